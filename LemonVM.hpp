@@ -1,6 +1,17 @@
 #pragma once
 
 #include "src/Defs.hpp"
+#include "src/Value.hpp"
 #include "src/InstructionSet.hpp"
 #include "src/Lexer.hpp"
 #include "src/Eval.hpp"
+#include "src/Fusion.hpp"
+#include "src/Optimize.hpp"
+#include "src/Register.hpp"
+#include "src/Compile.hpp"
+#include "src/Pool.hpp"
+#include "src/Tasks.hpp"
+#include "src/Async.hpp"
+#include "src/Jit.hpp"
+#include "src/Translate.hpp"
+#include "src/Static.hpp"
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "Eval.hpp"
+
+namespace LemonVM {
+
+using Post = std::function<void(std::coroutine_handle<>)>;
+
+struct Evaluation {
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        State state{State::ERR};
+        std::coroutine_handle<> continuation{};
+        Evaluation get_return_object() { return Evaluation{Handle::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(State result) { state = result; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Handle handle{};
+
+    explicit Evaluation(Handle h) : handle(h) {}
+    Evaluation(Evaluation&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Evaluation(const Evaluation&) = delete;
+    Evaluation& operator=(const Evaluation&) = delete;
+    ~Evaluation() { if (handle) handle.destroy(); }
+};
+
+std::coroutine_handle<> Evaluation::FinalAwaiter::await_suspend(Handle handle) noexcept {
+    if (handle.promise().continuation)
+        return handle.promise().continuation;
+    return std::noop_coroutine();
+}
+
+struct Reschedule {
+    const Post& post;
+    bool await_ready() noexcept { return !post; }
+    void await_suspend(std::coroutine_handle<> handle) { post(handle); }
+    void await_resume() noexcept {}
+};
+
+template<ValueType T>
+Evaluation eval_async(BasicVM<T>& vm, const Program& prg, std::uint64_t slice, Post post = {}) {
+    slice = std::max<std::uint64_t>(slice, 1);
+    State state = iset_eval_for(vm, prg, slice);
+    while (state == State::SUSPENDED || state == State::YIELD) {
+        co_await Reschedule{post};
+        state = iset_resume_for(vm, prg, slice);
+    }
+    co_return state;
+}
+
+void evaluation_start(Evaluation& ev) {
+    ev.handle.resume();
+}
+
+bool evaluation_done(const Evaluation& ev) {
+    return ev.handle.done();
+}
+
+State evaluation_state(const Evaluation& ev) {
+    return ev.handle.promise().state;
+}
+
+struct EvaluationAwaiter {
+    Evaluation::Handle handle{};
+    bool await_ready() noexcept { return handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    State await_resume() noexcept { return handle.promise().state; }
+};
+
+EvaluationAwaiter operator co_await(Evaluation& ev) {
+    return {ev.handle};
+}
+
+EvaluationAwaiter operator co_await(Evaluation&& ev) {
+    return {ev.handle};
+}
+
+}//ns
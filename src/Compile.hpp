@@ -2,21 +2,47 @@
 
 #include "Defs.hpp"
 #include "InstructionSet.hpp"
+#include "Eval.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LEMONVM_MMAP
+#endif
 
 namespace LemonVM {
 
 const std::array<std::uint8_t, 2> binary_password = {25, 01}; /*The net is vast and infinite*/
+const std::uint8_t binary_version = 1;
+const std::size_t binary_header_size = 11;
+const std::size_t binary_code_offset = 16;
 
 template<typename T>
 std::size_t stream_bytes(std::vector<std::uint8_t>& stream, const T t) {
-    std::uint8_t* tdata = static_cast<std::uint8_t>(t);
+    const std::uint8_t* tdata = reinterpret_cast<const std::uint8_t*>(&t);
     std::size_t i;
     for (i = 0; i < sizeof(T); i++)
         stream.push_back(tdata[i]);
     return i;
 }
 
-std::vector<std::uint8_t> generate_bytecode(const InstructionSet& iset) {
+std::size_t stream_string(std::vector<std::uint8_t>& stream, const std::string& str) {
+    std::size_t i = stream_bytes(stream, std::uint64_t(str.size()));
+    stream.insert(stream.end(), str.begin(), str.end());
+    return i + str.size();
+}
+
+std::size_t stream_bytecode(std::vector<std::uint8_t>& stream, const Bytecode& bc) {
+    std::size_t i = stream_bytes(stream, std::uint8_t(bc.opcode));
+    for (; i < offsetof(Bytecode, arg1); i++)
+        stream_bytes(stream, std::uint8_t(0));
+    return i + stream_bytes(stream, bc.arg1);
+}
+
+std::vector<std::uint8_t> generate_bytecode(const Program& prg) {
+    static_assert(std::endian::native == std::endian::little, "binaries are only supported on little endian hosts");
     std::vector<std::uint8_t> stream{};
     std::size_t i;
     /*Insert Password*/
@@ -24,21 +50,174 @@ std::vector<std::uint8_t> generate_bytecode(const InstructionSet& iset) {
         stream_bytes(stream, binary_password[i]);
 
     /*Insert Version*/
-    stream_bytes(stream, std::uint8_t(1));
+    stream_bytes(stream, binary_version);
     
-    /*Insert Program Size*/
-    for (i = 0; i < sizeof(std::size_t); i++)
+    /*Insert Program Size, patched in when the size is known*/
+    stream_bytes(stream, std::uint64_t(0));
+
+    /*Insert Padding*/
+    while (stream.size() < binary_code_offset)
         stream_bytes(stream, std::uint8_t(0));
- 
-    /*Insert Program Size*/
-    std::size_t size = 0;
-    for (auto ins: iset) {
-        auto bytecode = instruction_to_bytecode(ins);
-        stream.push_back(bytecode);
 
+    /*Insert Code*/
+    std::span<const Bytecode> code = program_code(prg);
+    stream_bytes(stream, std::uint64_t(code.size()));
+    for (auto bc: code)
+        stream_bytecode(stream, bc);
+
+    /*Insert Symbols*/
+    stream_bytes(stream, std::uint64_t(prg.symbols.size()));
+    for (auto& symbol: prg.symbols)
+        stream_string(stream, symbol);
+
+    /*Insert Labels*/
+    stream_bytes(stream, std::uint64_t(prg.labels.size()));
+    for (auto& [label, ip]: prg.labels) {
+        stream_string(stream, label);
+        stream_bytes(stream, std::uint64_t(ip));
+    }
+
+    /*Insert Functions*/
+    stream_bytes(stream, std::uint64_t(prg.functions.size()));
+    for (auto& fn: prg.functions) {
+        stream_string(stream, fn.name);
+        stream_bytes(stream, std::uint64_t(fn.entry));
+        stream_bytes(stream, std::uint64_t(fn.locals.size()));
+        for (auto& local: fn.locals)
+            stream_string(stream, local);
     }
 
+    const std::uint64_t size = stream.size() - binary_header_size;
+    std::memcpy(stream.data() + binary_password.size() + 1, &size, sizeof(size));
     return stream;
 }
 
+State write_bytecode(const std::string& path, const Program& prg) {
+    if (!is_linked(prg) || prg.value != VALUE_INT32)
+        return State::ERR;
+    const std::vector<std::uint8_t> stream = generate_bytecode(prg);
+    std::ofstream f(path, std::ios::binary);
+    f.write(reinterpret_cast<const char*>(stream.data()), stream.size());
+    return f ? State::OK : State::ERR;
+}
+
+struct ByteReader {
+    const std::uint8_t* data{nullptr};
+    std::size_t size{0};
+    std::size_t pos{0};
+    bool ok{true};
+};
+
+template<typename T>
+T read_bytes(ByteReader& reader) {
+    T t{};
+    if (!reader.ok || reader.size - reader.pos < sizeof(T)) {
+        reader.ok = false;
+        return t;
+    }
+    std::memcpy(&t, reader.data + reader.pos, sizeof(T));
+    reader.pos += sizeof(T);
+    return t;
+}
+
+std::string read_string(ByteReader& reader) {
+    const std::uint64_t length = read_bytes<std::uint64_t>(reader);
+    if (!reader.ok || reader.size - reader.pos < length) {
+        reader.ok = false;
+        return "";
+    }
+    std::string str(reinterpret_cast<const char*>(reader.data + reader.pos), length);
+    reader.pos += length;
+    return str;
+}
+
+std::size_t read_count(ByteReader& reader, std::size_t record) {
+    const std::uint64_t count = read_bytes<std::uint64_t>(reader);
+    if (!reader.ok || count > (reader.size - reader.pos) / record) {
+        reader.ok = false;
+        return 0;
+    }
+    return count;
+}
+
+bool known_opcodes(std::span<const Bytecode> code) {
+    return std::all_of(code.begin(), code.end(), [](Bytecode bc) { return bc.opcode < OPCODE_COUNT; });
+}
+
+State read_bytecode(const std::uint8_t* data, std::size_t size, std::shared_ptr<const void> owner, Program& prg) {
+    ByteReader reader{data, size, 0, true};
+    prg = Program{};
+    for (auto byte: binary_password) {
+        if (read_bytes<std::uint8_t>(reader) != byte)
+            return State::ERR;
+    }
+    if (read_bytes<std::uint8_t>(reader) != binary_version)
+        return State::ERR;
+    if (read_bytes<std::uint64_t>(reader) != size - binary_header_size || !reader.ok)
+        return State::ERR;
+    reader.pos = binary_code_offset;
+
+    const std::uint64_t count = read_bytes<std::uint64_t>(reader);
+    if (!reader.ok || (reader.size - reader.pos) / sizeof(Bytecode) < count)
+        return State::ERR;
+    const Bytecode* code = reinterpret_cast<const Bytecode*>(reader.data + reader.pos);
+    reader.pos += count * sizeof(Bytecode);
+
+    prg.symbols.resize(read_count(reader, sizeof(std::uint64_t)));
+    for (std::size_t i = 0; reader.ok && i < prg.symbols.size(); i++)
+        prg.symbols[i] = read_string(reader);
+
+    const std::size_t labels = read_count(reader, 2 * sizeof(std::uint64_t));
+    for (std::size_t i = 0; reader.ok && i < labels; i++) {
+        std::string label = read_string(reader);
+        prg.labels[label] = read_bytes<std::uint64_t>(reader);
+    }
+
+    prg.functions.resize(read_count(reader, 3 * sizeof(std::uint64_t)));
+    for (std::size_t i = 0; reader.ok && i < prg.functions.size(); i++) {
+        Function& fn = prg.functions[i];
+        fn.name = read_string(reader);
+        fn.entry = read_bytes<std::uint64_t>(reader);
+        fn.locals.resize(read_count(reader, sizeof(std::uint64_t)));
+        for (std::size_t j = 0; reader.ok && j < fn.locals.size(); j++)
+            fn.locals[j] = read_string(reader);
+    }
+
+    prg.image = std::shared_ptr<const Bytecode>(owner, code);
+    prg.image_size = count;
+    if (!reader.ok || !known_opcodes(program_code(prg)) || !verify_entries(prg)) {
+        prg = Program{};
+        return State::ERR;
+    }
+    prg.verification = program_verify(prg);
+    return State::OK;
+}
+
+State load_bytecode(const std::string& path, Program& prg) {
+#ifdef LEMONVM_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return State::ERR;
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return State::ERR;
+    }
+    const std::size_t size = st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return State::ERR;
+    std::shared_ptr<const void> owner(data, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+    return read_bytecode(static_cast<const std::uint8_t*>(data), size, owner, prg);
+#else
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        return State::ERR;
+    auto data = std::make_shared<std::vector<std::uint8_t>>(std::istreambuf_iterator<char>(f),
+                                                            std::istreambuf_iterator<char>());
+    return read_bytecode(data->data(), data->size(), data, prg);
+#endif
+}
+
 }//ns
@@ -6,6 +6,31 @@
 #include <fstream>
 #include <streambuf>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <array>
 #include <map>
+#include <unordered_map>
+#include <charconv>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <latch>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <initializer_list>
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <bit>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <coroutine>
+#include <limits>
+#include <utility>
+#include <limits>
+#include <type_traits>
@@ -3,33 +3,218 @@
 #include "InstructionSet.hpp"
 #include "Lexer.hpp"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/time.h>
+#define LEMONVM_SAMPLER_TIMER
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <unistd.h>
+#define LEMONVM_OUTPUT_FD
+#endif
+
 namespace LemonVM {
 
 using LabelMap = std::map<std::string, std::size_t>;
-using MemoryStack = std::vector<Arg>;
-using ReturnStack = std::vector<std::size_t>;
-using Scope = std::map<std::string, Arg>;
-using ScopeStack = std::vector<Scope>;
+
+template<ValueType T>
+struct BasicMemoryStack {
+    std::vector<T> slots{T{}};
+    std::size_t count{0};
+
+    BasicMemoryStack() = default;
+    BasicMemoryStack(std::initializer_list<T> values) : slots(values.size() + 1), count{values.size()} {
+        std::copy(values.begin(), values.end(), slots.begin() + 1);
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T* data() { return slots.data() + 1; }
+    const T* data() const { return slots.data() + 1; }
+    T* begin() { return data(); }
+    T* end() { return data() + count; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + count; }
+    const T* cbegin() const { return begin(); }
+    const T* cend() const { return end(); }
+    std::reverse_iterator<const T*> rbegin() const { return std::reverse_iterator<const T*>(end()); }
+    std::reverse_iterator<const T*> rend() const { return std::reverse_iterator<const T*>(begin()); }
+    T& operator[](std::size_t i) { return slots[i + 1]; }
+    const T& operator[](std::size_t i) const { return slots[i + 1]; }
+    T& back() { return slots[count]; }
+    const T& back() const { return slots[count]; }
+
+    /*Makes sure there are slots for size elements, growing at least twofold*/
+    void reserve(std::size_t size) {
+        if (slots.size() <= size)
+            slots.resize(std::max(size + 1, 2 * slots.size()));
+    }
+
+    void push_back(const T& value) {
+        reserve(count + 1);
+        slots[++count] = value;
+    }
+
+    void pop_back() {
+        count--;
+    }
+
+    void resize(std::size_t size) {
+        reserve(size);
+        if (size > count)
+            std::fill(end(), data() + size, T{});
+        count = size;
+    }
+
+    void clear() {
+        count = 0;
+    }
+
+    bool operator==(const BasicMemoryStack& other) const {
+        return std::equal(begin(), end(), other.begin(), other.end());
+    }
+};
+using MemoryStack = BasicMemoryStack<Arg>;
+
+struct Frame {
+    std::size_t ip{0};
+    std::size_t fp{0};
+};
+using ReturnStack = std::vector<Frame>;
+
+struct Bytecode {
+    Opcode opcode{OPCODE_NOP};
+    Arg arg1{0};
+};
+static_assert(sizeof(Bytecode) == 8, "Bytecode is expected to be packed into 8 bytes");
+static_assert(offsetof(Bytecode, arg1) == 4, "Bytecode is expected to have its operand at byte 4");
+
+using ByteCodes = std::vector<Bytecode>;
+using SymbolTable = std::vector<std::string>;
+
+struct Function {
+    std::string name{};
+    std::size_t entry{0};
+    std::vector<std::string> locals{};
+    std::size_t needs{0};
+    std::size_t max_stack{0};
+};
+using Functions = std::vector<Function>;
+
+struct LinkError {
+    std::size_t ip{0};
+    std::string label{};
+    std::size_t line{0};
+    std::size_t column{0};
+    const char* what{"unresolved symbol"};
+};
+using LinkErrors = std::vector<LinkError>;
+
+const std::int32_t no_height = std::numeric_limits<std::int32_t>::min();
+
+struct Verification {
+    bool verified{false};
+    bool recursive{false};
+    std::size_t max_depth{0};
+    std::size_t max_calls{0};
+    std::vector<std::int32_t> heights{};
+};
+
+struct Program {
+    ByteCodes code{};
+    SymbolTable symbols{};
+    Functions functions{};
+    LabelMap labels{};
+    LinkErrors errors{};
+    std::shared_ptr<const Bytecode> image{};
+    std::size_t image_size{0};
+    std::vector<std::uint64_t> constants{};
+    ValueKind value{VALUE_INT32};
+    Verification verification{};
+};
+
+const std::size_t no_ip = static_cast<std::size_t>(-1);
+
+std::span<const Bytecode> program_code(const Program& prg) {
+    if (prg.image)
+        return {prg.image.get(), prg.image_size};
+    return {prg.code.data(), prg.code.size()};
+}
+
+bool is_linked(const Program& prg) {
+    return prg.errors.empty();
+}
+
+template<ValueType T>
+Arg link_value(Program& prg, T value) {
+    if constexpr (std::is_same_v<T, Arg>) {
+        return value;
+    }
+    else {
+        prg.constants.push_back(std::bit_cast<std::uint64_t>(value));
+        return static_cast<Arg>(prg.constants.size() - 1);
+    }
+}
+
+template<ValueType T>
+T operand_value(const std::uint64_t* constants, Arg arg) {
+    if constexpr (std::is_same_v<T, Arg>)
+        return arg;
+    else
+        return std::bit_cast<T>(constants[arg]);
+}
 
 enum class State {
     ERR,
     OK,
     EXIT,
+    YIELD,
+    SUSPENDED,
 };
 
-struct VM {
+struct Sampler;
+struct Scheduler;
+template<ValueType T>
+struct BasicOutput;
+
+template<ValueType T>
+struct BasicVM {
     std::size_t ip{0};
-    Arg a{0};
-    Arg b{0};
+    T a{0};
+    T b{0};
 
-    MemoryStack stack{};
+    BasicMemoryStack<T> stack{};
 
     ReturnStack returnstack{};
 
-    ScopeStack scopestack{};
+    BasicMemoryStack<T> locals{};
+    std::size_t fp{0};
+
+    std::uint64_t steps{0};
+
+    Sampler* sampler{nullptr};
+
+    BasicOutput<T>* output{nullptr};
+
+    Scheduler* scheduler{nullptr};
 };
 
-std::string stack_dump(VM& vm, int width=80) {
+using VM = BasicVM<Arg>;
+using Int64VM = BasicVM<std::int64_t>;
+using DoubleVM = BasicVM<double>;
+using DynamicVM = BasicVM<Value>;
+
+Arg scheduler_spawn(Scheduler& sched, Arg function, Arg arg);
+State scheduler_join(Scheduler& sched, Arg task, Arg& result);
+
+template<ValueType T>
+std::string stack_dump(BasicVM<T>& vm, int width=80) {
     std::stringstream ss{};
     ss << "== VM Stack Dump Start ==";
     for (auto it = vm.stack.cbegin(); it != vm.stack.cend(); it++) {
@@ -41,166 +226,1095 @@ std::string stack_dump(VM& vm, int width=80) {
     return ss.str();
 }
 
-State ins_eval(VM& vm, const LabelMap& labels, const Instruction& ins)
+std::size_t function_end(const Program& prg, std::size_t fn) {
+    if (fn + 1 < prg.functions.size())
+        return prg.functions[fn + 1].entry;
+    return program_code(prg).size();
+}
+
+const Function& function_at(const Program& prg, std::size_t ip) {
+    auto it = std::upper_bound(prg.functions.begin(), prg.functions.end(), ip,
+                               [](std::size_t ip, const Function& fn) { return ip < fn.entry; });
+    return *std::prev(it);
+}
+
+struct StackEffect {
+    std::int32_t pops{0};
+    std::int32_t pushes{0};
+};
+
+constexpr StackEffect stack_effect(Opcode opcode) {
+    switch (opcode) {
+    case OPCODE_PUT:
+    case OPCODE_LOAD:
+        return {0, 1};
+    case OPCODE_DUPLAST:
+        return {1, 2};
+    case OPCODE_POP:
+    case OPCODE_STORE:
+    case OPCODE_WRITE:
+    case OPCODE_JMPIF:
+        return {1, 0};
+    case OPCODE_SWAP:
+        return {2, 2};
+    case OPCODE_PLUS:
+    case OPCODE_MINUS:
+    case OPCODE_MULTIPLY:
+    case OPCODE_DIVIDE:
+    case OPCODE_EQ:
+    case OPCODE_CMP:
+        return {2, 1};
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        return {2, 0};
+    case OPCODE_ADDI:
+    case OPCODE_SUBI:
+    case OPCODE_MULI:
+    case OPCODE_SQUARE:
+    case OPCODE_SPAWN:
+    case OPCODE_JOIN:
+        return {1, 1};
+    default:
+        return {0, 0};
+    }
+}
+
+bool verify_entries(const Program& prg) {
+    const std::size_t size = program_code(prg).size();
+    if (prg.functions.empty() || prg.functions.front().entry != 0)
+        return false;
+    for (std::size_t fn = 0; fn < prg.functions.size(); fn++) {
+        if (prg.functions[fn].entry > size || (fn > 0 && prg.functions[fn].entry <= prg.functions[fn - 1].entry))
+            return false;
+    }
+    return true;
+}
+
+bool verify_function(Program& prg, std::size_t fn, const std::vector<std::int32_t>& effects,
+                     std::vector<std::int32_t>& heights, std::int32_t& effect)
 {
-    switch (ins.opcode) {
+    std::span<const Bytecode> code = program_code(prg);
+    Function& f = prg.functions[fn];
+    const std::size_t end = function_end(prg, fn);
+    std::int64_t needs = 0;
+    std::int32_t max = 0;
+    std::fill(heights.begin() + f.entry, heights.begin() + end, no_height);
+    std::vector<std::size_t> work{};
+    auto flow = [&](std::size_t to, std::int32_t height) {
+        if (to == code.size())
+            return true;
+        if (to < f.entry || to >= end)
+            return false;
+        if (heights[to] == no_height) {
+            heights[to] = height;
+            work.push_back(to);
+        }
+        return heights[to] == height;
+    };
 
-    case OPCODE_COUNT:
-    case OPCODE_INVALID:
-    case OPCODE_EXIT:
-        return State::EXIT;
+    flow(f.entry, 0);
+    while (!work.empty()) {
+        const std::size_t ip = work.back();
+        work.pop_back();
+        const Bytecode bc = code[ip];
+        const std::int32_t height = heights[ip];
+        if (bc.opcode >= OPCODE_COUNT)
+            return false;
+        const StackEffect e = stack_effect(bc.opcode);
+        std::int64_t need = e.pops;
+        std::int32_t next = height - e.pops + e.pushes;
+        switch (bc.opcode) {
+        case OPCODE_INVALID:
+        case OPCODE_EXIT:
+            continue;
+        case OPCODE_RETURN:
+            if (effect != no_height && effect != height)
+                return false;
+            effect = height;
+            continue;
+        case OPCODE_JMP:
+            if (bc.arg1 < 0 || !flow(bc.arg1, height))
+                return false;
+            continue;
+        case OPCODE_DUP:
+            if (bc.arg1 < 0)
+                return false;
+            need = std::int64_t{bc.arg1} + 1;
+            next = height + 1;
+            break;
+        case OPCODE_CALL:
+        case OPCODE_SPAWN:
+            if (bc.arg1 < 0 || static_cast<std::size_t>(bc.arg1) >= prg.functions.size())
+                return false;
+            if (bc.opcode == OPCODE_SPAWN)
+                break;
+            needs = std::max(needs, static_cast<std::int64_t>(prg.functions[bc.arg1].needs) - height);
+            if (effects[bc.arg1] == no_height)
+                continue;
+            need = 0;
+            next = height + effects[bc.arg1];
+            break;
+        case OPCODE_VAR:
+        case OPCODE_LOAD:
+        case OPCODE_STORE:
+        case OPCODE_INCVAR:
+            if (bc.arg1 < 0 || static_cast<std::size_t>(bc.arg1) >= f.locals.size())
+                return false;
+            break;
+        case OPCODE_LABEL:
+            if (bc.arg1 < 0 || static_cast<std::size_t>(bc.arg1) >= prg.symbols.size())
+                return false;
+            break;
+        case OPCODE_JMPIF:
+        case OPCODE_JNE:
+        case OPCODE_JEQ:
+            if (bc.arg1 < 0 || !flow(bc.arg1, next))
+                return false;
+            break;
+        default:
+            break;
+        }
+        needs = std::max(needs, need - height);
+        max = std::max(max, next);
+        if (!flow(ip + 1, next))
+            return false;
+    }
+    f.needs = static_cast<std::size_t>(needs);
+    f.max_stack = static_cast<std::size_t>(max);
+    return true;
+}
 
-    case OPCODE_LABEL: 
-    case OPCODE_NOP: 
-        break;
+bool verify_functions(Program& prg, std::vector<std::int32_t>& heights) {
+    std::vector<std::int32_t> effects(prg.functions.size(), no_height);
+    for (std::size_t round = 0; round < 2 * prg.functions.size() + 2; round++) {
+        bool changed = false;
+        for (std::size_t fn = 0; fn < prg.functions.size(); fn++) {
+            const std::size_t needs = prg.functions[fn].needs;
+            const std::size_t max_stack = prg.functions[fn].max_stack;
+            std::int32_t effect = effects[fn];
+            if (!verify_function(prg, fn, effects, heights, effect))
+                return false;
+            changed = changed || effect != effects[fn] || needs != prg.functions[fn].needs
+                || max_stack != prg.functions[fn].max_stack;
+            effects[fn] = effect;
+        }
+        if (!changed)
+            return true;
+    }
+    return false;
+}
 
-    case OPCODE_PUT: 
-        vm.stack.push_back(ins.arg1);
-        break;
+struct VerifyDepth {
+    std::size_t stack{0};
+    std::size_t calls{0};
+};
 
-    case OPCODE_POP:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        break;
+bool verify_depth(const Program& prg, const std::vector<std::int32_t>& heights, std::size_t fn,
+                  std::vector<int>& visiting, std::vector<VerifyDepth>& depths)
+{
+    if (visiting[fn] == 1)
+        return false;
+    if (visiting[fn] == 2)
+        return true;
+    visiting[fn] = 1;
+    std::span<const Bytecode> code = program_code(prg);
+    VerifyDepth depth{prg.functions[fn].max_stack, 0};
+    for (std::size_t ip = prg.functions[fn].entry; ip < function_end(prg, fn); ip++) {
+        if (code[ip].opcode != OPCODE_CALL || heights[ip] == no_height)
+            continue;
+        if (!verify_depth(prg, heights, code[ip].arg1, visiting, depths))
+            return false;
+        const VerifyDepth& callee = depths[code[ip].arg1];
+        depth.stack = std::max<std::size_t>(depth.stack, std::max(heights[ip], 0) + callee.stack);
+        depth.calls = std::max(depth.calls, callee.calls + 1);
+    }
+    depths[fn] = depth;
+    visiting[fn] = 2;
+    return true;
+}
 
-    case OPCODE_JMPIF:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        if (vm.a != 0) {
-            vm.ip = labels.at(ins.label);
-            goto CONTEXT_CHANGE;
+Verification program_verify(Program& prg) {
+    Verification v{};
+    for (auto& fn: prg.functions)
+        fn.needs = fn.max_stack = 0;
+    v.heights.assign(program_code(prg).size(), no_height);
+    if (!is_linked(prg) || !verify_entries(prg) || !verify_functions(prg, v.heights)) {
+        v.heights.clear();
+        return v;
+    }
+    v.verified = true;
+    std::vector<int> visiting(prg.functions.size(), 0);
+    std::vector<VerifyDepth> depths(prg.functions.size());
+    v.recursive = !verify_depth(prg, v.heights, 0, visiting, depths);
+    if (!v.recursive) {
+        v.max_depth = depths[0].stack;
+        v.max_calls = depths[0].calls;
+    }
+    return v;
+}
+
+template<ValueType T>
+std::size_t verified_room(const BasicVM<T>& vm, const Program& prg) {
+    const Verification& v = prg.verification;
+    if (!v.verified)
+        return 0;
+    if (vm.ip >= v.heights.size())
+        return 1;
+    const std::int64_t top = static_cast<std::int64_t>(vm.stack.size());
+    std::int64_t height = v.heights[vm.ip];
+    const Function* fn = &function_at(prg, vm.ip);
+    std::int64_t base = top - height;
+    if (height == no_height || base < static_cast<std::int64_t>(fn->needs))
+        return 0;
+    std::int64_t room = base + static_cast<std::int64_t>(fn->max_stack) - top;
+    for (auto it = vm.returnstack.rbegin(); it != vm.returnstack.rend() && it->ip < v.heights.size(); it++) {
+        height = v.heights[it->ip];
+        if (height == no_height)
+            return 0;
+        base -= height;
+        fn = &function_at(prg, it->ip);
+        room = std::max(room, base + static_cast<std::int64_t>(fn->max_stack) - top);
+    }
+    if (!v.recursive && fn == &prg.functions.front())
+        room = std::max(room, base + static_cast<std::int64_t>(v.max_depth) - top);
+    return static_cast<std::size_t>(std::max<std::int64_t>(room, 0)) + 1;
+}
+
+struct FunctionProfile {
+    std::uint64_t calls{0};
+    std::uint64_t steps{0};
+    std::uint64_t inclusive{0};
+    std::uint64_t exclusive{0};
+};
+
+struct ProfileFrame {
+    std::size_t function{0};
+    std::uint64_t entered{0};
+};
+
+struct Profile {
+    std::array<std::uint64_t, OPCODE_COUNT> opcodes{};
+    std::vector<std::uint64_t> instructions{};
+    std::vector<FunctionProfile> functions{};
+    std::vector<ProfileFrame> frames{};
+    std::vector<std::uint32_t> active{};
+    std::uint64_t last{0};
+};
+
+std::uint64_t profile_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void profile_enter(Profile& prof, std::size_t fn) {
+    const std::uint64_t now = profile_clock();
+    if (!prof.frames.empty())
+        prof.functions[prof.frames.back().function].exclusive += now - prof.last;
+    prof.last = now;
+    prof.functions[fn].calls++;
+    prof.active[fn]++;
+    prof.frames.push_back({fn, now});
+}
+
+void profile_leave(Profile& prof) {
+    const std::uint64_t now = profile_clock();
+    const ProfileFrame top = prof.frames.back();
+    prof.functions[top.function].exclusive += now - prof.last;
+    prof.last = now;
+    if (--prof.active[top.function] == 0)
+        prof.functions[top.function].inclusive += now - top.entered;
+    prof.frames.pop_back();
+}
+
+void profile_begin(Profile& prof, const Program& prg) {
+    prof.instructions.resize(program_code(prg).size());
+    prof.functions.resize(prg.functions.size());
+    prof.active.assign(prg.functions.size(), 0);
+    prof.frames.clear();
+    profile_enter(prof, 0);
+}
+
+void profile_end(Profile& prof) {
+    while (!prof.frames.empty())
+        profile_leave(prof);
+}
+
+void profile_step(Profile& prof, std::size_t ip, Opcode opcode) {
+    prof.opcodes[opcode]++;
+    prof.instructions[ip]++;
+    prof.functions[prof.frames.back().function].steps++;
+}
+
+struct Sampler {
+    std::uint64_t interval{0};
+    std::atomic<bool> enabled{true};
+    std::atomic<bool> requested{false};
+    std::uint64_t next{0};
+    std::uint64_t samples{0};
+    std::map<std::vector<std::size_t>, std::uint64_t> stacks{};
+    const Bytecode* code{nullptr};
+    std::vector<std::size_t> label_ips{};
+};
+
+bool sampler_due(Sampler& sampler, std::uint64_t steps) {
+    if (!sampler.enabled.load(std::memory_order_relaxed))
+        return false;
+    if (sampler.requested.load(std::memory_order_relaxed))
+        return true;
+    if (sampler.interval == 0)
+        return false;
+    if (sampler.next == 0)
+        sampler.next = steps + sampler.interval;
+    return steps >= sampler.next;
+}
+
+std::size_t sampler_label_of(const Sampler& sampler, std::size_t ip) {
+    auto it = std::upper_bound(sampler.label_ips.begin(), sampler.label_ips.end(), ip);
+    if (it == sampler.label_ips.begin())
+        return no_ip;
+    return *--it;
+}
+
+template<ValueType T>
+void sampler_sample(Sampler& sampler, const BasicVM<T>& vm, const Program& prg) {
+    std::span<const Bytecode> code = program_code(prg);
+    if (sampler.code != code.data()) {
+        sampler.code = code.data();
+        sampler.label_ips.clear();
+        for (std::size_t ip = 0; ip < code.size(); ip++) {
+            if (code[ip].opcode == OPCODE_LABEL)
+                sampler.label_ips.push_back(ip);
         }
-        break;
+    }
 
-    case OPCODE_CALL:
-        vm.returnstack.push_back(vm.ip);
-        vm.ip = labels.at(ins.label);
-        goto CONTEXT_CHANGE;
-
-    case OPCODE_RETURN:
-        if (vm.stack.empty())
-            return State::EXIT;
-        vm.a = vm.returnstack.back();
+    std::vector<std::size_t> stack{};
+    stack.reserve(vm.returnstack.size() + 1);
+    for (auto& frame: vm.returnstack)
+        stack.push_back(sampler_label_of(sampler, frame.ip));
+    stack.push_back(sampler_label_of(sampler, vm.ip));
+    sampler.stacks[stack]++;
+    sampler.samples++;
+}
+
+template<ValueType T>
+void sampler_safepoint(BasicVM<T>& vm, const Program& prg, std::uint64_t steps) {
+    Sampler& sampler = *vm.sampler;
+    if (!sampler_due(sampler, steps))
+        return;
+    sampler_sample(sampler, vm, prg);
+    sampler.requested.store(false, std::memory_order_relaxed);
+    sampler.next = steps + sampler.interval;
+}
+
+std::string sampler_folded(const Sampler& sampler, const Program& prg) {
+    std::span<const Bytecode> code = program_code(prg);
+    auto name = [&](std::size_t ip) -> std::string {
+        if (ip < code.size() && code[ip].opcode == OPCODE_LABEL)
+            return prg.symbols[code[ip].arg1];
+        if (prg.functions.empty() || prg.functions.front().name.empty())
+            return "<entry>";
+        return prg.functions.front().name;
+    };
+    std::stringstream ss{};
+    for (auto& [stack, count]: sampler.stacks) {
+        for (std::size_t i = 0; i < stack.size(); i++)
+            ss << (i ? ";" : "") << name(stack[i]);
+        ss << " " << count << "\n";
+    }
+    return ss.str();
+}
+
+#ifdef LEMONVM_SAMPLER_TIMER
+inline std::atomic<Sampler*> sampler_timer_target{nullptr};
+
+void sampler_timer_handler(int) {
+    Sampler* sampler = sampler_timer_target.load();
+    if (sampler)
+        sampler->requested.store(true, std::memory_order_relaxed);
+}
+
+State sampler_timer_start(Sampler& sampler, std::chrono::microseconds period) {
+    sampler_timer_target.store(&sampler);
+    struct sigaction action{};
+    action.sa_handler = sampler_timer_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0)
+        return State::ERR;
+    itimerval timer{};
+    timer.it_interval.tv_sec = period.count() / 1000000;
+    timer.it_interval.tv_usec = period.count() % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0)
+        return State::ERR;
+    return State::OK;
+}
+
+void sampler_timer_stop() {
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sampler_timer_target.store(nullptr);
+}
+#endif
+
+enum OutputKind : std::uint8_t {
+    OUTPUT_FD,
+    OUTPUT_VECTOR,
+    OUTPUT_BINARY,
+};
+
+const std::size_t output_capacity = 1 << 16;
+
+template<ValueType T>
+struct BasicOutput {
+    OutputKind kind{OUTPUT_FD};
+    int fd{1};
+    std::vector<char> buffer{};
+    std::size_t used{0};
+    std::vector<T> values{};
+    std::uint64_t written{0};
+    bool failed{false};
+};
+
+using Output = BasicOutput<Arg>;
+
+template<ValueType T = Arg>
+BasicOutput<T> output_fd(int fd = 1, std::size_t capacity = output_capacity) {
+    BasicOutput<T> out{};
+    out.fd = fd;
+    out.buffer.resize(std::max<std::size_t>(capacity, 64));
+    return out;
+}
+
+template<ValueType T = Arg>
+BasicOutput<T> output_vector() {
+    BasicOutput<T> out{};
+    out.kind = OUTPUT_VECTOR;
+    return out;
+}
+
+template<ValueType T = Arg>
+BasicOutput<T> output_binary(int fd, std::size_t capacity = output_capacity) {
+    BasicOutput<T> out = output_fd<T>(fd, capacity);
+    out.kind = OUTPUT_BINARY;
+    return out;
+}
+
+template<ValueType T>
+State output_flush(BasicOutput<T>& out) {
+    const char* data = out.buffer.data();
+    std::size_t left = out.used;
+    out.used = 0;
+#ifdef LEMONVM_OUTPUT_FD
+    while (left > 0) {
+        const ssize_t n = ::write(out.fd, data, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            out.failed = true;
+            return State::ERR;
+        }
+        data += n;
+        left -= n;
+    }
+#else
+    if (left > 0 && std::fwrite(data, 1, left, out.fd == 2 ? stderr : stdout) != left) {
+        out.failed = true;
+        return State::ERR;
+    }
+#endif
+    return State::OK;
+}
+
+template<ValueType T>
+void output_value(BasicOutput<T>& out, T value) {
+    using std::to_chars;
+    const std::size_t room = out.kind == OUTPUT_BINARY ? sizeof(T) : 33;
+    out.written++;
+    if (out.kind == OUTPUT_VECTOR) {
+        out.values.push_back(value);
+        return;
+    }
+    if (out.buffer.size() - out.used < room)
+        output_flush(out);
+    char* first = out.buffer.data() + out.used;
+    if (out.kind == OUTPUT_BINARY) {
+        std::memcpy(first, &value, sizeof(T));
+        out.used += sizeof(T);
+        return;
+    }
+    auto [ptr, ec] = to_chars(first, first + room - 1, value);
+    *ptr++ = '\n';
+    out.used = ptr - out.buffer.data();
+}
+
+template<ValueType T>
+State output_end(BasicVM<T>& vm, State state) {
+    if (!vm.output || state == State::YIELD || state == State::SUSPENDED)
+        return state;
+    if (output_flush(*vm.output) != State::OK || vm.output->failed)
+        return State::ERR;
+    return state;
+}
+
+#if !defined(LEMONVM_DISPATCH_SWITCH) && (defined(__GNUC__) || defined(__clang__))
+#define LEMONVM_COMPUTED_GOTO
+#endif
+
+#ifdef LEMONVM_COMPUTED_GOTO
+#define LEMONVM_CASE(OP) OP##_HANDLER:
+#define LEMONVM_DEFAULT()
+#define LEMONVM_DISPATCH()                    \
+    {                                         \
+        if (vm.ip >= size)                    \
+            LEMONVM_RETURN(State::OK);        \
+        LEMONVM_BUDGET();                     \
+        ins = code[vm.ip];                    \
+        steps++;                              \
+        LEMONVM_PROFILE(profile_step(*profile, vm.ip, ins.opcode)); \
+        goto *dispatch_table[ins.opcode];     \
+    }
+#else
+#define LEMONVM_CASE(OP) case OP:
+#define LEMONVM_DEFAULT() default:
+#define LEMONVM_DISPATCH() continue
+#endif
+
+#define LEMONVM_NEXT() { vm.ip++; LEMONVM_DISPATCH(); }
+#define LEMONVM_JUMP() { LEMONVM_SAFEPOINT(); LEMONVM_DISPATCH(); }
+
+#define LEMONVM_SAFEPOINT()                                    \
+    {                                                          \
+        if (vm.sampler) [[unlikely]]                           \
+            sampler_safepoint(vm, prg, steps);                 \
+    }
+
+enum EvalFlags : unsigned {
+    EVAL_DEFAULT = 0,
+    EVAL_PROFILE = 1 << 0,
+    EVAL_BUDGET  = 1 << 1,
+    EVAL_CHECKED = 1 << 2,
+    EVAL_STOP    = 1 << 3,
+};
+
+#define LEMONVM_PROFILE(HOOK) { if constexpr ((Flags & EVAL_PROFILE) != 0) { HOOK; } }
+
+#define LEMONVM_CHECKED(CHECK)  { if constexpr ((Flags & EVAL_CHECKED) != 0) { CHECK; } }
+#define LEMONVM_UNCHECKED(CODE) { if constexpr ((Flags & EVAL_CHECKED) == 0) { CODE; } }
+
+#define LEMONVM_NEED(N)                                                        \
+    LEMONVM_CHECKED(if (LEMONVM_DEPTH() < (N)) [[unlikely]] LEMONVM_RETURN(State::ERR))
+
+#define LEMONVM_NEED_SLOT(I)                                                   \
+    LEMONVM_CHECKED(if (static_cast<std::uint32_t>(I) >= vm.locals.size() - vm.fp) [[unlikely]] \
+                        LEMONVM_RETURN(State::ERR))
+
+#define LEMONVM_NEED_FUNCTION(I)                                               \
+    LEMONVM_CHECKED(if (static_cast<std::uint32_t>(I) >= prg.functions.size()) [[unlikely]] \
+                        LEMONVM_RETURN(State::ERR))
+
+#define LEMONVM_BUDGET()                                       \
+    {                                                          \
+        if constexpr ((Flags & EVAL_BUDGET) != 0) {            \
+            if (steps == limit) [[unlikely]]                   \
+                LEMONVM_RETURN(State::SUSPENDED);              \
+        }                                                      \
+        if constexpr ((Flags & EVAL_STOP) != 0) {              \
+            if (stops[vm.ip] && steps != start) [[unlikely]]   \
+                LEMONVM_RETURN(State::SUSPENDED);              \
+        }                                                      \
+    }
+
+using DispatchTable = std::array<const void*, 256>;
+
+DispatchTable dispatch_table_new(const void* invalid,
+                                 std::initializer_list<std::pair<Opcode, const void*>> handlers)
+{
+    DispatchTable table{};
+    table.fill(invalid);
+    for (auto [opcode, handler]: handlers)
+        table[opcode] = handler;
+    return table;
+}
+
+#ifndef LEMONVM_NO_TOS_CACHE
+#define LEMONVM_TOS_CACHE
+#endif
+
+#ifdef LEMONVM_TOS_CACHE
+#define LEMONVM_STACK_LOAD()                                                 \
+    const std::size_t loaded_depth = vm.stack.size();                        \
+    vm.stack.reserve(std::max<std::size_t>(2 * loaded_depth + 1, 63));       \
+    T* stack_base = vm.stack.slots.data();                                   \
+    T* stack_end = stack_base + vm.stack.slots.size();                       \
+    T* sp = stack_base + loaded_depth;                                       \
+    T tos = *sp
+
+#define LEMONVM_STACK_SPILL()                                                \
+    {                                                                        \
+        *sp = tos;                                                           \
+        vm.stack.count = sp - stack_base;                                    \
+        vm.a = a;                                                            \
+        vm.b = b;                                                            \
+    }
+
+#define LEMONVM_STACK_GROW()                                                 \
+    {                                                                        \
+        const std::size_t depth = sp - stack_base;                           \
+        vm.stack.slots.resize(vm.stack.slots.size() * 2);                    \
+        stack_base = vm.stack.slots.data();                                  \
+        stack_end = stack_base + vm.stack.slots.size();                      \
+        sp = stack_base + depth;                                             \
+    }
+
+#define LEMONVM_RESERVE(N)                                                   \
+    {                                                                        \
+        while (stack_end - sp <= static_cast<std::ptrdiff_t>(N))            \
+            LEMONVM_STACK_GROW();                                            \
+    }
+
+#define LEMONVM_PUSH(V)                                                      \
+    {                                                                        \
+        const T pushed = (V);                                                \
+        if constexpr ((Flags & EVAL_CHECKED) != 0) {                         \
+            if (sp + 1 == stack_end)                                         \
+                LEMONVM_STACK_GROW();                                        \
+        }                                                                    \
+        *sp++ = tos;                                                         \
+        tos = pushed;                                                        \
+    }
+
+#define LEMONVM_POP()    (popped = tos, tos = *--sp, popped)
+#define LEMONVM_TOP()    tos
+#define LEMONVM_SECOND() sp[-1]
+#define LEMONVM_AT(I)    (stack_base + 1 + (I) == sp ? tos : stack_base[1 + (I)])
+#define LEMONVM_DEPTH()  static_cast<std::size_t>(sp - stack_base)
+
+#else
+#define LEMONVM_STACK_LOAD() (void)popped
+#define LEMONVM_STACK_SPILL() { vm.a = a; vm.b = b; }
+#define LEMONVM_RESERVE(N) (void)(N)
+#define LEMONVM_PUSH(V)  vm.stack.push_back(V)
+#define LEMONVM_POP()    (popped = vm.stack.back(), vm.stack.pop_back(), popped)
+#define LEMONVM_TOP()    vm.stack.back()
+#define LEMONVM_SECOND() vm.stack[vm.stack.size() - 2]
+#define LEMONVM_AT(I)    vm.stack[I]
+#define LEMONVM_DEPTH()  vm.stack.size()
+#endif
+
+#define LEMONVM_RETURN(STATE)                    \
+    {                                            \
+        LEMONVM_STACK_SPILL();                   \
+        vm.steps = steps;                        \
+        LEMONVM_PROFILE(profile_end(*profile));  \
+        return output_end(vm, STATE);            \
+    }
+
+template<ValueType T>
+void value_write(BasicVM<T>& vm, T value) {
+    using std::to_chars;
+    if (vm.output) {
+        output_value(*vm.output, value);
+        return;
+    }
+    std::array<char, 32> buf{};
+    auto [ptr, ec] = to_chars(buf.data(), buf.data() + buf.size(), value);
+    printf("[stdout] -> %.*s\n", static_cast<int>(ptr - buf.data()), buf.data());
+}
+
+template<ValueType T>
+constexpr T value_add(T a, T b) {
+    if constexpr (std::is_integral_v<T>)
+        return static_cast<T>(static_cast<std::make_unsigned_t<T>>(a) + static_cast<std::make_unsigned_t<T>>(b));
+    else
+        return a + b;
+}
+
+template<ValueType T>
+constexpr T value_sub(T a, T b) {
+    if constexpr (std::is_integral_v<T>)
+        return static_cast<T>(static_cast<std::make_unsigned_t<T>>(a) - static_cast<std::make_unsigned_t<T>>(b));
+    else
+        return a - b;
+}
+
+template<ValueType T>
+constexpr T value_mul(T a, T b) {
+    if constexpr (std::is_integral_v<T>)
+        return static_cast<T>(static_cast<std::make_unsigned_t<T>>(a) * static_cast<std::make_unsigned_t<T>>(b));
+    else
+        return a * b;
+}
+
+template<unsigned Flags, ValueType T>
+State iset_eval_engine(BasicVM<T>& vm, const Program& prg, [[maybe_unused]] Profile* profile,
+                       [[maybe_unused]] std::uint64_t budget, [[maybe_unused]] std::size_t room,
+                       [[maybe_unused]] const std::uint8_t* stops = nullptr)
+{
+    if (!is_linked(prg) || prg.value != value_kind<T>())
+        return State::ERR;
+    LEMONVM_PROFILE(profile_begin(*profile, prg));
+    const Bytecode* code = program_code(prg).data();
+    const std::size_t size = program_code(prg).size();
+    [[maybe_unused]] const std::uint64_t* constants = prg.constants.data();
+    Bytecode ins{};
+    T a{vm.a};
+    T b{vm.b};
+    T popped{};
+    std::uint64_t steps{vm.steps};
+    [[maybe_unused]] const std::uint64_t limit = steps + budget;
+    [[maybe_unused]] const std::uint64_t start = steps;
+    LEMONVM_STACK_LOAD();
+    LEMONVM_UNCHECKED(LEMONVM_RESERVE(room));
+    T* frame = vm.locals.data() + vm.fp;
+
+#ifdef LEMONVM_COMPUTED_GOTO
+    static const DispatchTable dispatch_table = dispatch_table_new(&&OPCODE_INVALID_HANDLER, {
+        {OPCODE_EXIT,     &&OPCODE_EXIT_HANDLER},
+        {OPCODE_NOP,      &&OPCODE_NOP_HANDLER},
+        {OPCODE_PUT,      &&OPCODE_PUT_HANDLER},
+        {OPCODE_POP,      &&OPCODE_POP_HANDLER},
+        {OPCODE_DUP,      &&OPCODE_DUP_HANDLER},
+        {OPCODE_DUPLAST,  &&OPCODE_DUPLAST_HANDLER},
+        {OPCODE_SWAP,     &&OPCODE_SWAP_HANDLER},
+        {OPCODE_LABEL,    &&OPCODE_LABEL_HANDLER},
+        {OPCODE_JMP,      &&OPCODE_JMP_HANDLER},
+        {OPCODE_JMPIF,    &&OPCODE_JMPIF_HANDLER},
+        {OPCODE_CALL,     &&OPCODE_CALL_HANDLER},
+        {OPCODE_RETURN,   &&OPCODE_RETURN_HANDLER},
+        {OPCODE_SPAWN,    &&OPCODE_SPAWN_HANDLER},
+        {OPCODE_JOIN,     &&OPCODE_JOIN_HANDLER},
+        {OPCODE_YIELD,    &&OPCODE_YIELD_HANDLER},
+        {OPCODE_PLUS,     &&OPCODE_PLUS_HANDLER},
+        {OPCODE_MINUS,    &&OPCODE_MINUS_HANDLER},
+        {OPCODE_MULTIPLY, &&OPCODE_MULTIPLY_HANDLER},
+        {OPCODE_DIVIDE,   &&OPCODE_DIVIDE_HANDLER},
+        {OPCODE_VAR,      &&OPCODE_VAR_HANDLER},
+        {OPCODE_LOAD,     &&OPCODE_LOAD_HANDLER},
+        {OPCODE_STORE,    &&OPCODE_STORE_HANDLER},
+        {OPCODE_CMP,      &&OPCODE_CMP_HANDLER},
+        {OPCODE_EQ,       &&OPCODE_EQ_HANDLER},
+        {OPCODE_WRITE,    &&OPCODE_WRITE_HANDLER},
+        {OPCODE_ADDI,     &&OPCODE_ADDI_HANDLER},
+        {OPCODE_SUBI,     &&OPCODE_SUBI_HANDLER},
+        {OPCODE_MULI,     &&OPCODE_MULI_HANDLER},
+        {OPCODE_SQUARE,   &&OPCODE_SQUARE_HANDLER},
+        {OPCODE_JNE,      &&OPCODE_JNE_HANDLER},
+        {OPCODE_JEQ,      &&OPCODE_JEQ_HANDLER},
+        {OPCODE_INCVAR,   &&OPCODE_INCVAR_HANDLER},
+        {OPCODE_COUNT,    &&OPCODE_COUNT_HANDLER},
+    });
+    LEMONVM_DISPATCH();
+#else
+    for (;;) {
+        if (vm.ip >= size)
+            LEMONVM_RETURN(State::OK);
+        LEMONVM_BUDGET();
+        ins = code[vm.ip];
+        steps++;
+        LEMONVM_PROFILE(profile_step(*profile, vm.ip, ins.opcode));
+        switch (ins.opcode) {
+#endif
+
+    LEMONVM_CASE(OPCODE_EXIT)
+        LEMONVM_RETURN(State::EXIT);
+
+    LEMONVM_DEFAULT()
+    LEMONVM_CASE(OPCODE_COUNT)
+    LEMONVM_CASE(OPCODE_INVALID)
+        LEMONVM_RETURN(State::ERR);
+
+    LEMONVM_CASE(OPCODE_LABEL)
+    LEMONVM_CASE(OPCODE_NOP)
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_PUT)
+        LEMONVM_PUSH(operand_value<T>(constants, ins.arg1));
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_POP)
+        LEMONVM_NEED(1);
+        a = LEMONVM_POP();
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_JMP)
+        vm.ip = ins.arg1;
+        LEMONVM_JUMP();
+
+    LEMONVM_CASE(OPCODE_JMPIF)
+        LEMONVM_NEED(1);
+        a = LEMONVM_POP();
+        if (a != 0) {
+            vm.ip = ins.arg1;
+            LEMONVM_JUMP();
+        }
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_CALL)
+    {
+        LEMONVM_NEED_FUNCTION(ins.arg1);
+        const Function& fn = prg.functions[ins.arg1];
+        LEMONVM_UNCHECKED(LEMONVM_RESERVE(fn.max_stack));
+        vm.returnstack.push_back({vm.ip, vm.fp});
+        LEMONVM_PROFILE(profile_enter(*profile, ins.arg1));
+        vm.fp = vm.locals.size();
+        vm.locals.resize(vm.fp + fn.locals.size());
+        frame = vm.locals.data() + vm.fp;
+        vm.ip = fn.entry;
+        LEMONVM_JUMP();
+    }
+
+    LEMONVM_CASE(OPCODE_RETURN)
+        if (vm.returnstack.empty())
+            LEMONVM_RETURN(State::EXIT);
+        vm.locals.resize(vm.fp);
+        vm.ip = vm.returnstack.back().ip;
+        vm.fp = vm.returnstack.back().fp;
         vm.returnstack.pop_back();
-        vm.ip = vm.a;
-        break;
-        goto CONTEXT_CHANGE;
+        LEMONVM_PROFILE(profile_leave(*profile));
+        frame = vm.locals.data() + vm.fp;
+        LEMONVM_NEXT();
 
-    case OPCODE_VAR:
-        vm.scopestack.back().insert({ins.label, 0});
-        break;
+    LEMONVM_CASE(OPCODE_SPAWN)
+        LEMONVM_NEED(1);
+        LEMONVM_NEED_FUNCTION(ins.arg1);
+        if constexpr (std::is_same_v<T, Arg>) {
+            if (!vm.scheduler)
+                LEMONVM_RETURN(State::ERR);
+            LEMONVM_TOP() = scheduler_spawn(*vm.scheduler, ins.arg1, LEMONVM_TOP());
+            LEMONVM_NEXT();
+        }
+        LEMONVM_RETURN(State::ERR);
 
-    case OPCODE_STORE:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.scopestack.back().insert({ins.label, vm.a});
-        break;
+    LEMONVM_CASE(OPCODE_JOIN)
+        LEMONVM_NEED(1);
+        if constexpr (std::is_same_v<T, Arg>) {
+            if (!vm.scheduler)
+                LEMONVM_RETURN(State::ERR);
+            const State joined = scheduler_join(*vm.scheduler, LEMONVM_TOP(), a);
+            if (joined == State::YIELD)
+                steps--;
+            if (joined != State::OK)
+                LEMONVM_RETURN(joined);
+            LEMONVM_TOP() = a;
+            LEMONVM_NEXT();
+        }
+        LEMONVM_RETURN(State::ERR);
 
-    case OPCODE_LOAD:
-        vm.a = vm.scopestack.back().at(ins.label);
-        vm.stack.push_back(vm.a);
-        break;
+    LEMONVM_CASE(OPCODE_YIELD)
+        vm.ip++;
+        LEMONVM_RETURN(State::YIELD);
 
-    case OPCODE_EQ:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        if (vm.a == vm.b)
-            vm.stack.push_back(1);
+    LEMONVM_CASE(OPCODE_VAR)
+        LEMONVM_NEED_SLOT(ins.arg1);
+        frame[ins.arg1] = 0;
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_STORE)
+        LEMONVM_NEED(1);
+        LEMONVM_NEED_SLOT(ins.arg1);
+        a = LEMONVM_POP();
+        frame[ins.arg1] = a;
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_LOAD)
+        LEMONVM_NEED_SLOT(ins.arg1);
+        a = frame[ins.arg1];
+        LEMONVM_PUSH(a);
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_EQ)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_TOP();
+        if (a == b)
+            LEMONVM_TOP() = 1;
         else
-            vm.stack.push_back(0);
-        break;
+            LEMONVM_TOP() = 0;
+        LEMONVM_NEXT();
 
-    case OPCODE_CMP:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        if (vm.b == vm.a)
-            vm.stack.push_back(0);
-        else if (vm.b < vm.a)
-            vm.stack.push_back(1);
+    LEMONVM_CASE(OPCODE_CMP)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_TOP();
+        if (b == a)
+            LEMONVM_TOP() = 0;
+        else if (b < a)
+            LEMONVM_TOP() = 1;
         else
-            vm.stack.push_back(-1);
-        break;
-
-   case OPCODE_SWAP: 
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        vm.stack.push_back(vm.a);
-        vm.stack.push_back(vm.b);
-        break;
-
-    case OPCODE_PLUS: 
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        vm.stack.push_back(vm.b+vm.a);
-        break;
-
-    case OPCODE_MINUS: 
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        vm.stack.push_back(vm.b-vm.a);
-        break;
-
-    case OPCODE_MULTIPLY: 
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        vm.stack.push_back(vm.b*vm.a);
-        break;
+            LEMONVM_TOP() = -1;
+        LEMONVM_NEXT();
 
-    case OPCODE_DIVIDE:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.b = vm.stack.back();
-        vm.stack.pop_back();
-        vm.stack.push_back(vm.b/vm.a);
-        break;
+    LEMONVM_CASE(OPCODE_SWAP)
+        LEMONVM_NEED(2);
+        a = LEMONVM_TOP();
+        b = LEMONVM_SECOND();
+        LEMONVM_TOP() = b;
+        LEMONVM_SECOND() = a;
+        LEMONVM_NEXT();
 
-    case OPCODE_DUPLAST:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        vm.stack.push_back(vm.a);
-        vm.stack.push_back(vm.a);
-        break;
+    LEMONVM_CASE(OPCODE_PLUS)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_TOP();
+        LEMONVM_TOP() = value_add(b, a);
+        LEMONVM_NEXT();
 
-    case OPCODE_DUP:
-        vm.a = vm.stack[ins.arg1];
-        vm.stack.push_back(vm.a);
-        break;
+    LEMONVM_CASE(OPCODE_MINUS)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_TOP();
+        LEMONVM_TOP() = value_sub(b, a);
+        LEMONVM_NEXT();
 
-    case OPCODE_WRITE:
-        vm.a = vm.stack.back();
-        vm.stack.pop_back();
-        printf("[stdout] -> %d\n", vm.a);
-        break;
+    LEMONVM_CASE(OPCODE_MULTIPLY)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_TOP();
+        LEMONVM_TOP() = value_mul(b, a);
+        LEMONVM_NEXT();
 
-    };
-    vm.ip++;
-    return State::OK;
+    LEMONVM_CASE(OPCODE_DIVIDE)
+        LEMONVM_NEED(2);
+        if constexpr (std::is_integral_v<T>) {
+            a = LEMONVM_TOP();
+            if (a == 0 || (a == -1 && LEMONVM_SECOND() == std::numeric_limits<T>::min())) [[unlikely]]
+                LEMONVM_RETURN(State::ERR);
+        }
+        a = LEMONVM_POP();
+        b = LEMONVM_TOP();
+        LEMONVM_TOP() = b/a;
+        LEMONVM_NEXT();
 
- CONTEXT_CHANGE:
-    return State::OK;
+    LEMONVM_CASE(OPCODE_DUPLAST)
+        LEMONVM_NEED(1);
+        a = LEMONVM_TOP();
+        LEMONVM_PUSH(a);
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_DUP)
+        LEMONVM_NEED(static_cast<std::uint32_t>(ins.arg1) + std::size_t{1});
+        a = LEMONVM_AT(ins.arg1);
+        LEMONVM_PUSH(a);
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_WRITE)
+        LEMONVM_NEED(1);
+        a = LEMONVM_POP();
+        value_write(vm, a);
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_ADDI)
+        LEMONVM_NEED(1);
+        a = LEMONVM_TOP();
+        LEMONVM_TOP() = value_add(a, operand_value<T>(constants, ins.arg1));
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_SUBI)
+        LEMONVM_NEED(1);
+        a = LEMONVM_TOP();
+        LEMONVM_TOP() = value_sub(a, operand_value<T>(constants, ins.arg1));
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_MULI)
+        LEMONVM_NEED(1);
+        a = LEMONVM_TOP();
+        LEMONVM_TOP() = value_mul(a, operand_value<T>(constants, ins.arg1));
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_SQUARE)
+        LEMONVM_NEED(1);
+        a = LEMONVM_TOP();
+        LEMONVM_TOP() = value_mul(a, a);
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_JNE)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_POP();
+        if (a != b) {
+            vm.ip = ins.arg1;
+            LEMONVM_JUMP();
+        }
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_JEQ)
+        LEMONVM_NEED(2);
+        a = LEMONVM_POP();
+        b = LEMONVM_POP();
+        if (a == b) {
+            vm.ip = ins.arg1;
+            LEMONVM_JUMP();
+        }
+        LEMONVM_NEXT();
+
+    LEMONVM_CASE(OPCODE_INCVAR)
+        LEMONVM_NEED_SLOT(ins.arg1);
+        frame[ins.arg1] = value_add(frame[ins.arg1], T{1});
+        LEMONVM_NEXT();
+
+#ifndef LEMONVM_COMPUTED_GOTO
+        };
+    }
+#endif
 }
 
-State iset_eval(VM& vm, const LabelMap& labels, InstructionSet& iset) {
+template<ValueType T>
+void vm_start(BasicVM<T>& vm, const Program& prg) {
     vm.ip = 0;
-    State state = State::OK; 
-    while (state == State::OK && vm.ip < iset.size())
-        state = ins_eval(vm, labels, iset[vm.ip]);
-    return state;
+    vm.fp = 0;
+    if (!prg.functions.empty())
+        vm.locals.resize(std::max(vm.locals.size(), prg.functions.front().locals.size()));
+}
+
+template<unsigned Flags, ValueType T>
+State iset_eval_select(BasicVM<T>& vm, const Program& prg, Profile* profile, std::uint64_t budget) {
+    const std::size_t room = verified_room(vm, prg);
+    if (room == 0)
+        return iset_eval_engine<Flags | EVAL_CHECKED>(vm, prg, profile, budget, 0);
+    return iset_eval_engine<Flags>(vm, prg, profile, budget, room);
+}
+
+template<ValueType T>
+State iset_eval(BasicVM<T>& vm, const Program& prg) {
+    vm_start(vm, prg);
+    return iset_eval_select<EVAL_DEFAULT>(vm, prg, nullptr, 0);
+}
+
+template<ValueType T>
+State iset_eval_profiled(BasicVM<T>& vm, const Program& prg, Profile& profile) {
+    vm_start(vm, prg);
+    return iset_eval_select<EVAL_PROFILE>(vm, prg, &profile, 0);
+}
+
+template<ValueType T>
+State iset_eval_checked(BasicVM<T>& vm, const Program& prg) {
+    vm_start(vm, prg);
+    return iset_eval_engine<EVAL_CHECKED>(vm, prg, nullptr, 0, 0);
+}
+
+template<ValueType T>
+State iset_resume(BasicVM<T>& vm, const Program& prg) {
+    return iset_eval_select<EVAL_DEFAULT>(vm, prg, nullptr, 0);
 }
 
-LabelMap extract_labels(const InstructionSet& iset) {
+template<ValueType T>
+State iset_eval_for(BasicVM<T>& vm, const Program& prg, std::uint64_t budget) {
+    vm_start(vm, prg);
+    return iset_eval_select<EVAL_BUDGET>(vm, prg, nullptr, budget);
+}
+
+template<ValueType T>
+State iset_resume_for(BasicVM<T>& vm, const Program& prg, std::uint64_t budget) {
+    return iset_eval_select<EVAL_BUDGET>(vm, prg, nullptr, budget);
+}
+
+template<ValueType T>
+LabelMap extract_labels(const BasicInstructionSet<T>& iset) {
     LabelMap labels{};
     std::size_t idx = 0;
     for (auto ins: iset) {
@@ -211,14 +1325,419 @@ LabelMap extract_labels(const InstructionSet& iset) {
     return labels;
 }
 
-State eval(VM& vm, const std::string& program) {
-    Tokens tokens{};
-    InstructionSet iset{};
-    LabelMap labels{};
-    tokens = tokenize(program);
-    iset = assemble(tokens);
-    labels = extract_labels(iset);
-    return iset_eval(vm, labels, iset);
+Arg intern_symbol(Program& prg, std::map<std::string, Arg>& ids, const std::string& symbol) {
+    auto [it, inserted] = ids.insert({symbol, static_cast<Arg>(prg.symbols.size())});
+    if (inserted)
+        prg.symbols.push_back(symbol);
+    return it->second;
+}
+
+template<ValueType T>
+std::map<std::string, Arg> link_functions(Program& prg, const BasicInstructionSet<T>& iset) {
+    std::map<std::string, Arg> function_ids{};
+    for (auto ins: iset) {
+        if ((ins.opcode == OPCODE_CALL || ins.opcode == OPCODE_SPAWN) && prg.labels.count(ins.label))
+            function_ids.insert({ins.label, 0});
+    }
+    prg.functions.push_back({"", 0, {}});
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        const BasicInstruction<T>& ins = iset[ip];
+        auto it = function_ids.find(ins.label);
+        if (ins.opcode != OPCODE_LABEL || it == function_ids.end())
+            continue;
+        if (ip == 0)
+            prg.functions.front().name = ins.label;
+        else
+            prg.functions.push_back({ins.label, ip, {}});
+        it->second = static_cast<Arg>(prg.functions.size() - 1);
+    }
+    return function_ids;
+}
+
+template<ValueType T>
+std::vector<std::map<std::string, Arg>> link_slots(Program& prg, const BasicInstructionSet<T>& iset) {
+    std::vector<std::map<std::string, Arg>> slots(prg.functions.size());
+    std::size_t fn = 0;
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        const BasicInstruction<T>& ins = iset[ip];
+        if (fn + 1 < prg.functions.size() && prg.functions[fn + 1].entry == ip)
+            fn++;
+        if (ins.opcode != OPCODE_VAR && ins.opcode != OPCODE_STORE)
+            continue;
+        std::vector<std::string>& locals = prg.functions[fn].locals;
+        auto [it, inserted] = slots[fn].insert({ins.label, static_cast<Arg>(locals.size())});
+        if (inserted)
+            locals.push_back(ins.label);
+    }
+    return slots;
+}
+
+template<ValueType T>
+Program link(const BasicInstructionSet<T>& iset) {
+    Program prg{};
+    prg.value = value_kind<T>();
+    std::map<std::string, Arg> ids{};
+    prg.labels = extract_labels(iset);
+    prg.code.reserve(iset.size());
+    std::map<std::string, Arg> function_ids = link_functions(prg, iset);
+    std::vector<std::map<std::string, Arg>> slots = link_slots(prg, iset);
+    Arg fn = 0;
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        const BasicInstruction<T>& ins = iset[ip];
+        Bytecode bc{ins.opcode, 0};
+        if (static_cast<std::size_t>(fn + 1) < prg.functions.size() && prg.functions[fn + 1].entry == ip)
+            fn++;
+        switch (ins.opcode) {
+        case OPCODE_JMP:
+        case OPCODE_JMPIF:
+        case OPCODE_JNE:
+        case OPCODE_JEQ: {
+            auto it = prg.labels.find(ins.label);
+            if (it == prg.labels.end())
+                prg.errors.push_back({ip, ins.label});
+            else
+                bc.arg1 = static_cast<Arg>(it->second);
+            break;
+        }
+        case OPCODE_CALL:
+        case OPCODE_SPAWN: {
+            auto it = function_ids.find(ins.label);
+            if (it == function_ids.end())
+                prg.errors.push_back({ip, ins.label});
+            else
+                bc.arg1 = it->second;
+            break;
+        }
+        case OPCODE_LABEL:
+            bc.arg1 = intern_symbol(prg, ids, ins.label);
+            break;
+        case OPCODE_VAR:
+        case OPCODE_LOAD:
+        case OPCODE_STORE:
+        case OPCODE_INCVAR: {
+            auto it = slots[fn].find(ins.label);
+            if (it == slots[fn].end())
+                prg.errors.push_back({ip, ins.label});
+            else
+                bc.arg1 = it->second;
+            break;
+        }
+        default:
+            if (operand_of(ins.opcode) == Operand::VALUE)
+                bc.arg1 = link_value(prg, ins.arg1);
+            else
+                bc.arg1 = static_cast<Arg>(ins.arg1);
+            break;
+        }
+        prg.code.push_back(bc);
+    }
+    prg.verification = program_verify(prg);
+    return prg;
+}
+
+std::string link_errors_str(const LinkErrors& errors) {
+    std::stringstream ss{};
+    for (auto& err: errors) {
+        if (err.line != 0)
+            ss << err.line << ":" << err.column << ": ";
+        ss << err.what << " '" << err.label << "' at instruction " << err.ip << "\n";
+    }
+    return ss.str();
+}
+
+std::string link_errors_str(const Program& prg) {
+    return link_errors_str(prg.errors);
+}
+
+std::string label_at(const Program& prg, Arg ip) {
+    std::span<const Bytecode> code = program_code(prg);
+    if (ip >= 0 && static_cast<std::size_t>(ip) < code.size() && code[ip].opcode == OPCODE_LABEL)
+        return prg.symbols[code[ip].arg1];
+    return std::to_string(ip);
+}
+
+Instruction unlink(const Program& prg, std::size_t ip) {
+    const Bytecode& bc = program_code(prg)[ip];
+    switch (bc.opcode) {
+    case OPCODE_JMP:
+    case OPCODE_JMPIF:
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        return ins_new(bc.opcode, label_at(prg, bc.arg1));
+    case OPCODE_CALL:
+    case OPCODE_SPAWN:
+        return ins_new(bc.opcode, prg.functions[bc.arg1].name);
+    case OPCODE_LABEL:
+        return ins_new(bc.opcode, prg.symbols[bc.arg1]);
+    case OPCODE_VAR:
+    case OPCODE_LOAD:
+    case OPCODE_STORE:
+    case OPCODE_INCVAR:
+        return ins_new(bc.opcode, function_at(prg, ip).locals[bc.arg1]);
+    default:
+        return ins_new(bc.opcode, bc.arg1);
+    }
+}
+
+const std::string
+str(const Program& prg, std::size_t ip)
+{
+    const Bytecode& bc = program_code(prg)[ip];
+    const std::uint64_t* constants = prg.constants.data();
+    if (prg.value == VALUE_INT64 && operand_of(bc.opcode) == Operand::VALUE)
+        return str(BasicInstruction<std::int64_t>{bc.opcode, operand_value<std::int64_t>(constants, bc.arg1)});
+    if (prg.value == VALUE_DOUBLE && operand_of(bc.opcode) == Operand::VALUE)
+        return str(BasicInstruction<double>{bc.opcode, operand_value<double>(constants, bc.arg1)});
+    if (prg.value == VALUE_DYNAMIC && operand_of(bc.opcode) == Operand::VALUE)
+        return str(BasicInstruction<Value>{bc.opcode, operand_value<Value>(constants, bc.arg1)});
+    return str(unlink(prg, ip));
+}
+
+std::string
+ISet_disasemble(const Program& prg)
+{
+    std::stringstream ss{};
+    for (std::size_t ip = 0; ip < program_code(prg).size(); ip++) {
+        ss << str(prg, ip);
+        ss << "\n";
+    }
+    return ss.str();
+}
+
+struct AsmName {
+    std::string_view str{};
+    std::size_t label_ip{no_ip};
+    Arg symbol{-1};
+    Arg function{-1};
+    Arg slot{-1};
+    bool called{false};
+};
+
+struct AsmRef {
+    std::size_t ip{0};
+    std::size_t name{0};
+    std::size_t line{0};
+    std::size_t column{0};
+};
+using AsmRefs = std::vector<AsmRef>;
+
+struct Assembler {
+    Program prg{};
+    LexCursor cur{};
+    std::unordered_map<std::string_view, std::size_t> ids{};
+    std::vector<AsmName> names{};
+    AsmRefs labels{};
+    AsmRefs jumps{};
+    AsmRefs calls{};
+    AsmRefs vars{};
+};
+
+std::size_t asm_name(Assembler& as, std::string_view str) {
+    auto [it, inserted] = as.ids.insert({str, as.names.size()});
+    if (inserted)
+        as.names.push_back({str});
+    return it->second;
+}
+
+void asm_error(Assembler& as, std::size_t ip, const Token& tok, const char* what) {
+    as.prg.errors.push_back({ip, std::string(tok.str), tok.line, tok.column, what});
+}
+
+template<ValueType T>
+void asm_instruction(Assembler& as, const Token& mnemonic) {
+    const std::size_t ip = as.prg.code.size();
+    Bytecode bc{get_opcode(mnemonic.str), 0};
+    if (bc.opcode == OPCODE_INVALID)
+        asm_error(as, ip, mnemonic, "unknown mnemonic");
+
+    const Operand operand = operand_of(bc.opcode);
+    Token tok{};
+    if (operand != Operand::NONE) {
+        trim_left(as.cur);
+        if (as.cur.pos == as.cur.src.size()) {
+            asm_error(as, ip, mnemonic, "missing operand for");
+            as.prg.code.push_back(bc);
+            return;
+        }
+        tok = extract_token(as.cur);
+    }
+    if (operand == Operand::INT && !parse_arg(tok.str, bc.arg1))
+        asm_error(as, ip, tok, "expected integer, got");
+    if (operand == Operand::VALUE) {
+        T value{};
+        if (!parse_arg(tok.str, value))
+            asm_error(as, ip, tok, "expected number, got");
+        bc.arg1 = link_value(as.prg, value);
+    }
+    if (operand == Operand::NAME && is_opcode(tok.str))
+        asm_error(as, ip, tok, "expected name, got");
+
+    if (operand == Operand::NAME) {
+        const std::size_t id = asm_name(as, tok.str);
+        AsmName& name = as.names[id];
+        const AsmRef ref{ip, id, tok.line, tok.column};
+        switch (bc.opcode) {
+        case OPCODE_LABEL:
+            if (name.label_ip != no_ip) {
+                asm_error(as, ip, tok, "duplicate label");
+                bc.arg1 = name.symbol;
+                break;
+            }
+            name.label_ip = ip;
+            name.symbol = static_cast<Arg>(as.prg.symbols.size());
+            as.prg.symbols.emplace_back(tok.str);
+            as.labels.push_back(ref);
+            bc.arg1 = name.symbol;
+            break;
+        case OPCODE_JMP:
+        case OPCODE_JMPIF:
+        case OPCODE_JNE:
+        case OPCODE_JEQ:
+            if (name.label_ip != no_ip)
+                bc.arg1 = static_cast<Arg>(name.label_ip);
+            else
+                as.jumps.push_back(ref);
+            break;
+        case OPCODE_CALL:
+        case OPCODE_SPAWN:
+            name.called = true;
+            as.calls.push_back(ref);
+            break;
+        default:
+            as.vars.push_back(ref);
+            break;
+        }
+    }
+    as.prg.code.push_back(bc);
+}
+
+void asm_patch(Assembler& as) {
+    Program& prg = as.prg;
+    auto unresolved = [&](const AsmRef& ref) {
+        prg.errors.push_back({ref.ip, std::string(as.names[ref.name].str), ref.line, ref.column});
+    };
+    for (auto& ref: as.jumps) {
+        const AsmName& name = as.names[ref.name];
+        if (name.label_ip == no_ip)
+            unresolved(ref);
+        else
+            prg.code[ref.ip].arg1 = static_cast<Arg>(name.label_ip);
+    }
+
+    prg.functions.push_back({"", 0, {}});
+    for (auto& ref: as.labels) {
+        AsmName& name = as.names[ref.name];
+        if (!name.called)
+            continue;
+        if (ref.ip == 0)
+            prg.functions.front().name = std::string(name.str);
+        else
+            prg.functions.push_back({std::string(name.str), ref.ip, {}});
+        name.function = static_cast<Arg>(prg.functions.size() - 1);
+    }
+    for (auto& ref: as.calls) {
+        const AsmName& name = as.names[ref.name];
+        if (name.function < 0)
+            unresolved(ref);
+        else
+            prg.code[ref.ip].arg1 = name.function;
+    }
+
+    std::size_t fn = 0;
+    std::vector<std::size_t> touched{};
+    for (auto& ref: as.vars) {
+        while (fn + 1 < prg.functions.size() && prg.functions[fn + 1].entry <= ref.ip) {
+            fn++;
+            for (auto id: touched)
+                as.names[id].slot = -1;
+            touched.clear();
+        }
+        AsmName& name = as.names[ref.name];
+        Bytecode& bc = prg.code[ref.ip];
+        if (name.slot < 0 && (bc.opcode == OPCODE_VAR || bc.opcode == OPCODE_STORE)) {
+            name.slot = static_cast<Arg>(prg.functions[fn].locals.size());
+            prg.functions[fn].locals.emplace_back(name.str);
+            touched.push_back(ref.name);
+        }
+        if (name.slot < 0)
+            unresolved(ref);
+        else
+            bc.arg1 = name.slot;
+    }
+
+    /*Inserting the labels in order lets the map append instead of search*/
+    std::vector<std::pair<std::string_view, std::size_t>> labels{};
+    labels.reserve(as.labels.size());
+    for (auto& ref: as.labels)
+        labels.push_back({as.names[ref.name].str, ref.ip});
+    std::sort(labels.begin(), labels.end());
+    for (auto& [label, ip]: labels)
+        prg.labels.emplace_hint(prg.labels.end(), label, ip);
+
+    std::stable_sort(prg.errors.begin(), prg.errors.end(),
+                     [](const LinkError& a, const LinkError& b) { return a.ip < b.ip; });
+}
+
+template<ValueType T = Arg>
+Program assemble_program(std::string_view src) {
+    Assembler as{};
+    as.cur = LexCursor{src};
+    as.prg.value = value_kind<T>();
+    /*Rough guesses from typical sources, to avoid growing the tables while assembling*/
+    as.prg.code.reserve(src.size() / 16);
+    as.ids.reserve(src.size() / 32);
+    for (;;) {
+        trim_left(as.cur);
+        if (as.cur.pos == as.cur.src.size())
+            break;
+        asm_instruction<T>(as, extract_token(as.cur));
+    }
+    asm_patch(as);
+    as.prg.verification = program_verify(as.prg);
+    return std::move(as.prg);
+}
+
+std::map<std::string, std::uint64_t> profile_labels(const Program& prg, const Profile& prof) {
+    std::map<std::string, std::uint64_t> labels{};
+    for (auto& [label, ip]: prg.labels)
+        labels[label] = ip < prof.instructions.size() ? prof.instructions[ip] : 0;
+    return labels;
+}
+
+std::string profile_listing(const Program& prg, const Profile& prof) {
+    std::stringstream ss{};
+    for (std::size_t ip = 0; ip < program_code(prg).size(); ip++) {
+        const std::uint64_t count = ip < prof.instructions.size() ? prof.instructions[ip] : 0;
+        ss << std::setw(12) << count << " " << std::setw(6) << ip << "  " << str(prg, ip) << "\n";
+    }
+
+    ss << "\n" << std::setw(12) << "calls" << std::setw(14) << "steps"
+       << std::setw(16) << "inclusive" << std::setw(16) << "exclusive" << "  function\n";
+    for (std::size_t fn = 0; fn < prof.functions.size() && fn < prg.functions.size(); fn++) {
+        const FunctionProfile& f = prof.functions[fn];
+        ss << std::setw(12) << f.calls << std::setw(14) << f.steps
+           << std::setw(16) << f.inclusive << std::setw(16) << f.exclusive << "  "
+           << (prg.functions[fn].name.empty() ? "<entry>" : prg.functions[fn].name) << "\n";
+    }
+
+    ss << "\n" << std::setw(12) << "count" << "  opcode\n";
+    for (std::size_t op = 0; op < prof.opcodes.size(); op++) {
+        if (prof.opcodes[op] == 0)
+            continue;
+        const std::string name = str(ins_new(static_cast<Opcode>(op)));
+        ss << std::setw(12) << prof.opcodes[op] << "  " << name.substr(0, name.find(' ')) << "\n";
+    }
+    return ss.str();
+}
+
+template<ValueType T>
+State eval(BasicVM<T>& vm, const std::string& program) {
+    const Program prg = assemble_program<T>(program);
+    if (!is_linked(prg)) {
+        std::cerr << link_errors_str(prg);
+        return State::ERR;
+    }
+    return iset_eval(vm, prg);
 }
 
 std::string file_slurp(const std::string& path) {
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "InstructionSet.hpp"
+
+namespace LemonVM {
+
+using FuseFn = bool (*)(const Instruction* match, Instruction& fused);
+
+struct Fusion {
+    std::vector<Opcode> pattern{};
+    FuseFn fuse{nullptr};
+};
+using Fusions = std::vector<Fusion>;
+
+const Fusions default_fusions = {
+    {{OPCODE_LOAD, OPCODE_PUT, OPCODE_PLUS, OPCODE_STORE},
+     [](const Instruction* m, Instruction& fused) {
+         if (m[0].label != m[3].label || m[1].arg1 != 1)
+             return false;
+         fused = ins_new(OPCODE_INCVAR, m[0].label);
+         return true;
+     }},
+    {{OPCODE_PUT, OPCODE_PLUS},
+     [](const Instruction* m, Instruction& fused) { fused = ins_new(OPCODE_ADDI, m[0].arg1); return true; }},
+    {{OPCODE_PUT, OPCODE_MINUS},
+     [](const Instruction* m, Instruction& fused) { fused = ins_new(OPCODE_SUBI, m[0].arg1); return true; }},
+    {{OPCODE_PUT, OPCODE_MULTIPLY},
+     [](const Instruction* m, Instruction& fused) { fused = ins_new(OPCODE_MULI, m[0].arg1); return true; }},
+    {{OPCODE_DUPLAST, OPCODE_MULTIPLY},
+     [](const Instruction*, Instruction& fused) { fused = ins_new(OPCODE_SQUARE); return true; }},
+    {{OPCODE_CMP, OPCODE_JMPIF},
+     [](const Instruction* m, Instruction& fused) { fused = ins_new(OPCODE_JNE, m[1].label); return true; }},
+    {{OPCODE_EQ, OPCODE_JMPIF},
+     [](const Instruction* m, Instruction& fused) { fused = ins_new(OPCODE_JEQ, m[1].label); return true; }},
+};
+
+bool fusion_matches(const InstructionSet& iset, std::size_t i, const Fusion& fusion) {
+    if (i + fusion.pattern.size() > iset.size())
+        return false;
+    for (std::size_t j = 0; j < fusion.pattern.size(); j++) {
+        if (iset[i + j].opcode != fusion.pattern[j])
+            return false;
+    }
+    return true;
+}
+
+std::size_t iset_fuse(InstructionSet& iset, const Fusions& fusions = default_fusions) {
+    InstructionSet fused_iset{};
+    fused_iset.reserve(iset.size());
+    std::size_t i = 0;
+    while (i < iset.size()) {
+        Instruction fused{};
+        std::size_t matched = 0;
+        for (const Fusion& fusion: fusions) {
+            if (fusion_matches(iset, i, fusion) && fusion.fuse(&iset[i], fused)) {
+                matched = fusion.pattern.size();
+                break;
+            }
+        }
+        if (matched == 0) {
+            fused_iset.push_back(iset[i]);
+            i++;
+            continue;
+        }
+        fused_iset.push_back(fused);
+        i += matched;
+    }
+    const std::size_t removed = iset.size() - fused_iset.size();
+    iset = std::move(fused_iset);
+    return removed;
+}
+
+}//ns
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Defs.hpp"
+#include "Value.hpp"
 
 namespace LemonVM {
 
@@ -15,10 +16,10 @@ enum Opcode : std::uint8_t {
     OPCODE_SWAP    = 07,
 
     OPCODE_LABEL  = 20,
-    //OPCODE_JMP,
     OPCODE_JMPIF  = 21,
     OPCODE_CALL   = 22,
     OPCODE_RETURN = 23,
+    OPCODE_JMP    = 24,
 
     OPCODE_PLUS     = 30,
     OPCODE_MINUS    = 31,
@@ -34,17 +35,61 @@ enum Opcode : std::uint8_t {
     //OPCODE_IF,
     OPCODE_WRITE = 60,
 
+    OPCODE_SPAWN = 61,
+    OPCODE_JOIN  = 62,
+    OPCODE_YIELD = 63,
+
+    OPCODE_ADDI   = 70,
+    OPCODE_SUBI   = 71,
+    OPCODE_MULI   = 72,
+    OPCODE_SQUARE = 73,
+    OPCODE_JNE    = 74,
+    OPCODE_JEQ    = 75,
+    OPCODE_INCVAR = 76,
+
     OPCODE_COUNT
 };
 
-using Arg = int;
+using Arg = std::int32_t;
+
+template<typename T>
+concept ValueType = std::is_same_v<T, std::int32_t> || std::is_same_v<T, std::int64_t> || std::is_same_v<T, double>
+                    || std::is_same_v<T, Value>;
+
+enum ValueKind : std::uint8_t {VALUE_INT32, VALUE_INT64, VALUE_DOUBLE, VALUE_DYNAMIC};
 
-struct Instruction {
+template<ValueType T>
+constexpr ValueKind value_kind() {
+    if constexpr (std::is_same_v<T, std::int64_t>)
+        return VALUE_INT64;
+    else if constexpr (std::is_same_v<T, double>)
+        return VALUE_DOUBLE;
+    else if constexpr (std::is_same_v<T, Value>)
+        return VALUE_DYNAMIC;
+    else
+        return VALUE_INT32;
+}
+
+template<ValueType T>
+struct BasicInstruction {
     Opcode opcode{OPCODE_NOP};
-    Arg arg1{0};
+    T arg1{0};
     std::string label{};
 };
-using InstructionSet = std::vector<Instruction>;
+
+template<ValueType T>
+using BasicInstructionSet = std::vector<BasicInstruction<T>>;
+
+using Instruction = BasicInstruction<Arg>;
+using InstructionSet = BasicInstructionSet<Arg>;
+
+template<ValueType T>
+std::string value_str(T value) {
+    using std::to_chars;
+    std::array<char, 32> buf{};
+    auto [ptr, ec] = to_chars(buf.data(), buf.data() + buf.size(), value);
+    return std::string(buf.data(), ptr);
+}
 
 inline const Instruction ins_new(Opcode op)                     { return {op, 0, ""}; }
 inline const Instruction ins_new(Opcode op, Arg arg)            { return {op, arg, ""}; }
@@ -66,23 +111,29 @@ inline Instruction ins_multiply()    { return ins_new(OPCODE_MULTIPLY); }
 inline Instruction ins_divide()      { return ins_new(OPCODE_DIVIDE); }
 
 inline Instruction ins_label(std::string label) { return ins_new(OPCODE_LABEL, label); }
+inline Instruction ins_jmp(std::string label)   { return ins_new(OPCODE_JMP, label); }
 inline Instruction ins_jmpif(std::string label) { return ins_new(OPCODE_JMPIF, label); }
 inline Instruction ins_call(std::string label)  { return ins_new(OPCODE_CALL, label); }
 inline Instruction ins_return()                 { return ins_new(OPCODE_RETURN); }
 
+inline Instruction ins_spawn(std::string label) { return ins_new(OPCODE_SPAWN, label); }
+inline Instruction ins_join()                   { return ins_new(OPCODE_JOIN); }
+inline Instruction ins_yield()                  { return ins_new(OPCODE_YIELD); }
+
 inline Instruction ins_var(std::string name)   { return ins_new(OPCODE_VAR, name); }
 inline Instruction ins_load(std::string name)  { return ins_new(OPCODE_LOAD, name); }
 inline Instruction ins_store(std::string name) { return ins_new(OPCODE_STORE, name); }
 
-static const std::string
-str(const Instruction& ins)
+template<ValueType T>
+const std::string
+str(const BasicInstruction<T>& ins)
 {
     switch (ins.opcode) {
     case OPCODE_EXIT:     return "exit";
     case OPCODE_NOP:      return "nop";
     case OPCODE_SWAP:     return "swap";
     case OPCODE_POP:      return "pop";
-    case OPCODE_PUT:      return "put " + std::to_string(ins.arg1);
+    case OPCODE_PUT:      return "put " + value_str(ins.arg1);
     case OPCODE_PLUS:     return "plus";
     case OPCODE_MINUS:    return "minus";
     case OPCODE_MULTIPLY: return "multiply";
@@ -93,12 +144,23 @@ str(const Instruction& ins)
     case OPCODE_EQ:       return "eq";
     case OPCODE_CMP:      return "cmp";
     case OPCODE_LABEL:    return "label " + ins.label;
+    case OPCODE_JMP:      return "jmp "   + ins.label;
     case OPCODE_JMPIF:    return "jmpif " + ins.label;
     case OPCODE_CALL:     return "call "  + ins.label;
     case OPCODE_RETURN:   return "return";
-    case OPCODE_VAR:      return "var"   + ins.label;
-    case OPCODE_LOAD:     return "load"  + ins.label;
-    case OPCODE_STORE:    return "store" + ins.label;
+    case OPCODE_SPAWN:    return "spawn " + ins.label;
+    case OPCODE_JOIN:     return "join";
+    case OPCODE_YIELD:    return "yield";
+    case OPCODE_VAR:      return "var "   + ins.label;
+    case OPCODE_LOAD:     return "load "  + ins.label;
+    case OPCODE_STORE:    return "store " + ins.label;
+    case OPCODE_ADDI:     return "addi " + value_str(ins.arg1);
+    case OPCODE_SUBI:     return "subi " + value_str(ins.arg1);
+    case OPCODE_MULI:     return "muli " + value_str(ins.arg1);
+    case OPCODE_SQUARE:   return "square";
+    case OPCODE_JNE:      return "jne " + ins.label;
+    case OPCODE_JEQ:      return "jeq " + ins.label;
+    case OPCODE_INCVAR:   return "incvar " + ins.label;
 
     case OPCODE_INVALID:
     case OPCODE_COUNT: 
@@ -108,8 +170,9 @@ str(const Instruction& ins)
     return "unreachable opcode";
 }
 
+template<ValueType T>
 std::string
-ISet_disasemble(const InstructionSet& iset)
+ISet_disasemble(const BasicInstructionSet<T>& iset)
 {
     std::stringstream ss{};
     for (auto it : iset) {
@@ -119,34 +182,139 @@ ISet_disasemble(const InstructionSet& iset)
     return ss.str();
 }
 
-Opcode
-get_opcode(const std::string& str)
+struct Mnemonic {
+    std::string_view name{};
+    Opcode opcode{OPCODE_INVALID};
+};
+
+constexpr std::array<Mnemonic, 32> mnemonics = {{
+    {"exit",     OPCODE_EXIT},
+    {"nop",      OPCODE_NOP},
+    {"swap",     OPCODE_SWAP},
+    {"pop",      OPCODE_POP},
+    {"put",      OPCODE_PUT},
+    {"plus",     OPCODE_PLUS},
+    {"minus",    OPCODE_MINUS},
+    {"multiply", OPCODE_MULTIPLY},
+    {"divide",   OPCODE_DIVIDE},
+    {"dup",      OPCODE_DUP},
+    {"duplast",  OPCODE_DUPLAST},
+    {"write",    OPCODE_WRITE},
+    {"eq",       OPCODE_EQ},
+    {"cmp",      OPCODE_CMP},
+    {"label",    OPCODE_LABEL},
+    {"jmp",      OPCODE_JMP},
+    {"jmpif",    OPCODE_JMPIF},
+    {"call",     OPCODE_CALL},
+    {"return",   OPCODE_RETURN},
+    {"spawn",    OPCODE_SPAWN},
+    {"join",     OPCODE_JOIN},
+    {"yield",    OPCODE_YIELD},
+    {"var",      OPCODE_VAR},
+    {"load",     OPCODE_LOAD},
+    {"store",    OPCODE_STORE},
+    {"addi",     OPCODE_ADDI},
+    {"subi",     OPCODE_SUBI},
+    {"muli",     OPCODE_MULI},
+    {"square",   OPCODE_SQUARE},
+    {"jne",      OPCODE_JNE},
+    {"jeq",      OPCODE_JEQ},
+    {"incvar",   OPCODE_INCVAR},
+}};
+
+using MnemonicTable = std::array<Mnemonic, 64>;
+
+constexpr std::size_t mnemonic_hash(std::string_view str) {
+    if (str.empty())
+        return 0;
+    const std::size_t first = static_cast<unsigned char>(str.front());
+    const std::size_t last = static_cast<unsigned char>(str.back());
+    return (str.size() + first * 8 + last * 26) % MnemonicTable{}.size();
+}
+
+constexpr MnemonicTable mnemonic_table_new() {
+    MnemonicTable table{};
+    table.fill(Mnemonic{}); /*GCC 12 only treats slots that were assigned as constants*/
+    for (auto mnemonic: mnemonics)
+        table[mnemonic_hash(mnemonic.name)] = mnemonic;
+    return table;
+}
+
+constexpr MnemonicTable mnemonic_table = mnemonic_table_new();
+
+constexpr bool mnemonic_table_is_perfect() {
+    for (auto mnemonic: mnemonics) {
+        if (mnemonic_table[mnemonic_hash(mnemonic.name)].opcode != mnemonic.opcode)
+            return false;
+    }
+    return true;
+}
+static_assert(mnemonic_table_is_perfect(), "mnemonic_hash has a collision, tune its constants");
+
+constexpr Opcode
+get_opcode(std::string_view str)
 {
-    /*TODO: Use a map for quicker access*/
-    if (str == "exit")     return OPCODE_EXIT;
-    if (str == "nop")      return OPCODE_NOP;
-    if (str == "swap")     return OPCODE_SWAP;
-    if (str == "put")      return OPCODE_PUT;
-    if (str == "plus")     return OPCODE_PLUS;
-    if (str == "minus")    return OPCODE_MINUS;
-    if (str == "multiply") return OPCODE_MULTIPLY;
-    if (str == "divide")   return OPCODE_DIVIDE;
-    if (str == "dup")      return OPCODE_DUP;
-    if (str == "duplast")  return OPCODE_DUPLAST;
-    if (str == "write")    return OPCODE_WRITE;
-    if (str == "eq")       return OPCODE_EQ;
-    if (str == "cmp")      return OPCODE_CMP;
-    if (str == "label")    return OPCODE_LABEL;
-    if (str == "jmpif")    return OPCODE_JMPIF;
-    if (str == "call")     return OPCODE_CALL;
-    if (str == "var")      return OPCODE_VAR;
-    if (str == "load")     return OPCODE_LOAD;
-    if (str == "store")    return OPCODE_STORE;
-    if (str == "return")   return OPCODE_RETURN;
+    const Mnemonic mnemonic = mnemonic_table[mnemonic_hash(str)];
+    if (mnemonic.name == str)
+        return mnemonic.opcode;
     return OPCODE_INVALID;
 }
 
-bool is_opcode(const std::string& str) {
+enum class Operand {NONE, INT, VALUE, NAME};
+
+constexpr Operand operand_of(Opcode opcode) {
+    switch (opcode) {
+    case OPCODE_DUP:
+        return Operand::INT;
+    case OPCODE_PUT:
+    case OPCODE_ADDI:
+    case OPCODE_SUBI:
+    case OPCODE_MULI:
+        return Operand::VALUE;
+    case OPCODE_LABEL:
+    case OPCODE_JMP:
+    case OPCODE_JMPIF:
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+    case OPCODE_CALL:
+    case OPCODE_SPAWN:
+    case OPCODE_VAR:
+    case OPCODE_LOAD:
+    case OPCODE_STORE:
+    case OPCODE_INCVAR:
+        return Operand::NAME;
+    default:
+        return Operand::NONE;
+    }
+}
+
+template<ValueType T>
+constexpr bool parse_arg(std::string_view str, T& arg) {
+    if constexpr (std::is_integral_v<T>) {
+        if (std::is_constant_evaluated()) {
+            const bool negative = !str.empty() && str.front() == '-';
+            const std::string_view digits = str.substr(negative ? 1 : 0);
+            const std::uint64_t limit = static_cast<std::uint64_t>(std::numeric_limits<T>::max()) + (negative ? 1 : 0);
+            std::uint64_t value = 0;
+            for (char c: digits) {
+                const std::uint64_t digit = static_cast<std::uint64_t>(c - '0');
+                if (c < '0' || c > '9' || value > (limit - digit) / 10)
+                    return false;
+                value = value * 10 + digit;
+            }
+            if (digits.empty())
+                return false;
+            arg = static_cast<T>(negative ? 0 - value : value);
+            return true;
+        }
+    }
+    using std::from_chars;
+    const char* end = str.data() + str.size();
+    auto [ptr, ec] = from_chars(str.data(), end, arg);
+    return ec == std::errc{} && ptr == end;
+}
+
+constexpr bool is_opcode(std::string_view str) {
     if (get_opcode(str) == OPCODE_INVALID)
         return false;
     return true;
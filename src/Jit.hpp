@@ -0,0 +1,756 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "Eval.hpp"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LEMONVM_NO_JIT)
+#include <sys/mman.h>
+#define LEMONVM_JIT
+#endif
+
+namespace LemonVM {
+
+struct Jit;
+
+struct JitContext {
+    Arg* sp{nullptr};
+    Arg* stack_base{nullptr};
+    Arg* stack_end{nullptr};
+    Arg* frame{nullptr};
+    std::uint64_t steps{0};
+    std::size_t ip{0};
+    VM* vm{nullptr};
+    const Program* prg{nullptr};
+    const Jit* jit{nullptr};
+    Arg tos{0};
+};
+
+enum JitExit : int {
+    JIT_END      = 0,
+    JIT_EXIT     = 1,
+    JIT_FALLBACK = 2,
+};
+
+using JitEntry = int (*)(JitContext* ctx, const void* entry);
+
+struct Jit {
+    std::uint8_t* code{nullptr};
+    std::size_t code_size{0};
+    std::vector<const void*> entries{};
+    std::vector<std::uint8_t> stops{};
+    const void* end{nullptr};
+    const void* fallback{nullptr};
+    const void* empty{nullptr};
+
+    Jit() = default;
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+    ~Jit();
+};
+
+void jit_free(Jit& jit) {
+#ifdef LEMONVM_JIT
+    if (jit.code)
+        munmap(jit.code, jit.code_size);
+#endif
+    jit.code = nullptr;
+    jit.code_size = 0;
+    jit.entries.clear();
+    jit.stops.clear();
+}
+
+Jit::~Jit() {
+    jit_free(*this);
+}
+
+void jit_grow(JitContext* ctx, std::size_t pushes) {
+    VM& vm = *ctx->vm;
+    const std::size_t depth = ctx->sp - ctx->stack_base;
+    while (depth + pushes >= vm.stack.slots.size())
+        vm.stack.slots.resize(vm.stack.slots.size() * 2);
+    ctx->stack_base = vm.stack.slots.data();
+    ctx->stack_end = ctx->stack_base + vm.stack.slots.size();
+    ctx->sp = ctx->stack_base + depth;
+}
+
+Arg* jit_call(JitContext* ctx, std::size_t ip, Arg function) {
+    VM& vm = *ctx->vm;
+    const Function& fn = ctx->prg->functions[function];
+    vm.returnstack.push_back({ip, vm.fp});
+    vm.fp = vm.locals.size();
+    vm.locals.resize(vm.fp + fn.locals.size());
+    return vm.locals.data() + vm.fp;
+}
+
+const void* jit_return(JitContext* ctx, std::size_t ip) {
+    VM& vm = *ctx->vm;
+    const Jit& jit = *ctx->jit;
+    if (vm.returnstack.empty()) {
+        ctx->ip = ip;
+        return jit.empty;
+    }
+    vm.locals.resize(vm.fp);
+    const Frame frame = vm.returnstack.back();
+    vm.returnstack.pop_back();
+    vm.fp = frame.fp;
+    ctx->frame = vm.locals.data() + vm.fp;
+    ctx->ip = frame.ip + 1;
+    if (ctx->ip >= jit.entries.size())
+        return jit.end;
+    if (!jit.entries[ctx->ip])
+        return jit.fallback;
+    return jit.entries[ctx->ip];
+}
+
+void jit_write(JitContext* ctx, Arg value) {
+    value_write(*ctx->vm, value);
+}
+
+enum X64Reg : std::uint8_t {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+struct JitFixup {
+    std::size_t at{0};
+    std::size_t ip{0};
+};
+
+struct JitAssembler {
+    std::vector<std::uint8_t> code{};
+    std::vector<std::size_t> offsets{};
+    std::vector<JitFixup> fixups{};
+    std::size_t exit{0};
+    std::size_t end{0};
+    std::size_t fallback{0};
+    std::size_t empty{0};
+    std::size_t grow{0};
+    std::size_t call{0};
+    std::size_t ret{0};
+    std::size_t write{0};
+};
+
+void x64_bytes(JitAssembler& as, std::initializer_list<std::uint8_t> bytes) {
+    as.code.insert(as.code.end(), bytes);
+}
+
+void x64_u32(JitAssembler& as, std::uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        as.code.push_back(static_cast<std::uint8_t>(v >> (8 * i)));
+}
+
+void x64_u64(JitAssembler& as, std::uint64_t v) {
+    x64_u32(as, static_cast<std::uint32_t>(v));
+    x64_u32(as, static_cast<std::uint32_t>(v >> 32));
+}
+
+void x64_rex(JitAssembler& as, bool wide, int reg, int rm) {
+    const std::uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        as.code.push_back(rex);
+}
+
+/*op reg, rm where both are registers*/
+void x64_reg(JitAssembler& as, bool wide, std::initializer_list<std::uint8_t> op, int reg, int rm) {
+    x64_rex(as, wide, reg, rm);
+    x64_bytes(as, op);
+    as.code.push_back(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/*op reg, [base + disp]*/
+void x64_mem(JitAssembler& as, bool wide, std::initializer_list<std::uint8_t> op, int reg, int base,
+             std::int32_t disp)
+{
+    x64_rex(as, wide, reg, base);
+    x64_bytes(as, op);
+    const bool byte = disp >= -128 && disp <= 127;
+    const std::uint8_t mod = (disp == 0 && (base & 7) != RBP) ? 0x00 : byte ? 0x40 : 0x80;
+    as.code.push_back(mod | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        as.code.push_back(0x24);
+    if (mod == 0x40)
+        as.code.push_back(static_cast<std::uint8_t>(disp));
+    else if (mod == 0x80)
+        x64_u32(as, static_cast<std::uint32_t>(disp));
+}
+
+void x64_push(JitAssembler& as, int reg) {
+    if (reg >= 8)
+        as.code.push_back(0x41);
+    as.code.push_back(0x50 + (reg & 7));
+}
+
+void x64_pop(JitAssembler& as, int reg) {
+    if (reg >= 8)
+        as.code.push_back(0x41);
+    as.code.push_back(0x58 + (reg & 7));
+}
+
+void x64_mov_imm32(JitAssembler& as, int reg, std::uint32_t imm) {
+    if (reg >= 8)
+        as.code.push_back(0x41);
+    as.code.push_back(0xB8 + (reg & 7));
+    x64_u32(as, imm);
+}
+
+void x64_mov_imm64(JitAssembler& as, int reg, std::uint64_t imm) {
+    as.code.push_back(0x48 | (reg >> 3));
+    as.code.push_back(0xB8 + (reg & 7));
+    x64_u64(as, imm);
+}
+
+/*A trampoline, so that calls to a helper can be short calls within the buffer*/
+std::size_t x64_trampoline(JitAssembler& as, const void* fn) {
+    const std::size_t at = as.code.size();
+    x64_mov_imm64(as, RAX, reinterpret_cast<std::uint64_t>(fn));
+    x64_reg(as, false, {0xFF}, 4, RAX);
+    return at;
+}
+
+enum X64Cond : std::uint8_t {X64_B = 0x2, X64_E = 0x4, X64_NE = 0x5, X64_L = 0xC, X64_G = 0xF};
+
+void x64_jmp_to(JitAssembler& as, std::size_t target) {
+    as.code.push_back(0xE9);
+    x64_u32(as, static_cast<std::uint32_t>(target - (as.code.size() + 4)));
+}
+
+void x64_call_to(JitAssembler& as, std::size_t target) {
+    as.code.push_back(0xE8);
+    x64_u32(as, static_cast<std::uint32_t>(target - (as.code.size() + 4)));
+}
+
+void x64_jmp_ip(JitAssembler& as, std::size_t ip) {
+    as.code.push_back(0xE9);
+    as.fixups.push_back({as.code.size(), ip});
+    x64_u32(as, 0);
+}
+
+void x64_jcc_ip(JitAssembler& as, X64Cond cond, std::size_t ip) {
+    x64_bytes(as, {0x0F, static_cast<std::uint8_t>(0x80 | cond)});
+    as.fixups.push_back({as.code.size(), ip});
+    x64_u32(as, 0);
+}
+
+std::size_t x64_skip(JitAssembler& as, X64Cond cond) {
+    x64_bytes(as, {static_cast<std::uint8_t>(0x70 | cond), 0});
+    return as.code.size();
+}
+
+void x64_skip_here(JitAssembler& as, std::size_t from) {
+    as.code[from - 1] = static_cast<std::uint8_t>(as.code.size() - from);
+}
+
+#define LEMONVM_JIT_CTX(FIELD) static_cast<std::int32_t>(offsetof(JitContext, FIELD))
+
+void jit_prologue(JitAssembler& as) {
+    for (int reg: {RBX, RBP, R12, R13, R14, R15})
+        x64_push(as, reg);
+    x64_reg(as, true, {0x83}, 5, RSP); as.code.push_back(8);    /*sub rsp, 8*/
+    x64_reg(as, true, {0x89}, RDI, R12);
+    x64_mem(as, true, {0x8B}, RBX, R12, LEMONVM_JIT_CTX(sp));
+    x64_mem(as, false, {0x8B}, R13, R12, LEMONVM_JIT_CTX(tos));
+    x64_mem(as, true, {0x8B}, R14, R12, LEMONVM_JIT_CTX(frame));
+    x64_mem(as, true, {0x8B}, R15, R12, LEMONVM_JIT_CTX(stack_end));
+    x64_mem(as, true, {0x8B}, RBP, R12, LEMONVM_JIT_CTX(steps));
+    x64_reg(as, false, {0xFF}, 4, RSI);                           /*jmp rsi*/
+}
+
+void jit_stubs(JitAssembler& as) {
+    as.exit = as.code.size();
+    x64_mem(as, true, {0x89}, RBX, R12, LEMONVM_JIT_CTX(sp));
+    x64_mem(as, false, {0x89}, R13, R12, LEMONVM_JIT_CTX(tos));
+    x64_mem(as, true, {0x89}, RBP, R12, LEMONVM_JIT_CTX(steps));
+    x64_reg(as, true, {0x83}, 0, RSP); as.code.push_back(8);    /*add rsp, 8*/
+    for (int reg: {R15, R14, R13, R12, RBP, RBX})
+        x64_pop(as, reg);
+    as.code.push_back(0xC3);
+
+    as.end = as.code.size();
+    x64_mov_imm32(as, RAX, JIT_END);
+    x64_jmp_to(as, as.exit);
+
+    as.fallback = as.code.size();
+    x64_mov_imm32(as, RAX, JIT_FALLBACK);
+    x64_jmp_to(as, as.exit);
+
+    as.empty = as.code.size();
+    x64_mov_imm32(as, RAX, JIT_EXIT);
+    x64_jmp_to(as, as.exit);
+
+    as.call = x64_trampoline(as, reinterpret_cast<const void*>(&jit_call));
+    as.ret = x64_trampoline(as, reinterpret_cast<const void*>(&jit_return));
+    as.write = x64_trampoline(as, reinterpret_cast<const void*>(&jit_write));
+    const std::size_t grow = x64_trampoline(as, reinterpret_cast<const void*>(&jit_grow));
+
+    /*Grows the stack to fit rsi more values*/
+    as.grow = as.code.size();
+    x64_reg(as, true, {0x83}, 5, RSP); as.code.push_back(8);
+    x64_mem(as, true, {0x89}, RBX, R12, LEMONVM_JIT_CTX(sp));
+    x64_reg(as, true, {0x89}, R12, RDI);
+    x64_call_to(as, grow);
+    x64_mem(as, true, {0x8B}, RBX, R12, LEMONVM_JIT_CTX(sp));
+    x64_mem(as, true, {0x8B}, R15, R12, LEMONVM_JIT_CTX(stack_end));
+    x64_reg(as, true, {0x83}, 0, RSP); as.code.push_back(8);
+    as.code.push_back(0xC3);
+}
+
+void jit_exit(JitAssembler& as, std::size_t ip, JitExit exit) {
+    x64_mem(as, true, {0xC7}, 0, R12, LEMONVM_JIT_CTX(ip));
+    x64_u32(as, static_cast<std::uint32_t>(ip));
+    x64_mov_imm32(as, RAX, exit);
+    x64_jmp_to(as, as.exit);
+}
+
+void jit_reserve(JitAssembler& as, std::uint32_t pushes) {
+    x64_mem(as, true, {0x8D}, RAX, RBX, 4 * pushes);              /*lea rax, [rbx + 4 * pushes]*/
+    x64_reg(as, true, {0x39}, R15, RAX);                          /*cmp rax, r15*/
+    const std::size_t room = x64_skip(as, X64_B);
+    x64_mov_imm32(as, RSI, pushes);
+    x64_call_to(as, as.grow);
+    x64_skip_here(as, room);
+}
+
+void jit_push(JitAssembler& as) {
+    x64_mem(as, false, {0x89}, R13, RBX, 0);                      /*mov [rbx], r13d*/
+    x64_reg(as, true, {0x83}, 0, RBX); as.code.push_back(4);    /*add rbx, 4*/
+}
+
+void jit_pop(JitAssembler& as) {
+    x64_reg(as, true, {0x83}, 5, RBX); as.code.push_back(4);    /*sub rbx, 4*/
+    x64_mem(as, false, {0x8B}, R13, RBX, 0);                      /*mov r13d, [rbx]*/
+}
+
+bool jit_native(Opcode opcode) {
+    switch (opcode) {
+    case OPCODE_EXIT:
+    case OPCODE_NOP:
+    case OPCODE_PUT:
+    case OPCODE_POP:
+    case OPCODE_DUP:
+    case OPCODE_DUPLAST:
+    case OPCODE_SWAP:
+    case OPCODE_LABEL:
+    case OPCODE_JMP:
+    case OPCODE_JMPIF:
+    case OPCODE_CALL:
+    case OPCODE_RETURN:
+    case OPCODE_PLUS:
+    case OPCODE_MINUS:
+    case OPCODE_MULTIPLY:
+    case OPCODE_DIVIDE:
+    case OPCODE_VAR:
+    case OPCODE_LOAD:
+    case OPCODE_STORE:
+    case OPCODE_CMP:
+    case OPCODE_EQ:
+    case OPCODE_WRITE:
+    case OPCODE_ADDI:
+    case OPCODE_SUBI:
+    case OPCODE_MULI:
+    case OPCODE_SQUARE:
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+    case OPCODE_INCVAR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool jit_translatable(const Program& prg, Bytecode bc) {
+    const std::uint32_t arg = static_cast<std::uint32_t>(bc.arg1);
+    if (!jit_native(bc.opcode))
+        return false;
+    switch (bc.opcode) {
+    case OPCODE_JMP:
+    case OPCODE_JMPIF:
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        return bc.arg1 >= 0 && arg <= program_code(prg).size();
+    case OPCODE_CALL:
+        return bc.arg1 >= 0 && arg < prg.functions.size();
+    case OPCODE_VAR:
+    case OPCODE_LOAD:
+    case OPCODE_STORE:
+    case OPCODE_INCVAR:
+    case OPCODE_DUP:
+        return bc.arg1 >= 0 && arg < (1u << 28);
+    default:
+        return true;
+    }
+}
+
+bool jit_ends_block(Opcode opcode) {
+    switch (opcode) {
+    case OPCODE_EXIT:
+    case OPCODE_JMP:
+    case OPCODE_JMPIF:
+    case OPCODE_CALL:
+    case OPCODE_RETURN:
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void jit_steps(JitAssembler& as, std::uint8_t ext, std::uint32_t count) {
+    if (count < 128) {
+        x64_reg(as, true, {0x83}, ext, RBP);                      /*add/sub rbp, count*/
+        as.code.push_back(static_cast<std::uint8_t>(count));
+    } else {
+        x64_reg(as, true, {0x81}, ext, RBP);
+        x64_u32(as, count);
+    }
+}
+
+void jit_instruction(JitAssembler& as, const Program& prg, std::size_t ip, Bytecode ins, std::uint32_t left) {
+    const std::int32_t slot = static_cast<std::int32_t>(static_cast<std::uint32_t>(ins.arg1) * sizeof(Arg));
+    switch (ins.opcode) {
+    case OPCODE_EXIT:
+        jit_exit(as, ip, JIT_EXIT);
+        break;
+    case OPCODE_NOP:
+    case OPCODE_LABEL:
+        break;
+    case OPCODE_PUT:
+        jit_push(as);
+        x64_mov_imm32(as, R13, static_cast<std::uint32_t>(ins.arg1));
+        break;
+    case OPCODE_POP:
+        jit_pop(as);
+        break;
+    case OPCODE_DUPLAST:
+        jit_push(as);
+        break;
+    case OPCODE_DUP:
+        jit_push(as);
+        x64_mem(as, true, {0x8B}, RAX, R12, LEMONVM_JIT_CTX(stack_base));
+        x64_mem(as, false, {0x8B}, R13, RAX, 4 * (ins.arg1 + 1));   /*mov r13d, [rax + 4 * (arg + 1)]*/
+        break;
+    case OPCODE_SWAP:
+        x64_mem(as, false, {0x8B}, RAX, RBX, -4);                 /*mov eax, [rbx - 4]*/
+        x64_mem(as, false, {0x89}, R13, RBX, -4);                 /*mov [rbx - 4], r13d*/
+        x64_reg(as, false, {0x89}, RAX, R13);                     /*mov r13d, eax*/
+        break;
+    case OPCODE_JMP:
+        x64_jmp_ip(as, ins.arg1);
+        break;
+    case OPCODE_JMPIF:
+        x64_reg(as, false, {0x89}, R13, RAX);                     /*mov eax, r13d*/
+        jit_pop(as);
+        x64_reg(as, false, {0x85}, RAX, RAX);                     /*test eax, eax*/
+        x64_jcc_ip(as, X64_NE, ins.arg1);
+        break;
+    case OPCODE_CALL:
+        x64_reg(as, true, {0x89}, R12, RDI);
+        x64_mov_imm32(as, RSI, static_cast<std::uint32_t>(ip));
+        x64_mov_imm32(as, RDX, static_cast<std::uint32_t>(ins.arg1));
+        x64_call_to(as, as.call);
+        x64_reg(as, true, {0x89}, RAX, R14);                      /*mov r14, rax*/
+        x64_jmp_ip(as, prg.functions[ins.arg1].entry);
+        break;
+    case OPCODE_RETURN:
+        x64_mov_imm32(as, RSI, static_cast<std::uint32_t>(ip));
+        x64_reg(as, true, {0x89}, R12, RDI);
+        x64_call_to(as, as.ret);
+        x64_mem(as, true, {0x8B}, R14, R12, LEMONVM_JIT_CTX(frame));
+        x64_reg(as, false, {0xFF}, 4, RAX);                       /*jmp rax*/
+        break;
+    case OPCODE_PLUS:
+        x64_reg(as, true, {0x83}, 5, RBX); as.code.push_back(4);
+        x64_mem(as, false, {0x03}, R13, RBX, 0);                  /*add r13d, [rbx]*/
+        break;
+    case OPCODE_MINUS:
+        x64_reg(as, false, {0x89}, R13, RAX);
+        jit_pop(as);
+        x64_reg(as, false, {0x29}, RAX, R13);                     /*sub r13d, eax*/
+        break;
+    case OPCODE_MULTIPLY:
+        x64_reg(as, true, {0x83}, 5, RBX); as.code.push_back(4);
+        x64_mem(as, false, {0x0F, 0xAF}, R13, RBX, 0);            /*imul r13d, [rbx]*/
+        break;
+    case OPCODE_DIVIDE: {
+        x64_reg(as, false, {0x85}, R13, R13);                     /*test r13d, r13d*/
+        const std::size_t zero = x64_skip(as, X64_E);
+        x64_reg(as, false, {0x83}, 7, R13); as.code.push_back(0xFF); /*cmp r13d, -1*/
+        const std::size_t safe = x64_skip(as, X64_NE);
+        x64_mem(as, false, {0x81}, 7, RBX, -4);                   /*cmp dword [rbx - 4], INT_MIN*/
+        x64_u32(as, 0x80000000u);
+        const std::size_t overflow = x64_skip(as, X64_E);
+        x64_skip_here(as, safe);
+        x64_mem(as, false, {0x8B}, RAX, RBX, -4);                 /*mov eax, [rbx - 4]*/
+        as.code.push_back(0x99);                                  /*cdq*/
+        x64_reg(as, false, {0xF7}, 7, R13);                       /*idiv r13d*/
+        x64_reg(as, true, {0x83}, 5, RBX); as.code.push_back(4);
+        x64_reg(as, false, {0x89}, RAX, R13);                     /*mov r13d, eax*/
+        x64_bytes(as, {0xEB, 0});                                 /*jmp done*/
+        const std::size_t done = as.code.size();
+        x64_skip_here(as, zero);
+        x64_skip_here(as, overflow);
+        jit_steps(as, 5, left);
+        jit_exit(as, ip, JIT_FALLBACK);
+        x64_skip_here(as, done);
+        break;
+    }
+    case OPCODE_VAR:
+        x64_mem(as, false, {0xC7}, 0, R14, slot);
+        x64_u32(as, 0);
+        break;
+    case OPCODE_LOAD:
+        jit_push(as);
+        x64_mem(as, false, {0x8B}, R13, R14, slot);
+        break;
+    case OPCODE_STORE:
+        x64_mem(as, false, {0x89}, R13, R14, slot);
+        jit_pop(as);
+        break;
+    case OPCODE_INCVAR:
+        x64_mem(as, false, {0x83}, 0, R14, slot); as.code.push_back(1);
+        break;
+    case OPCODE_EQ:
+        x64_reg(as, true, {0x83}, 5, RBX); as.code.push_back(4);
+        x64_mem(as, false, {0x3B}, R13, RBX, 0);                  /*cmp r13d, [rbx]*/
+        x64_reg(as, false, {0x0F, 0x94}, 0, RAX);                 /*sete al*/
+        x64_reg(as, false, {0x0F, 0xB6}, R13, RAX);               /*movzx r13d, al*/
+        break;
+    case OPCODE_WRITE:
+        x64_reg(as, true, {0x89}, R12, RDI);
+        x64_reg(as, false, {0x89}, R13, RSI);                     /*mov esi, r13d*/
+        x64_call_to(as, as.write);
+        jit_pop(as);
+        break;
+    case OPCODE_CMP:
+        x64_reg(as, false, {0x89}, R13, RAX);
+        jit_pop(as);
+        x64_reg(as, false, {0x39}, RAX, R13);                     /*cmp r13d, eax*/
+        x64_reg(as, false, {0x0F, 0x9C}, 0, RAX);                 /*setl al*/
+        x64_reg(as, false, {0x0F, 0x9F}, 0, RCX);                 /*setg cl*/
+        x64_reg(as, false, {0x0F, 0xB6}, RAX, RAX);
+        x64_reg(as, false, {0x0F, 0xB6}, RCX, RCX);
+        x64_reg(as, false, {0x29}, RCX, RAX);                     /*sub eax, ecx*/
+        x64_reg(as, false, {0x89}, RAX, R13);
+        break;
+    case OPCODE_ADDI:
+        x64_reg(as, false, {0x81}, 0, R13);
+        x64_u32(as, static_cast<std::uint32_t>(ins.arg1));
+        break;
+    case OPCODE_SUBI:
+        x64_reg(as, false, {0x81}, 5, R13);
+        x64_u32(as, static_cast<std::uint32_t>(ins.arg1));
+        break;
+    case OPCODE_MULI:
+        x64_reg(as, false, {0x69}, R13, R13);
+        x64_u32(as, static_cast<std::uint32_t>(ins.arg1));
+        break;
+    case OPCODE_SQUARE:
+        x64_reg(as, false, {0x0F, 0xAF}, R13, R13);
+        break;
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        x64_reg(as, false, {0x89}, R13, RAX);
+        x64_mem(as, false, {0x8B}, RCX, RBX, -4);                 /*mov ecx, [rbx - 4]*/
+        x64_reg(as, true, {0x83}, 5, RBX); as.code.push_back(8);
+        x64_mem(as, false, {0x8B}, R13, RBX, 0);
+        x64_reg(as, false, {0x39}, RCX, RAX);                     /*cmp eax, ecx*/
+        x64_jcc_ip(as, ins.opcode == OPCODE_JNE ? X64_NE : X64_E, ins.arg1);
+        break;
+    default:
+        jit_exit(as, ip, JIT_FALLBACK);
+        break;
+    }
+}
+
+std::vector<bool> jit_leaders(const Program& prg) {
+    std::span<const Bytecode> code = program_code(prg);
+    std::vector<bool> leaders(code.size() + 1, false);
+    leaders[0] = true;
+    for (auto& fn: prg.functions)
+        leaders[fn.entry] = true;
+    for (std::size_t ip = 0; ip < code.size(); ip++) {
+        const Opcode opcode = code[ip].opcode;
+        if (!jit_translatable(prg, code[ip])) {
+            leaders[ip] = leaders[ip + 1] = true;
+            continue;
+        }
+        if (opcode == OPCODE_JMP || opcode == OPCODE_JMPIF || opcode == OPCODE_JNE || opcode == OPCODE_JEQ)
+            leaders[code[ip].arg1] = true;
+        if (jit_ends_block(opcode))
+            leaders[ip + 1] = true;
+    }
+    return leaders;
+}
+
+std::uint32_t jit_block_length(const Program& prg, const std::vector<bool>& leaders, std::size_t ip) {
+    std::span<const Bytecode> code = program_code(prg);
+    std::uint32_t length = 0;
+    for (std::size_t i = ip; i < code.size() && jit_translatable(prg, code[i]); i++) {
+        if (i != ip && leaders[i])
+            break;
+        length++;
+        if (jit_ends_block(code[i].opcode))
+            break;
+    }
+    return length;
+}
+
+int jit_stack_effect(Opcode opcode) {
+    switch (opcode) {
+    case OPCODE_PUT:
+    case OPCODE_DUP:
+    case OPCODE_DUPLAST:
+    case OPCODE_LOAD:
+        return 1;
+    case OPCODE_POP:
+    case OPCODE_STORE:
+    case OPCODE_PLUS:
+    case OPCODE_MINUS:
+    case OPCODE_MULTIPLY:
+    case OPCODE_DIVIDE:
+    case OPCODE_WRITE:
+    case OPCODE_EQ:
+    case OPCODE_CMP:
+    case OPCODE_JMPIF:
+        return -1;
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        return -2;
+    default:
+        return 0;
+    }
+}
+
+std::uint32_t jit_block_pushes(std::span<const Bytecode> code, std::size_t ip, std::uint32_t length) {
+    int depth = 0;
+    int pushes = 0;
+    for (std::size_t i = ip; i < ip + length; i++) {
+        depth += jit_stack_effect(code[i].opcode);
+        pushes = std::max(pushes, depth);
+    }
+    return static_cast<std::uint32_t>(pushes);
+}
+
+State jit_compile(const Program& prg, Jit& jit) {
+    jit_free(jit);
+#ifdef LEMONVM_JIT
+    if (!is_linked(prg) || prg.value != VALUE_INT32 || !prg.verification.verified)
+        return State::ERR;
+    std::span<const Bytecode> code = program_code(prg);
+    const std::vector<bool> leaders = jit_leaders(prg);
+    std::size_t block_end = 0;
+    JitAssembler as{};
+    as.code.reserve(64 + code.size() * 24);
+    as.offsets.resize(code.size() + 1);
+    jit_prologue(as);
+    jit_stubs(as);
+    for (std::size_t ip = 0; ip < code.size(); ip++) {
+        as.offsets[ip] = as.code.size();
+        if (!jit_translatable(prg, code[ip])) {
+            jit_exit(as, ip, JIT_FALLBACK);
+            continue;
+        }
+        if (leaders[ip]) {
+            const std::uint32_t length = jit_block_length(prg, leaders, ip);
+            const std::uint32_t pushes = jit_block_pushes(code, ip, length);
+            block_end = ip + length;
+            jit_steps(as, 0, length);
+            if (pushes > 0)
+                jit_reserve(as, pushes);
+        }
+        jit_instruction(as, prg, ip, code[ip], static_cast<std::uint32_t>(block_end - ip));
+    }
+    as.offsets[code.size()] = as.code.size();
+    jit_exit(as, code.size(), JIT_END);
+    for (auto& fixup: as.fixups) {
+        const std::uint32_t rel = static_cast<std::uint32_t>(as.offsets[fixup.ip] - (fixup.at + 4));
+        std::memcpy(as.code.data() + fixup.at, &rel, sizeof(rel));
+    }
+
+    void* mem = mmap(nullptr, as.code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return State::ERR;
+    std::memcpy(mem, as.code.data(), as.code.size());
+    if (mprotect(mem, as.code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, as.code.size());
+        return State::ERR;
+    }
+    jit.code = static_cast<std::uint8_t*>(mem);
+    jit.code_size = as.code.size();
+    jit.entries.assign(code.size(), nullptr);
+    jit.stops.assign(code.size() + 1, 0);
+    for (std::size_t ip = 0; ip < code.size(); ip++) {
+        if (leaders[ip] && jit_translatable(prg, code[ip])) {
+            jit.entries[ip] = jit.code + as.offsets[ip];
+            jit.stops[ip] = 1;
+        }
+    }
+    jit.end = jit.code + as.end;
+    jit.fallback = jit.code + as.fallback;
+    jit.empty = jit.code + as.empty;
+    return State::OK;
+#else
+    (void)prg;
+    return State::ERR;
+#endif
+}
+
+JitExit jit_enter(VM& vm, const Program& prg, const Jit& jit, const void* entry) {
+    JitContext ctx{};
+    const std::size_t depth = vm.stack.size();
+    vm.stack.reserve(std::max<std::size_t>(2 * depth + 1, 63));
+    ctx.stack_base = vm.stack.slots.data();
+    ctx.stack_end = ctx.stack_base + vm.stack.slots.size();
+    ctx.sp = ctx.stack_base + depth;
+    ctx.tos = *ctx.sp;
+    ctx.frame = vm.locals.data() + vm.fp;
+    ctx.steps = vm.steps;
+    ctx.ip = vm.ip;
+    ctx.vm = &vm;
+    ctx.prg = &prg;
+    ctx.jit = &jit;
+
+    const JitEntry enter = reinterpret_cast<JitEntry>(jit.code);
+    const JitExit exit = static_cast<JitExit>(enter(&ctx, entry));
+
+    *ctx.sp = ctx.tos;
+    vm.stack.count = ctx.sp - ctx.stack_base;
+    vm.ip = ctx.ip;
+    vm.steps = ctx.steps;
+    return exit;
+}
+
+State jit_resume(VM& vm, const Program& prg, const Jit& jit) {
+    if (!jit.code || verified_room(vm, prg) == 0)
+        return iset_resume(vm, prg);
+    const std::size_t size = program_code(prg).size();
+    assert(jit.entries.size() == size);
+    for (;;) {
+        if (vm.ip >= size)
+            return output_end(vm, State::OK);
+        const void* entry = jit.entries[vm.ip];
+        if (!entry) {
+            const std::size_t room = verified_room(vm, prg);
+            const State state = room == 0
+                ? iset_eval_engine<EVAL_STOP | EVAL_CHECKED>(vm, prg, nullptr, 0, 0, jit.stops.data())
+                : iset_eval_engine<EVAL_STOP>(vm, prg, nullptr, 0, room, jit.stops.data());
+            if (state != State::SUSPENDED)
+                return state;
+            continue;
+        }
+        const JitExit exit = jit_enter(vm, prg, jit, entry);
+        if (exit == JIT_END)
+            return output_end(vm, State::OK);
+        if (exit == JIT_EXIT)
+            return output_end(vm, State::EXIT);
+    }
+}
+
+State jit_eval(VM& vm, const Program& prg, const Jit& jit) {
+    if (!is_linked(prg))
+        return State::ERR;
+    vm_start(vm, prg);
+    return jit_resume(vm, prg, jit);
+}
+
+}//ns
@@ -6,33 +6,45 @@
 namespace LemonVM {
 
 struct Token {
-    std::string str{};
-    std::size_t line{0}; 
+    std::string_view str{};
+    std::size_t line{1};
+    std::size_t column{1};
 };
 
 using Tokens = std::vector<Token>;
 
-void print_tokens(Tokens tokens) {
+void print_tokens(const Tokens& tokens) {
     std::size_t i = 0;
-    for (auto tok: tokens)
-        std::cout << i++ << ") =" << tok.str << "=\n";
+    for (auto& tok: tokens)
+        std::cout << i++ << ") " << tok.line << ":" << tok.column << " =" << tok.str << "=\n";
     std::cout << std::endl;
 }
 
-void trim_left(std::string::iterator& curr, const std::string::iterator eof) {
-    auto is_whitespace = [](char c) { return (c == ' ' || c == '\t'); };
-    auto is_comment    = [](char c) { return (c == '#'); };
-    auto is_endline    = [](char c) { return (c == '\n'); };
+struct LexCursor {
+    std::string_view src{};
+    std::size_t pos{0};
+    std::size_t line{1};
+    std::size_t line_start{0};
+};
+
+constexpr bool is_whitespace(char c) { return (c == ' ' || c == '\t' || c == '\r'); }
+constexpr bool is_comment(char c)    { return (c == '#'); }
+constexpr bool is_endline(char c)    { return (c == '\n'); }
 
-    while (curr != eof) {
-        if (is_whitespace(*curr)) {
-            curr++;
+constexpr void trim_left(LexCursor& cur) {
+    while (cur.pos < cur.src.size()) {
+        const char c = cur.src[cur.pos];
+        if (is_endline(c)) {
+            cur.pos++;
+            cur.line++;
+            cur.line_start = cur.pos;
+        }
+        else if (is_whitespace(c)) {
+            cur.pos++;
         }
-        else if (is_comment(*curr)) {
-            while (curr != eof && !is_endline(*curr))
-                curr++;
-            curr++;
-            curr++;
+        else if (is_comment(c)) {
+            while (cur.pos < cur.src.size() && !is_endline(cur.src[cur.pos]))
+                cur.pos++;
         }
         else {
             break;
@@ -40,50 +52,47 @@ void trim_left(std::string::iterator& curr, const std::string::iterator eof) {
     }
 }
 
-Token extract_token(std::string::iterator start, const std::string::iterator eof) {
-    auto is_whitespace = [](char c) { return (c == ' ' || c == '\t'); };
-    auto is_comment    = [](char c) { return (c == '#'); };
-    auto is_endline    = [](char c) { return (c == '\n'); };
-
-    std::string::iterator end = start;
-    while (end != eof) {
-        if (is_whitespace(*end) || is_endline(*end) || is_comment(*end))
+constexpr Token extract_token(LexCursor& cur) {
+    const std::size_t start = cur.pos;
+    while (cur.pos < cur.src.size()) {
+        const char c = cur.src[cur.pos];
+        if (is_whitespace(c) || is_endline(c) || is_comment(c))
             break;
-        end++;
+        cur.pos++;
     }
-    return Token{std::string(start, end), 0};
+    return Token{cur.src.substr(start, cur.pos - start), cur.line, start - cur.line_start + 1};
 }
 
-Tokens tokenize(std::string prg) {
+Tokens tokenize(std::string_view prg) {
     Tokens tokens{};
-    std::string::iterator curr = prg.begin();
-    std::string::iterator eof = prg.end();
-    while (curr != eof) {
-        trim_left(curr, eof);
-        if (curr == eof)
+    tokens.reserve(prg.size() / 8); /*Rough guess, most tokens are short*/
+    LexCursor cur{prg};
+    for (;;) {
+        trim_left(cur);
+        if (cur.pos == cur.src.size())
             return tokens;
-        tokens.emplace_back(extract_token(curr, eof));
-        curr += tokens.back().str.size() + 1;
+        tokens.push_back(extract_token(cur));
     }
-    return tokens;
 }
 
-InstructionSet assemble(const Tokens& tokens) {
-    InstructionSet iset{};
+template<ValueType T = Arg>
+BasicInstructionSet<T> assemble(const Tokens& tokens) {
+    BasicInstructionSet<T> iset{};
     std::size_t i = 0;
     while (i < tokens.size()) {
-        Instruction ins;
+        BasicInstruction<T> ins;
         ins.opcode = get_opcode(tokens[i].str);
-        if (ins.opcode == OPCODE_PUT || ins.opcode == OPCODE_DUP) {
+        const Operand operand = operand_of(ins.opcode);
+        if (operand != Operand::NONE) {
             i++;
-            assert(!is_opcode(tokens[i].str));
-            ins.arg1 = std::stoi(tokens[i].str);
+            assert(i < tokens.size() && !is_opcode(tokens[i].str));
         }
-        else if (ins.opcode == OPCODE_LABEL || ins.opcode == OPCODE_JMPIF ||
-            ins.opcode == OPCODE_CALL) {
-            i++;
-            assert(!is_opcode(tokens[i].str));
-            ins.label = tokens[i].str;
+        if (operand == Operand::INT || operand == Operand::VALUE) {
+            [[maybe_unused]] const bool ok = parse_arg(tokens[i].str, ins.arg1);
+            assert(ok && "expected number");
+        }
+        else if (operand == Operand::NAME) {
+            ins.label = std::string(tokens[i].str);
         }
         iset.push_back(ins);
         i++;
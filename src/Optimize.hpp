@@ -0,0 +1,514 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "InstructionSet.hpp"
+#include "Eval.hpp"
+
+namespace LemonVM {
+
+enum OptLevel : int {
+    OPT_O0 = 0,
+    OPT_O1 = 1,
+    OPT_O2 = 2,
+};
+
+bool opt_is_jump(Opcode opcode) {
+    return opcode == OPCODE_JMP || opcode == OPCODE_JMPIF || opcode == OPCODE_JNE || opcode == OPCODE_JEQ;
+}
+
+bool opt_stops(Opcode opcode) {
+    return opcode == OPCODE_EXIT || opcode == OPCODE_RETURN || opcode == OPCODE_INVALID || opcode == OPCODE_COUNT;
+}
+
+struct BasicBlock {
+    std::size_t begin{0};
+    std::size_t end{0};
+};
+using BasicBlocks = std::vector<BasicBlock>;
+
+BasicBlocks iset_blocks(const InstructionSet& iset) {
+    BasicBlocks blocks{};
+    std::size_t begin = 0;
+    for (std::size_t i = 0; i < iset.size(); i++) {
+        if (iset[i].opcode == OPCODE_LABEL && i > begin) {
+            blocks.push_back({begin, i});
+            begin = i;
+        }
+        if (opt_is_jump(iset[i].opcode) || opt_stops(iset[i].opcode)) {
+            blocks.push_back({begin, i + 1});
+            begin = i + 1;
+        }
+    }
+    if (begin < iset.size())
+        blocks.push_back({begin, iset.size()});
+    return blocks;
+}
+
+bool opt_always_jumps(const InstructionSet& iset, std::size_t i) {
+    if (iset[i].opcode == OPCODE_JMP)
+        return true;
+    return iset[i].opcode == OPCODE_JMPIF && i > 0 && iset[i - 1].opcode == OPCODE_PUT && iset[i - 1].arg1 != 0;
+}
+
+std::map<std::string, bool> opt_targets(const InstructionSet& iset) {
+    std::map<std::string, bool> targets{};
+    for (auto& ins: iset) {
+        if (ins.opcode == OPCODE_CALL || ins.opcode == OPCODE_SPAWN)
+            targets[ins.label] = true;
+        else if (opt_is_jump(ins.opcode))
+            targets.insert({ins.label, false});
+    }
+    return targets;
+}
+
+bool opt_called(const std::map<std::string, bool>& targets, const Instruction& ins) {
+    auto it = targets.find(ins.label);
+    return ins.opcode == OPCODE_LABEL && it != targets.end() && it->second;
+}
+
+std::size_t iset_strip_labels(InstructionSet& iset) {
+    const std::map<std::string, bool> targets = opt_targets(iset);
+    const std::size_t before = iset.size();
+    std::erase_if(iset, [&](const Instruction& ins) {
+        return ins.opcode == OPCODE_NOP || (ins.opcode == OPCODE_LABEL && !targets.count(ins.label));
+    });
+    return before - iset.size();
+}
+
+bool fold_binary(Opcode opcode, Arg b, Arg a, Arg& result) {
+    const std::int64_t x = b;
+    const std::int64_t y = a;
+    switch (opcode) {
+    case OPCODE_PLUS:
+    case OPCODE_ADDI:
+        result = static_cast<Arg>(static_cast<std::uint32_t>(x + y));
+        return true;
+    case OPCODE_MINUS:
+    case OPCODE_SUBI:
+        result = static_cast<Arg>(static_cast<std::uint32_t>(x - y));
+        return true;
+    case OPCODE_MULTIPLY:
+    case OPCODE_MULI:
+    case OPCODE_SQUARE:
+        result = static_cast<Arg>(static_cast<std::uint32_t>(x * y));
+        return true;
+    case OPCODE_DIVIDE:
+        if (a == 0 || (a == -1 && b == std::numeric_limits<Arg>::min()))
+            return false;
+        result = b / a;
+        return true;
+    case OPCODE_EQ:
+        result = b == a ? 1 : 0;
+        return true;
+    case OPCODE_CMP:
+        result = b == a ? 0 : b < a ? 1 : -1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool opt_puts(const InstructionSet& out, std::size_t n) {
+    if (out.size() < n)
+        return false;
+    for (std::size_t i = out.size() - n; i < out.size(); i++) {
+        if (out[i].opcode != OPCODE_PUT)
+            return false;
+    }
+    return true;
+}
+
+bool fold_instruction(InstructionSet& out, const Instruction& ins) {
+    Arg result{};
+    switch (ins.opcode) {
+    case OPCODE_PLUS:
+    case OPCODE_MINUS:
+    case OPCODE_MULTIPLY:
+    case OPCODE_DIVIDE:
+    case OPCODE_EQ:
+    case OPCODE_CMP:
+        if (!opt_puts(out, 2) || !fold_binary(ins.opcode, out[out.size() - 2].arg1, out.back().arg1, result))
+            break;
+        out.pop_back();
+        out.back().arg1 = result;
+        return true;
+    case OPCODE_ADDI:
+    case OPCODE_SUBI:
+    case OPCODE_MULI:
+    case OPCODE_SQUARE:
+        if (!opt_puts(out, 1))
+            break;
+        fold_binary(ins.opcode, out.back().arg1, ins.opcode == OPCODE_SQUARE ? out.back().arg1 : ins.arg1, result);
+        out.back().arg1 = result;
+        return true;
+    case OPCODE_DUPLAST:
+        if (!opt_puts(out, 1))
+            break;
+        out.push_back(out.back());
+        return true;
+    case OPCODE_POP:
+        if (!opt_puts(out, 1))
+            break;
+        out.pop_back();
+        return true;
+    case OPCODE_SWAP:
+        if (!opt_puts(out, 2))
+            break;
+        std::swap(out[out.size() - 2].arg1, out.back().arg1);
+        return true;
+    case OPCODE_JMPIF:
+        if (!opt_puts(out, 1))
+            break;
+        if (out.back().arg1 != 0)
+            out.back() = ins_jmp(ins.label);
+        else
+            out.pop_back();
+        return true;
+    case OPCODE_JNE:
+    case OPCODE_JEQ: {
+        if (!opt_puts(out, 2))
+            break;
+        const bool equal = out[out.size() - 2].arg1 == out.back().arg1;
+        out.resize(out.size() - 2);
+        if (equal == (ins.opcode == OPCODE_JEQ))
+            out.push_back(ins_jmp(ins.label));
+        return true;
+    }
+    default:
+        break;
+    }
+    out.push_back(ins);
+    return false;
+}
+
+std::size_t iset_fold(InstructionSet& iset) {
+    InstructionSet out{};
+    out.reserve(iset.size());
+    std::size_t folded = 0;
+    for (auto& ins: iset)
+        folded += fold_instruction(out, ins);
+    iset = std::move(out);
+    return folded;
+}
+
+std::size_t opt_skip_labels(const InstructionSet& iset, std::size_t i) {
+    while (i < iset.size() && (iset[i].opcode == OPCODE_LABEL || iset[i].opcode == OPCODE_NOP))
+        i++;
+    return i;
+}
+
+bool opt_jumps_at(const InstructionSet& iset, std::size_t i) {
+    if (i < iset.size() && iset[i].opcode == OPCODE_JMP)
+        return true;
+    return i + 1 < iset.size() && iset[i + 1].opcode == OPCODE_JMPIF && opt_always_jumps(iset, i + 1);
+}
+
+std::string thread_target(const InstructionSet& iset, const LabelMap& labels, std::string label) {
+    for (std::size_t hops = 0; hops < iset.size(); hops++) {
+        auto it = labels.find(label);
+        if (it == labels.end())
+            break;
+        const std::size_t i = opt_skip_labels(iset, it->second);
+        if (!opt_jumps_at(iset, i))
+            break;
+        const Instruction& jump = iset[iset[i].opcode == OPCODE_JMP ? i : i + 1];
+        if (jump.label == label)
+            break;
+        label = jump.label;
+    }
+    return label;
+}
+
+std::size_t iset_thread_jumps(InstructionSet& iset) {
+    const LabelMap labels = extract_labels(iset);
+    std::size_t threaded = 0;
+    InstructionSet out{};
+    out.reserve(iset.size());
+    for (std::size_t i = 0; i < iset.size(); i++) {
+        Instruction ins = iset[i];
+        if (!opt_is_jump(ins.opcode)) {
+            out.push_back(ins);
+            continue;
+        }
+        const std::string target = thread_target(iset, labels, ins.label);
+        threaded += target != ins.label;
+        ins.label = target;
+        auto it = labels.find(target);
+        if (it != labels.end() && it->second > i && opt_skip_labels(iset, i + 1) > it->second) {
+            if (ins.opcode != OPCODE_JMP)
+                out.push_back(ins_pop());
+            if (ins.opcode == OPCODE_JNE || ins.opcode == OPCODE_JEQ)
+                out.push_back(ins_pop());
+            threaded++;
+            continue;
+        }
+        out.push_back(ins);
+    }
+    iset = std::move(out);
+    return threaded;
+}
+
+std::vector<bool> opt_reachable(const InstructionSet& iset, const BasicBlocks& blocks) {
+    std::map<std::string, std::size_t> block_of{};
+    for (std::size_t b = 0; b < blocks.size(); b++) {
+        if (iset[blocks[b].begin].opcode == OPCODE_LABEL)
+            block_of[iset[blocks[b].begin].label] = b;
+    }
+    std::vector<bool> reachable(blocks.size(), false);
+    std::vector<std::size_t> work{};
+    auto reach = [&](std::size_t b) {
+        if (b < blocks.size() && !reachable[b]) {
+            reachable[b] = true;
+            work.push_back(b);
+        }
+    };
+    reach(0);
+    while (!work.empty()) {
+        const BasicBlock block = blocks[work.back()];
+        const std::size_t b = work.back();
+        work.pop_back();
+        for (std::size_t i = block.begin; i < block.end; i++) {
+            const Instruction& ins = iset[i];
+            if (ins.opcode == OPCODE_CALL || ins.opcode == OPCODE_SPAWN || opt_is_jump(ins.opcode)) {
+                auto it = block_of.find(ins.label);
+                if (it != block_of.end())
+                    reach(it->second);
+            }
+        }
+        const std::size_t last = block.end - 1;
+        if (!opt_stops(iset[last].opcode) && !opt_always_jumps(iset, last))
+            reach(b + 1);
+    }
+    return reachable;
+}
+
+std::size_t iset_remove_unreachable(InstructionSet& iset) {
+    const BasicBlocks blocks = iset_blocks(iset);
+    std::vector<bool> keep = opt_reachable(iset, blocks);
+    const std::map<std::string, bool> targets = opt_targets(iset);
+    std::vector<std::size_t> fn(blocks.size(), 0);
+    for (std::size_t b = 1; b < blocks.size(); b++)
+        fn[b] = fn[b - 1] + opt_called(targets, iset[blocks[b].begin]);
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        std::map<std::pair<std::size_t, std::string>, bool> created{};
+        for (std::size_t b = 0; b < blocks.size(); b++) {
+            for (std::size_t i = blocks[b].begin; keep[b] && i < blocks[b].end; i++) {
+                const Instruction& ins = iset[i];
+                if (ins.opcode == OPCODE_VAR || ins.opcode == OPCODE_STORE)
+                    created[{fn[b], ins.label}] = true;
+                else if (ins.opcode == OPCODE_LOAD || ins.opcode == OPCODE_INCVAR)
+                    created.insert({{fn[b], ins.label}, false});
+            }
+        }
+        for (std::size_t b = 0; b < blocks.size(); b++) {
+            for (std::size_t i = blocks[b].begin; !keep[b] && i < blocks[b].end; i++) {
+                const Instruction& ins = iset[i];
+                auto it = created.find({fn[b], ins.label});
+                if ((ins.opcode == OPCODE_VAR || ins.opcode == OPCODE_STORE) && it != created.end() && !it->second)
+                    keep[b] = changed = true;
+            }
+        }
+    }
+
+    InstructionSet out{};
+    out.reserve(iset.size());
+    for (std::size_t b = 0; b < blocks.size(); b++) {
+        if (keep[b])
+            out.insert(out.end(), iset.begin() + blocks[b].begin, iset.begin() + blocks[b].end);
+    }
+    const std::size_t removed = iset.size() - out.size();
+    iset = std::move(out);
+    return removed;
+}
+
+std::size_t opt_function_end(const InstructionSet& iset, const std::map<std::string, bool>& targets, std::size_t begin) {
+    std::size_t end = begin + 1;
+    while (end < iset.size() && !opt_called(targets, iset[end]))
+        end++;
+    return end;
+}
+
+std::vector<std::string> opt_fresh_variables(const InstructionSet& iset, std::size_t begin, std::size_t end) {
+    std::map<std::string, bool> written{};
+    std::vector<std::string> fresh{};
+    bool straight = true;
+    for (std::size_t i = begin + 1; i < end; i++) {
+        const Instruction& ins = iset[i];
+        if (ins.opcode == OPCODE_LABEL)
+            straight = false;
+        const bool reads = ins.opcode == OPCODE_LOAD || ins.opcode == OPCODE_INCVAR;
+        if (reads && !written.count(ins.label) && std::find(fresh.begin(), fresh.end(), ins.label) == fresh.end())
+            fresh.push_back(ins.label);
+        if (straight && (ins.opcode == OPCODE_VAR || ins.opcode == OPCODE_STORE))
+            written[ins.label] = true;
+        if (opt_is_jump(ins.opcode) || opt_stops(ins.opcode))
+            straight = false;
+    }
+    return fresh;
+}
+
+bool opt_inlinable(const InstructionSet& iset, const LabelMap& labels, BasicBlock fn, std::size_t max_size) {
+    if (fn.begin == 0 || fn.end - fn.begin < 2 || fn.end - fn.begin - 1 > max_size)
+        return false;
+    const Opcode last = iset[fn.end - 1].opcode;
+    if (last != OPCODE_RETURN && last != OPCODE_EXIT)
+        return false;
+    if (!opt_stops(iset[fn.begin - 1].opcode) && !opt_always_jumps(iset, fn.begin - 1))
+        return false;
+    for (std::size_t i = 0; i < iset.size(); i++) {
+        const Instruction& ins = iset[i];
+        const bool inside = i > fn.begin && i < fn.end;
+        if (inside && (ins.opcode == OPCODE_CALL || ins.opcode == OPCODE_SPAWN))
+            return false;
+        if (ins.opcode == OPCODE_SPAWN && ins.label == iset[fn.begin].label)
+            return false;
+        if (!opt_is_jump(ins.opcode))
+            continue;
+        auto it = labels.find(ins.label);
+        if (inside != (it != labels.end() && it->second >= fn.begin && it->second < fn.end))
+            return false;
+    }
+    return true;
+}
+
+std::string opt_unique_suffix(const InstructionSet& iset, BasicBlock fn, std::map<std::string, bool>& names) {
+    for (std::size_t n = 0;; n++) {
+        const std::string suffix = "@" + std::to_string(n);
+        bool unique = !names.count(iset[fn.begin].label + "@end" + suffix);
+        for (std::size_t i = fn.begin; unique && i < fn.end; i++)
+            unique = operand_of(iset[i].opcode) != Operand::NAME || !names.count(iset[i].label + suffix);
+        if (!unique)
+            continue;
+        names[iset[fn.begin].label + "@end" + suffix] = true;
+        for (std::size_t i = fn.begin; i < fn.end; i++) {
+            if (operand_of(iset[i].opcode) == Operand::NAME)
+                names[iset[i].label + suffix] = true;
+        }
+        return suffix;
+    }
+}
+
+void opt_inline_copy(InstructionSet& out, const InstructionSet& iset, BasicBlock fn, std::map<std::string, bool>& names) {
+    const std::string suffix = opt_unique_suffix(iset, fn, names);
+    const std::string end = iset[fn.begin].label + "@end" + suffix;
+    for (auto& name: opt_fresh_variables(iset, fn.begin, fn.end))
+        out.push_back(ins_var(name + suffix));
+    for (std::size_t i = fn.begin; i < fn.end; i++) {
+        Instruction ins = iset[i];
+        if (operand_of(ins.opcode) == Operand::NAME)
+            ins.label += suffix;
+        if (ins.opcode == OPCODE_RETURN && i + 1 == fn.end)
+            continue;
+        if (ins.opcode == OPCODE_RETURN)
+            ins = ins_jmp(end);
+        out.push_back(ins);
+    }
+    out.push_back(ins_label(end));
+}
+
+std::size_t iset_inline(InstructionSet& iset, std::size_t max_size = 16) {
+    const std::map<std::string, bool> targets = opt_targets(iset);
+    const LabelMap labels = extract_labels(iset);
+    std::map<std::string, BasicBlock> leaves{};
+    for (std::size_t i = 0; i < iset.size(); i++) {
+        if (!opt_called(targets, iset[i]))
+            continue;
+        const BasicBlock fn{i, opt_function_end(iset, targets, i)};
+        if (opt_inlinable(iset, labels, fn, max_size))
+            leaves[iset[i].label] = fn;
+    }
+    if (leaves.empty())
+        return 0;
+
+    std::map<std::string, bool> names{};
+    for (auto& ins: iset) {
+        if (operand_of(ins.opcode) == Operand::NAME)
+            names[ins.label] = true;
+    }
+    std::size_t inlined = 0;
+    InstructionSet out{};
+    out.reserve(iset.size());
+    for (auto& ins: iset) {
+        auto it = leaves.find(ins.label);
+        if (ins.opcode != OPCODE_CALL || it == leaves.end()) {
+            out.push_back(ins);
+            continue;
+        }
+        opt_inline_copy(out, iset, it->second, names);
+        inlined++;
+    }
+    iset = std::move(out);
+    return inlined;
+}
+
+std::size_t iset_tail_calls(InstructionSet& iset) {
+    const std::map<std::string, bool> targets = opt_targets(iset);
+    std::map<std::string, std::size_t> calls{};
+    for (auto& ins: iset) {
+        if (ins.opcode == OPCODE_CALL || ins.opcode == OPCODE_SPAWN)
+            calls[ins.label]++;
+    }
+
+    std::map<std::string, std::vector<std::size_t>> tails{};
+    std::map<std::string, std::size_t> begins{};
+    std::string fn{};
+    for (std::size_t i = 0; i < iset.size(); i++) {
+        if (opt_called(targets, iset[i])) {
+            fn = iset[i].label;
+            begins[fn] = i;
+        }
+        std::size_t next = i + 1;
+        while (next < iset.size() && iset[next].opcode == OPCODE_LABEL && !opt_called(targets, iset[next]))
+            next++;
+        if (iset[i].opcode == OPCODE_CALL && iset[i].label == fn && next < iset.size() && iset[next].opcode == OPCODE_RETURN)
+            tails[fn].push_back(i);
+    }
+
+    std::map<std::size_t, std::vector<std::string>> jumps{};
+    for (auto& [name, sites]: tails) {
+        if (sites.size() >= calls[name])
+            continue;
+        const std::size_t begin = begins[name];
+        const std::vector<std::string> fresh = opt_fresh_variables(iset, begin, opt_function_end(iset, targets, begin));
+        for (auto site: sites)
+            jumps[site] = fresh;
+    }
+    if (jumps.empty())
+        return 0;
+
+    InstructionSet out{};
+    out.reserve(iset.size());
+    for (std::size_t i = 0; i < iset.size(); i++) {
+        auto it = jumps.find(i);
+        if (it == jumps.end()) {
+            out.push_back(iset[i]);
+            continue;
+        }
+        for (auto& name: it->second)
+            out.push_back(ins_var(name));
+        out.push_back(ins_jmp(iset[i].label));
+    }
+    iset = std::move(out);
+    return jumps.size();
+}
+
+std::size_t iset_optimize(InstructionSet& iset, OptLevel level = OPT_O2) {
+    if (level == OPT_O0 || iset.empty())
+        return 0;
+    const std::size_t before = iset.size();
+    const bool entry_called = opt_called(opt_targets(iset), iset.front());
+    for (int round = 0; round < 16; round++) {
+        std::size_t changes = iset_strip_labels(iset) + iset_fold(iset);
+        if (level >= OPT_O2)
+            changes += iset_inline(iset) + iset_tail_calls(iset) + iset_thread_jumps(iset) + iset_remove_unreachable(iset);
+        if (changes == 0)
+            break;
+    }
+    if (!iset.empty() && !entry_called && opt_called(opt_targets(iset), iset.front()))
+        iset.insert(iset.begin(), ins_nop());
+    return before > iset.size() ? before - iset.size() : 0;
+}
+
+}//ns
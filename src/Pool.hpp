@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "Eval.hpp"
+
+namespace LemonVM {
+
+using SharedProgram = std::shared_ptr<const Program>;
+
+SharedProgram share_program(Program prg) {
+    return std::make_shared<const Program>(std::move(prg));
+}
+
+SharedProgram assemble_shared(std::string_view src) {
+    return share_program(assemble_program(src));
+}
+
+struct Pool {
+    std::vector<std::thread> workers{};
+    std::mutex mutex{};
+    std::condition_variable wake{};
+    std::deque<std::function<void()>> tasks{};
+    bool stopping{false};
+    ~Pool();
+};
+
+void pool_worker(Pool& pool) {
+    for (;;) {
+        std::function<void()> task{};
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.wake.wait(lock, [&]() { return pool.stopping || !pool.tasks.empty(); });
+            if (pool.tasks.empty())
+                return;
+            task = std::move(pool.tasks.front());
+            pool.tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void pool_submit(Pool& pool, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.tasks.push_back(std::move(task));
+    }
+    pool.wake.notify_one();
+}
+
+void pool_start(Pool& pool, std::size_t threads = std::thread::hardware_concurrency()) {
+    pool.stopping = false;
+    for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++)
+        pool.workers.emplace_back(pool_worker, std::ref(pool));
+}
+
+void pool_stop(Pool& pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (auto& worker: pool.workers)
+        worker.join();
+    pool.workers.clear();
+}
+
+Pool::~Pool() {
+    pool_stop(*this);
+}
+
+struct BatchResult {
+    State state{State::ERR};
+    VM vm{};
+};
+using BatchResults = std::vector<BatchResult>;
+
+BatchResults pool_eval(Pool& pool, const Program& prg, std::vector<VM> batch) {
+    BatchResults results(batch.size());
+    std::atomic<std::size_t> next{0};
+    auto work = [&]() {
+        for (std::size_t i = next++; i < batch.size(); i = next++) {
+            results[i].vm = std::move(batch[i]);
+            results[i].state = iset_eval(results[i].vm, prg);
+        }
+    };
+    const std::size_t tasks = std::min(pool.workers.size(), batch.size());
+    if (tasks == 0) {
+        work();
+        return results;
+    }
+    std::latch done(tasks);
+    for (std::size_t i = 0; i < tasks; i++)
+        pool_submit(pool, [&]() { work(); done.count_down(); });
+    done.wait();
+    return results;
+}
+
+BatchResults pool_eval(Pool& pool, const Program& prg, const std::vector<MemoryStack>& inputs) {
+    std::vector<VM> batch(inputs.size());
+    for (std::size_t i = 0; i < inputs.size(); i++)
+        batch[i].stack = inputs[i];
+    return pool_eval(pool, prg, std::move(batch));
+}
+
+}//ns
@@ -0,0 +1,502 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "Eval.hpp"
+
+namespace LemonVM {
+
+enum RegOpcode : std::uint8_t {
+    REG_NOP,
+    REG_MOV,
+    REG_ADD,
+    REG_SUB,
+    REG_MUL,
+    REG_DIV,
+    REG_EQ,
+    REG_CMP,
+    REG_SWAP,
+    REG_WRITE,
+    REG_JMP,
+    REG_JNZ,
+    REG_JNE,
+    REG_JEQ,
+    REG_CALL,
+    REG_RETURN,
+    REG_EXIT,
+    REG_LEAVE,
+};
+
+enum RegKind : std::uint8_t {
+    REG_SLOT,
+    REG_LOCAL,
+    REG_IMM,
+    REG_ABS,
+};
+
+struct RegOperand {
+    RegKind kind{REG_IMM};
+    Arg value{0};
+};
+
+struct RegInstruction {
+    RegOpcode opcode{REG_NOP};
+    RegOperand dst{};
+    RegOperand a{};
+    RegOperand b{};
+    std::uint32_t target{0};
+    std::uint32_t steps{0};
+    std::uint32_t ip{0};
+    std::int32_t height{0};
+};
+
+const std::uint32_t no_entry = std::numeric_limits<std::uint32_t>::max();
+
+struct RegisterProgram {
+    std::vector<RegInstruction> code{};
+    std::vector<std::uint32_t> entries{};
+    std::vector<std::uint8_t> stops{};
+};
+
+struct RegPending {
+    RegOpcode opcode{REG_NOP};
+    RegOperand a{};
+    RegOperand b{};
+};
+
+struct RegTranslator {
+    RegisterProgram& out;
+    std::vector<RegPending> stack{};
+    std::int32_t offset{0};
+    std::int32_t height{0};
+    std::int32_t dirty{0};
+    std::uint32_t steps{0};
+    std::uint32_t ip{0};
+};
+
+RegOperand reg_slot(std::int32_t height) {
+    return {REG_SLOT, height};
+}
+
+RegPending& reg_at(RegTranslator& tr, std::int32_t height) {
+    return tr.stack[height + tr.offset];
+}
+
+void reg_emit(RegTranslator& tr, RegInstruction ins) {
+    ins.steps = tr.steps;
+    ins.ip = tr.ip;
+    ins.height = tr.height;
+    tr.steps = 0;
+    tr.out.code.push_back(ins);
+}
+
+void reg_flush(RegTranslator& tr, std::int32_t upto) {
+    for (; tr.dirty <= upto; tr.dirty++) {
+        RegPending& p = reg_at(tr, tr.dirty);
+        if (p.opcode != REG_NOP)
+            reg_emit(tr, {p.opcode, reg_slot(tr.dirty), p.a, p.b});
+        p = RegPending{};
+    }
+}
+
+void reg_push(RegTranslator& tr, RegPending p) {
+    if (p.opcode != REG_NOP)
+        tr.dirty = std::min(tr.dirty, tr.height);
+    reg_at(tr, tr.height++) = p;
+}
+
+RegPending reg_pop(RegTranslator& tr) {
+    return reg_at(tr, --tr.height);
+}
+
+RegOperand reg_operand(RegTranslator& tr, std::int32_t height) {
+    const RegPending p = reg_at(tr, height);
+    if (p.opcode == REG_MOV)
+        return p.a;
+    if (p.opcode != REG_NOP)
+        reg_flush(tr, height);
+    return reg_slot(height);
+}
+
+void reg_protect(RegTranslator& tr, Arg local) {
+    auto reads = [&](const RegOperand& op) { return op.kind == REG_LOCAL && op.value == local; };
+    for (std::int32_t h = tr.dirty; h < tr.height; h++) {
+        const RegPending& p = reg_at(tr, h);
+        if (p.opcode != REG_NOP && (reads(p.a) || (p.opcode != REG_MOV && reads(p.b)))) {
+            reg_flush(tr, tr.height - 1);
+            return;
+        }
+    }
+}
+
+RegOpcode reg_binary(Opcode opcode) {
+    switch (opcode) {
+    case OPCODE_PLUS:
+    case OPCODE_ADDI:
+        return REG_ADD;
+    case OPCODE_MINUS:
+    case OPCODE_SUBI:
+        return REG_SUB;
+    case OPCODE_MULTIPLY:
+    case OPCODE_MULI:
+    case OPCODE_SQUARE:
+        return REG_MUL;
+    case OPCODE_EQ:
+        return REG_EQ;
+    default:
+        return REG_CMP;
+    }
+}
+
+bool reg_instruction(RegTranslator& tr, const Bytecode& bc) {
+    const std::int32_t h = tr.height;
+    switch (bc.opcode) {
+    case OPCODE_NOP:
+    case OPCODE_LABEL:
+        return true;
+    case OPCODE_PUT:
+        reg_push(tr, {REG_MOV, {REG_IMM, bc.arg1}});
+        return true;
+    case OPCODE_LOAD:
+        reg_push(tr, {REG_MOV, {REG_LOCAL, bc.arg1}});
+        return true;
+    case OPCODE_POP:
+        reg_pop(tr);
+        return true;
+    case OPCODE_DUPLAST:
+        reg_push(tr, {REG_MOV, reg_operand(tr, h - 1)});
+        return true;
+    case OPCODE_DUP:
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_MOV, reg_slot(h), {REG_ABS, bc.arg1}});
+        reg_push(tr, {});
+        return true;
+    case OPCODE_SWAP:
+        if (reg_at(tr, h - 2).opcode == REG_MOV && reg_at(tr, h - 1).opcode != REG_NOP) {
+            std::swap(reg_at(tr, h - 2), reg_at(tr, h - 1));
+            return true;
+        }
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_SWAP, reg_slot(h - 2), reg_slot(h - 1)});
+        return true;
+    case OPCODE_PLUS:
+    case OPCODE_MINUS:
+    case OPCODE_MULTIPLY:
+    case OPCODE_EQ:
+    case OPCODE_CMP: {
+        const RegOperand a = reg_operand(tr, h - 2);
+        const RegOperand b = reg_operand(tr, h - 1);
+        tr.height -= 2;
+        reg_push(tr, {reg_binary(bc.opcode), a, b});
+        return true;
+    }
+    case OPCODE_ADDI:
+    case OPCODE_SUBI:
+    case OPCODE_MULI:
+    case OPCODE_SQUARE: {
+        const RegOperand a = reg_operand(tr, h - 1);
+        const RegOperand b = bc.opcode == OPCODE_SQUARE ? a : RegOperand{REG_IMM, bc.arg1};
+        tr.height--;
+        reg_push(tr, {reg_binary(bc.opcode), a, b});
+        return true;
+    }
+    case OPCODE_DIVIDE:
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_DIV, reg_slot(h - 2), reg_slot(h - 2), reg_slot(h - 1)});
+        tr.height--;
+        return true;
+    case OPCODE_WRITE: {
+        const RegOperand a = reg_operand(tr, h - 1);
+        tr.height--;
+        reg_emit(tr, {REG_WRITE, {}, a});
+        return true;
+    }
+    case OPCODE_STORE: {
+        const RegPending p = reg_pop(tr);
+        reg_protect(tr, bc.arg1);
+        if (p.opcode == REG_NOP)
+            reg_emit(tr, {REG_MOV, {REG_LOCAL, bc.arg1}, reg_slot(h - 1)});
+        else
+            reg_emit(tr, {p.opcode, {REG_LOCAL, bc.arg1}, p.a, p.b});
+        return true;
+    }
+    case OPCODE_VAR:
+        reg_protect(tr, bc.arg1);
+        reg_emit(tr, {REG_MOV, {REG_LOCAL, bc.arg1}, {REG_IMM, 0}});
+        return true;
+    case OPCODE_INCVAR:
+        reg_protect(tr, bc.arg1);
+        reg_emit(tr, {REG_ADD, {REG_LOCAL, bc.arg1}, {REG_LOCAL, bc.arg1}, {REG_IMM, 1}});
+        return true;
+    case OPCODE_JMPIF: {
+        const RegOperand a = reg_operand(tr, h - 1);
+        tr.height--;
+        reg_flush(tr, h - 2);
+        reg_emit(tr, {REG_JNZ, {}, a, {}, static_cast<std::uint32_t>(bc.arg1)});
+        return true;
+    }
+    case OPCODE_JNE:
+    case OPCODE_JEQ: {
+        const RegOperand a = reg_operand(tr, h - 2);
+        const RegOperand b = reg_operand(tr, h - 1);
+        tr.height -= 2;
+        reg_flush(tr, h - 3);
+        reg_emit(tr, {bc.opcode == OPCODE_JNE ? REG_JNE : REG_JEQ, {}, a, b, static_cast<std::uint32_t>(bc.arg1)});
+        return true;
+    }
+    case OPCODE_JMP:
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_JMP, {}, {}, {}, static_cast<std::uint32_t>(bc.arg1)});
+        return false;
+    case OPCODE_CALL:
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_CALL, {}, {}, {}, static_cast<std::uint32_t>(bc.arg1)});
+        return false;
+    case OPCODE_RETURN:
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_RETURN});
+        return false;
+    case OPCODE_EXIT:
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_EXIT});
+        return false;
+    default:
+        tr.steps--;
+        reg_flush(tr, h - 1);
+        reg_emit(tr, {REG_LEAVE});
+        return false;
+    }
+}
+
+void reg_translate_function(const Program& prg, std::size_t fn, const std::vector<bool>& leaders, RegisterProgram& rp) {
+    std::span<const Bytecode> code = program_code(prg);
+    const std::vector<std::int32_t>& heights = prg.verification.heights;
+    const Function& f = prg.functions[fn];
+    const std::size_t end = function_end(prg, fn);
+    RegTranslator tr{rp, std::vector<RegPending>(f.needs + f.max_stack + 2), static_cast<std::int32_t>(f.needs)};
+    bool open = false;
+    for (std::size_t ip = f.entry; ip < end; ip++) {
+        if (heights[ip] == no_height)
+            continue;
+        if (open && leaders[ip]) {
+            reg_flush(tr, tr.height - 1);
+            if (tr.steps > 0)
+                reg_emit(tr, {REG_NOP});
+        }
+        if (!open || leaders[ip]) {
+            rp.entries[ip] = static_cast<std::uint32_t>(rp.code.size());
+            std::fill(tr.stack.begin(), tr.stack.end(), RegPending{});
+            tr.height = tr.dirty = heights[ip];
+            open = true;
+        }
+        tr.ip = static_cast<std::uint32_t>(ip);
+        tr.steps++;
+        open = reg_instruction(tr, code[ip]);
+    }
+    if (open) {
+        reg_flush(tr, tr.height - 1);
+        tr.ip = static_cast<std::uint32_t>(end);
+        reg_emit(tr, {REG_LEAVE});
+    }
+}
+
+State reg_compile(const Program& prg, RegisterProgram& rp, const std::vector<std::string>& functions = {}) {
+    rp = RegisterProgram{};
+    if (!is_linked(prg) || prg.value != VALUE_INT32 || !prg.verification.verified)
+        return State::ERR;
+    std::span<const Bytecode> code = program_code(prg);
+    std::vector<bool> leaders(code.size() + 1, false);
+    for (auto& bc: code) {
+        if (bc.opcode == OPCODE_JMP || bc.opcode == OPCODE_JMPIF || bc.opcode == OPCODE_JNE || bc.opcode == OPCODE_JEQ)
+            leaders[bc.arg1] = true;
+    }
+    rp.entries.assign(code.size() + 1, no_entry);
+    for (std::size_t fn = 0; fn < prg.functions.size(); fn++) {
+        const std::string& name = prg.functions[fn].name;
+        if (functions.empty() || std::find(functions.begin(), functions.end(), name) != functions.end())
+            reg_translate_function(prg, fn, leaders, rp);
+    }
+    for (auto& ins: rp.code) {
+        if (ins.opcode == REG_JMP || ins.opcode == REG_JNZ || ins.opcode == REG_JNE || ins.opcode == REG_JEQ)
+            ins.target = rp.entries[ins.target];
+    }
+    rp.stops.assign(code.size() + 1, 0);
+    for (std::size_t ip = 0; ip < rp.entries.size(); ip++)
+        rp.stops[ip] = rp.entries[ip] != no_entry;
+    return State::OK;
+}
+
+std::vector<std::string> reg_hot_functions(const Program& prg, const Profile& prof, double share = 0.1) {
+    std::uint64_t total = 0;
+    for (auto& fn: prof.functions)
+        total += fn.steps;
+    std::vector<std::string> hot{};
+    for (std::size_t fn = 0; fn < prof.functions.size() && fn < prg.functions.size(); fn++) {
+        if (total > 0 && prof.functions[fn].steps >= share * total)
+            hot.push_back(prg.functions[fn].name);
+    }
+    return hot;
+}
+
+State reg_run(VM& vm, const Program& prg, const RegisterProgram& rp, std::uint64_t& dispatched) {
+    const std::vector<std::int32_t>& heights = prg.verification.heights;
+    std::size_t base = vm.stack.size() - heights[vm.ip];
+    std::size_t pc = rp.entries[vm.ip];
+    std::uint64_t steps = vm.steps;
+    std::uint64_t count = 0;
+    Arg* stack = nullptr;
+    Arg* regs = nullptr;
+    Arg* frame = vm.locals.data() + vm.fp;
+    Arg* kinds[4] = {};
+    auto reserve = [&](std::size_t size) {
+        vm.stack.reserve(size);
+        stack = vm.stack.data();
+        regs = stack + base;
+        kinds[REG_SLOT] = regs;
+        kinds[REG_LOCAL] = frame;
+        kinds[REG_ABS] = stack;
+    };
+    auto leave = [&](std::size_t ip, std::int32_t height, State state) {
+        vm.ip = ip;
+        vm.stack.count = base + height;
+        vm.steps = steps;
+        dispatched += count;
+        return state;
+    };
+    auto get = [&](const RegOperand& op) {
+        return op.kind == REG_IMM ? op.value : kinds[op.kind][op.value];
+    };
+    auto set = [&](const RegOperand& op, Arg value) {
+        kinds[op.kind][op.value] = value;
+    };
+    reserve(base + function_at(prg, vm.ip).max_stack + 1);
+
+    for (;;) {
+        const RegInstruction& ins = rp.code[pc++];
+        steps += ins.steps;
+        count++;
+        switch (ins.opcode) {
+        case REG_NOP:
+            break;
+        case REG_MOV:
+            set(ins.dst, get(ins.a));
+            break;
+        case REG_ADD:
+            set(ins.dst, value_add(get(ins.a), get(ins.b)));
+            break;
+        case REG_SUB:
+            set(ins.dst, value_sub(get(ins.a), get(ins.b)));
+            break;
+        case REG_MUL:
+            set(ins.dst, value_mul(get(ins.a), get(ins.b)));
+            break;
+        case REG_DIV: {
+            const Arg a = get(ins.a);
+            const Arg b = get(ins.b);
+            if (b == 0 || (b == -1 && a == std::numeric_limits<Arg>::min())) [[unlikely]]
+                return leave(ins.ip, ins.height, State::ERR);
+            set(ins.dst, a / b);
+            break;
+        }
+        case REG_EQ:
+            set(ins.dst, get(ins.a) == get(ins.b));
+            break;
+        case REG_CMP: {
+            const Arg a = get(ins.a);
+            const Arg b = get(ins.b);
+            set(ins.dst, a == b ? 0 : a < b ? 1 : -1);
+            break;
+        }
+        case REG_SWAP:
+            std::swap(regs[ins.dst.value], regs[ins.a.value]);
+            break;
+        case REG_WRITE:
+            value_write(vm, get(ins.a));
+            break;
+        case REG_JMP:
+            pc = ins.target;
+            break;
+        case REG_JNZ:
+            if (get(ins.a) != 0)
+                pc = ins.target;
+            break;
+        case REG_JNE:
+            if (get(ins.a) != get(ins.b))
+                pc = ins.target;
+            break;
+        case REG_JEQ:
+            if (get(ins.a) == get(ins.b))
+                pc = ins.target;
+            break;
+        case REG_CALL: {
+            const Function& fn = prg.functions[ins.target];
+            vm.returnstack.push_back({ins.ip, vm.fp});
+            vm.fp = vm.locals.size();
+            vm.locals.resize(vm.fp + fn.locals.size());
+            frame = vm.locals.data() + vm.fp;
+            base += ins.height;
+            reserve(base + fn.max_stack + 1);
+            pc = rp.entries[fn.entry];
+            if (pc == no_entry)
+                return leave(fn.entry, 0, State::SUSPENDED);
+            break;
+        }
+        case REG_RETURN: {
+            if (vm.returnstack.empty())
+                return leave(ins.ip, ins.height, State::EXIT);
+            const std::size_t call = vm.returnstack.back().ip;
+            vm.locals.resize(vm.fp);
+            vm.fp = vm.returnstack.back().fp;
+            vm.returnstack.pop_back();
+            frame = vm.locals.data() + vm.fp;
+            base -= heights[call];
+            reserve(0);
+            pc = rp.entries[call + 1];
+            if (pc == no_entry)
+                return leave(call + 1, heights[call] + ins.height, State::SUSPENDED);
+            break;
+        }
+        case REG_EXIT:
+            return leave(ins.ip, ins.height, State::EXIT);
+        case REG_LEAVE:
+            return leave(ins.ip, ins.height, State::SUSPENDED);
+        }
+    }
+}
+
+State reg_resume(VM& vm, const Program& prg, const RegisterProgram& rp, std::uint64_t* dispatches = nullptr) {
+    if (rp.entries.empty() || verified_room(vm, prg) == 0)
+        return iset_resume(vm, prg);
+    const std::size_t size = program_code(prg).size();
+    assert(rp.entries.size() == size + 1);
+    std::uint64_t dispatched = 0;
+    State state = State::SUSPENDED;
+    while (state == State::SUSPENDED) {
+        if (vm.ip >= size) {
+            state = State::OK;
+        }
+        else if (rp.entries[vm.ip] == no_entry) {
+            const std::uint64_t steps = vm.steps;
+            const std::size_t room = verified_room(vm, prg);
+            if (room == 0)
+                state = iset_eval_engine<EVAL_STOP | EVAL_CHECKED>(vm, prg, nullptr, 0, 0, rp.stops.data());
+            else
+                state = iset_eval_engine<EVAL_STOP>(vm, prg, nullptr, 0, room, rp.stops.data());
+            dispatched += vm.steps - steps;
+        }
+        else {
+            state = reg_run(vm, prg, rp, dispatched);
+        }
+    }
+    if (dispatches)
+        *dispatches += dispatched;
+    return output_end(vm, state);
+}
+
+State reg_eval(VM& vm, const Program& prg, const RegisterProgram& rp, std::uint64_t* dispatches = nullptr) {
+    if (!is_linked(prg))
+        return State::ERR;
+    vm_start(vm, prg);
+    return reg_resume(vm, prg, rp, dispatches);
+}
+
+}//ns
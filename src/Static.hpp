@@ -0,0 +1,444 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "InstructionSet.hpp"
+#include "Lexer.hpp"
+#include "Eval.hpp"
+
+namespace LemonVM {
+
+template<typename T, std::size_t N>
+struct FixedVector {
+    std::array<T, N> items{};
+    std::size_t count{0};
+
+    constexpr std::size_t size() const { return count; }
+    constexpr bool empty() const { return count == 0; }
+    constexpr bool full() const { return count == N; }
+    constexpr T& operator[](std::size_t i) { return items[i]; }
+    constexpr const T& operator[](std::size_t i) const { return items[i]; }
+    constexpr T& back() { return items[count - 1]; }
+    constexpr const T& back() const { return items[count - 1]; }
+    constexpr const T* begin() const { return items.data(); }
+    constexpr const T* end() const { return items.data() + count; }
+
+    constexpr void push_back(const T& value) {
+        assert(count < N && "FixedVector is full");
+        items[count++] = value;
+    }
+
+    constexpr T pop_back() {
+        assert(count > 0 && "FixedVector is empty");
+        return items[--count];
+    }
+
+    constexpr void resize(std::size_t size) {
+        assert(size <= N && "FixedVector is full");
+        for (std::size_t i = count; i < size; i++)
+            items[i] = T{};
+        count = size;
+    }
+};
+
+template<std::size_t N>
+struct FixedString {
+    std::array<char, N> chars{};
+
+    constexpr FixedString(const char (&str)[N]) {
+        std::copy_n(str, N, chars.begin());
+    }
+
+    constexpr std::string_view view() const {
+        return {chars.data(), N - 1};
+    }
+};
+
+constexpr std::size_t static_capacity(std::string_view src) {
+    return src.size() / 2 + 1;
+}
+
+template<std::size_t N>
+using StaticTokens = FixedVector<Token, N>;
+
+template<std::size_t N>
+constexpr StaticTokens<N> static_tokenize(std::string_view prg) {
+    StaticTokens<N> tokens{};
+    LexCursor cur{prg};
+    for (;;) {
+        trim_left(cur);
+        if (cur.pos == cur.src.size())
+            return tokens;
+        tokens.push_back(extract_token(cur));
+    }
+}
+
+struct StaticInstruction {
+    Opcode opcode{OPCODE_NOP};
+    Arg arg1{0};
+    std::string_view label{};
+};
+
+template<std::size_t N>
+using StaticInstructionSet = FixedVector<StaticInstruction, N>;
+
+template<std::size_t N>
+constexpr StaticInstructionSet<N> static_assemble(const StaticTokens<N>& tokens) {
+    StaticInstructionSet<N> iset{};
+    std::size_t i = 0;
+    while (i < tokens.size()) {
+        StaticInstruction ins{};
+        ins.opcode = get_opcode(tokens[i].str);
+        const Operand operand = operand_of(ins.opcode);
+        if (operand != Operand::NONE) {
+            i++;
+            assert(i < tokens.size() && !is_opcode(tokens[i].str));
+        }
+        if (operand == Operand::INT || operand == Operand::VALUE) {
+            [[maybe_unused]] const bool ok = parse_arg(tokens[i].str, ins.arg1);
+            assert(ok && "expected integer");
+        }
+        else if (operand == Operand::NAME) {
+            ins.label = tokens[i].str;
+        }
+        iset.push_back(ins);
+        i++;
+    }
+    return iset;
+}
+
+struct StaticName {
+    std::string_view name{};
+    std::size_t value{0};
+    std::size_t scope{0};
+};
+
+template<std::size_t N>
+using StaticNames = FixedVector<StaticName, N>;
+
+template<std::size_t N>
+constexpr std::size_t static_find(const StaticNames<N>& names, std::string_view name, std::size_t scope = 0) {
+    for (auto& entry: names) {
+        if (entry.name == name && entry.scope == scope)
+            return entry.value;
+    }
+    return no_ip;
+}
+
+template<std::size_t N>
+constexpr void static_insert(StaticNames<N>& names, std::string_view name, std::size_t value, std::size_t scope = 0) {
+    for (std::size_t i = 0; i < names.size(); i++) {
+        if (names[i].name == name && names[i].scope == scope) {
+            names[i].value = value;
+            return;
+        }
+    }
+    names.push_back({name, value, scope});
+}
+
+template<std::size_t N>
+constexpr StaticNames<N> static_extract_labels(const StaticInstructionSet<N>& iset) {
+    StaticNames<N> labels{};
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        if (iset[ip].opcode == OPCODE_LABEL)
+            static_insert(labels, iset[ip].label, ip);
+    }
+    return labels;
+}
+
+struct StaticFunction {
+    std::size_t entry{0};
+    std::size_t locals{0};
+};
+
+template<std::size_t N>
+struct StaticProgram {
+    FixedVector<Bytecode, N> code{};
+    FixedVector<StaticFunction, N + 1> functions{};
+    std::size_t errors{0};
+};
+
+template<std::size_t N>
+constexpr bool static_is_linked(const StaticProgram<N>& prg) {
+    return prg.errors == 0;
+}
+
+template<std::size_t N>
+constexpr StaticProgram<N> static_link(const StaticInstructionSet<N>& iset) {
+    StaticProgram<N> prg{};
+    const StaticNames<N> labels = static_extract_labels(iset);
+
+    StaticNames<N> function_ids{};
+    prg.functions.push_back({0, 0});
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        const StaticInstruction& ins = iset[ip];
+        if (ins.opcode != OPCODE_LABEL || static_find(function_ids, ins.label) != no_ip)
+            continue;
+        bool called = false;
+        for (auto& other: iset)
+            called = called || ((other.opcode == OPCODE_CALL || other.opcode == OPCODE_SPAWN) && other.label == ins.label);
+        if (!called)
+            continue;
+        if (ip != 0)
+            prg.functions.push_back({ip, 0});
+        static_insert(function_ids, ins.label, prg.functions.size() - 1);
+    }
+
+    StaticNames<N> slots{};
+    std::size_t fn = 0;
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        const StaticInstruction& ins = iset[ip];
+        if (fn + 1 < prg.functions.size() && prg.functions[fn + 1].entry == ip)
+            fn++;
+        if ((ins.opcode == OPCODE_VAR || ins.opcode == OPCODE_STORE) && static_find(slots, ins.label, fn) == no_ip)
+            static_insert(slots, ins.label, prg.functions[fn].locals++, fn);
+    }
+
+    fn = 0;
+    for (std::size_t ip = 0; ip < iset.size(); ip++) {
+        const StaticInstruction& ins = iset[ip];
+        Bytecode bc{ins.opcode, ins.arg1};
+        if (fn + 1 < prg.functions.size() && prg.functions[fn + 1].entry == ip)
+            fn++;
+        std::size_t resolved = 0;
+        switch (ins.opcode) {
+        case OPCODE_JMP:
+        case OPCODE_JMPIF:
+        case OPCODE_JNE:
+        case OPCODE_JEQ:
+            resolved = static_find(labels, ins.label);
+            break;
+        case OPCODE_CALL:
+        case OPCODE_SPAWN:
+            resolved = static_find(function_ids, ins.label);
+            break;
+        case OPCODE_VAR:
+        case OPCODE_STORE:
+        case OPCODE_LOAD:
+        case OPCODE_INCVAR:
+            resolved = static_find(slots, ins.label, fn);
+            break;
+        default:
+            break;
+        }
+        if (operand_of(ins.opcode) == Operand::NAME && ins.opcode != OPCODE_LABEL) {
+            if (resolved == no_ip)
+                prg.errors++;
+            else
+                bc.arg1 = static_cast<Arg>(resolved);
+        }
+        prg.code.push_back(bc);
+    }
+    return prg;
+}
+
+template<FixedString Src>
+constexpr auto static_program() {
+    constexpr std::size_t capacity = static_capacity(Src.view());
+    return static_link(static_assemble(static_tokenize<capacity>(Src.view())));
+}
+
+template<std::size_t Capacity>
+struct StaticVM {
+    std::size_t ip{0};
+    FixedVector<Arg, Capacity> stack{};
+    FixedVector<Frame, Capacity> returnstack{};
+    FixedVector<Arg, Capacity> locals{};
+    std::size_t fp{0};
+    std::uint64_t steps{0};
+    FixedVector<Arg, Capacity> output{};
+};
+
+template<std::size_t N, std::size_t C>
+constexpr State static_step(StaticVM<C>& vm, const StaticProgram<N>& prg, Bytecode ins) {
+    Arg a{0};
+    Arg b{0};
+    vm.steps++;
+    if (vm.stack.size() < static_cast<std::size_t>(stack_effect(ins.opcode).pops))
+        return State::ERR;
+    switch (ins.opcode) {
+    case OPCODE_LABEL:
+    case OPCODE_NOP:
+        break;
+    case OPCODE_PUT:
+        if (vm.stack.full())
+            return State::ERR;
+        vm.stack.push_back(ins.arg1);
+        break;
+    case OPCODE_POP:
+        vm.stack.pop_back();
+        break;
+    case OPCODE_JMP:
+        vm.ip = ins.arg1;
+        return State::OK;
+    case OPCODE_JMPIF:
+        if (vm.stack.pop_back() != 0) {
+            vm.ip = ins.arg1;
+            return State::OK;
+        }
+        break;
+    case OPCODE_CALL: {
+        const StaticFunction& fn = prg.functions[ins.arg1];
+        if (vm.returnstack.full() || vm.locals.size() + fn.locals > C)
+            return State::ERR;
+        vm.returnstack.push_back({vm.ip, vm.fp});
+        vm.fp = vm.locals.size();
+        vm.locals.resize(vm.fp + fn.locals);
+        vm.ip = fn.entry;
+        return State::OK;
+    }
+    case OPCODE_RETURN:
+        if (vm.returnstack.empty())
+            return State::EXIT;
+        vm.locals.resize(vm.fp);
+        vm.ip = vm.returnstack.back().ip;
+        vm.fp = vm.returnstack.back().fp;
+        vm.returnstack.pop_back();
+        break;
+    case OPCODE_YIELD:
+        vm.ip++;
+        return State::YIELD;
+    case OPCODE_VAR:
+        vm.locals[vm.fp + ins.arg1] = 0;
+        break;
+    case OPCODE_STORE:
+        vm.locals[vm.fp + ins.arg1] = vm.stack.pop_back();
+        break;
+    case OPCODE_LOAD:
+        if (vm.stack.full())
+            return State::ERR;
+        vm.stack.push_back(vm.locals[vm.fp + ins.arg1]);
+        break;
+    case OPCODE_EQ:
+        a = vm.stack.pop_back();
+        vm.stack.back() = vm.stack.back() == a ? 1 : 0;
+        break;
+    case OPCODE_CMP:
+        a = vm.stack.pop_back();
+        b = vm.stack.back();
+        vm.stack.back() = b == a ? 0 : b < a ? 1 : -1;
+        break;
+    case OPCODE_SWAP:
+        a = vm.stack.back();
+        vm.stack.back() = vm.stack[vm.stack.size() - 2];
+        vm.stack[vm.stack.size() - 2] = a;
+        break;
+    case OPCODE_PLUS:
+        a = vm.stack.pop_back();
+        vm.stack.back() = value_add(vm.stack.back(), a);
+        break;
+    case OPCODE_MINUS:
+        a = vm.stack.pop_back();
+        vm.stack.back() = value_sub(vm.stack.back(), a);
+        break;
+    case OPCODE_MULTIPLY:
+        a = vm.stack.pop_back();
+        vm.stack.back() = value_mul(vm.stack.back(), a);
+        break;
+    case OPCODE_DIVIDE:
+        a = vm.stack.back();
+        if (a == 0 || (a == -1 && vm.stack[vm.stack.size() - 2] == std::numeric_limits<Arg>::min()))
+            return State::ERR;
+        vm.stack.pop_back();
+        vm.stack.back() = vm.stack.back() / a;
+        break;
+    case OPCODE_DUPLAST:
+    case OPCODE_DUP:
+        if (vm.stack.full())
+            return State::ERR;
+        if (ins.opcode == OPCODE_DUP && (ins.arg1 < 0 || static_cast<std::size_t>(ins.arg1) >= vm.stack.size()))
+            return State::ERR;
+        vm.stack.push_back(ins.opcode == OPCODE_DUP ? vm.stack[ins.arg1] : vm.stack.back());
+        break;
+    case OPCODE_WRITE:
+        if (vm.output.full())
+            return State::ERR;
+        vm.output.push_back(vm.stack.pop_back());
+        break;
+    case OPCODE_ADDI:
+        vm.stack.back() = value_add(vm.stack.back(), ins.arg1);
+        break;
+    case OPCODE_SUBI:
+        vm.stack.back() = value_sub(vm.stack.back(), ins.arg1);
+        break;
+    case OPCODE_MULI:
+        vm.stack.back() = value_mul(vm.stack.back(), ins.arg1);
+        break;
+    case OPCODE_SQUARE:
+        vm.stack.back() = value_mul(vm.stack.back(), vm.stack.back());
+        break;
+    case OPCODE_JNE:
+    case OPCODE_JEQ:
+        a = vm.stack.pop_back();
+        b = vm.stack.pop_back();
+        if ((a == b) == (ins.opcode == OPCODE_JEQ)) {
+            vm.ip = ins.arg1;
+            return State::OK;
+        }
+        break;
+    case OPCODE_INCVAR:
+        vm.locals[vm.fp + ins.arg1] = value_add(vm.locals[vm.fp + ins.arg1], Arg{1});
+        break;
+    case OPCODE_SPAWN:
+    case OPCODE_JOIN:
+        return State::ERR;
+    case OPCODE_EXIT:
+        return State::EXIT;
+    default:
+        return State::ERR;
+    }
+    vm.ip++;
+    return State::OK;
+}
+
+template<std::size_t N, std::size_t C>
+constexpr void static_start(StaticVM<C>& vm, const StaticProgram<N>& prg) {
+    vm.ip = 0;
+    vm.fp = 0;
+    if (vm.locals.size() < prg.functions[0].locals)
+        vm.locals.resize(prg.functions[0].locals);
+}
+
+template<std::size_t N, std::size_t C>
+constexpr State static_resume(StaticVM<C>& vm, const StaticProgram<N>& prg) {
+    if (!static_is_linked(prg))
+        return State::ERR;
+    while (vm.ip < prg.code.size()) {
+        const State state = static_step(vm, prg, prg.code[vm.ip]);
+        if (state != State::OK)
+            return state;
+    }
+    return State::OK;
+}
+
+template<std::size_t N, std::size_t C>
+constexpr State static_eval(StaticVM<C>& vm, const StaticProgram<N>& prg) {
+    static_start(vm, prg);
+    return static_resume(vm, prg);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LEMONVM_FLATTEN [[gnu::flatten]]
+#else
+#define LEMONVM_FLATTEN
+#endif
+
+template<auto Prg, std::size_t C, std::size_t... I>
+LEMONVM_FLATTEN constexpr State static_dispatch(StaticVM<C>& vm, std::index_sequence<I...>) {
+    State state = State::OK;
+    ((vm.ip == I && ((state = static_step(vm, Prg, Prg.code[I])), true)) || ...);
+    return state;
+}
+
+template<auto Prg, std::size_t C>
+constexpr State static_run(StaticVM<C>& vm) {
+    static_assert(static_is_linked(Prg), "the program has unresolved names");
+    StaticVM<C> local = vm;
+    State state = State::OK;
+    static_start(local, Prg);
+    while (local.ip < Prg.code.size() && state == State::OK)
+        state = static_dispatch<Prg>(local, std::make_index_sequence<Prg.code.size()>{});
+    vm = local;
+    return state;
+}
+
+}//ns
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "Eval.hpp"
+#include "Pool.hpp"
+
+namespace LemonVM {
+
+struct Task {
+    VM vm{};
+    State state{State::OK};
+    Arg result{0};
+    std::atomic<bool> done{false};
+    std::vector<Task*> waiters{};
+};
+
+struct TaskQueue {
+    std::mutex mutex{};
+    std::deque<Task*> tasks{};
+};
+
+void queue_push_back(TaskQueue& queue, Task* task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(task);
+}
+
+void queue_push_front(TaskQueue& queue, Task* task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_front(task);
+}
+
+Task* queue_pop_back(TaskQueue& queue) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return nullptr;
+    Task* task = queue.tasks.back();
+    queue.tasks.pop_back();
+    return task;
+}
+
+Task* queue_pop_front(TaskQueue& queue) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return nullptr;
+    Task* task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return task;
+}
+
+struct Scheduler {
+    const Program* prg{nullptr};
+    std::mutex mutex{};
+    std::condition_variable ready{};
+    std::vector<std::unique_ptr<Task>> tasks{};
+    std::deque<TaskQueue> queues{};
+    std::atomic<std::size_t> pending{0};
+    std::size_t parked{0};
+    std::atomic<std::size_t> sleeping{0};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> deadlocked{false};
+};
+
+/*The queue of the worker running on this thread*/
+inline thread_local std::size_t scheduler_worker = 0;
+/*The task that the task running on this thread waits for in a join*/
+inline thread_local Task* scheduler_target = nullptr;
+
+/*Wakes a sleeping worker, taking the lock so the wakeup can not slip in between its check and its wait*/
+void scheduler_wake(Scheduler& sched) {
+    if (sched.sleeping.load() == 0)
+        return;
+    { std::lock_guard<std::mutex> lock(sched.mutex); }
+    sched.ready.notify_one();
+}
+
+Arg scheduler_add(Scheduler& sched, VM vm) {
+    auto task = std::make_unique<Task>();
+    task->vm = std::move(vm);
+    task->vm.scheduler = &sched;
+    Task* ready = task.get();
+    Arg id{0};
+    sched.pending++;
+    {
+        std::lock_guard<std::mutex> lock(sched.mutex);
+        id = static_cast<Arg>(sched.tasks.size());
+        sched.tasks.push_back(std::move(task));
+    }
+    queue_push_back(sched.queues[scheduler_worker % sched.queues.size()], ready);
+    scheduler_wake(sched);
+    return id;
+}
+
+Arg scheduler_spawn(Scheduler& sched, Arg function, Arg arg) {
+    const Function& fn = sched.prg->functions[function];
+    VM vm{};
+    vm.stack.push_back(arg);
+    vm.returnstack.push_back({program_code(*sched.prg).size(), 0});
+    vm.locals.resize(fn.locals.size());
+    vm.ip = fn.entry;
+    return scheduler_add(sched, std::move(vm));
+}
+
+State scheduler_join(Scheduler& sched, Arg id, Arg& result) {
+    Task* task = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(sched.mutex);
+        if (id >= 0 && static_cast<std::size_t>(id) < sched.tasks.size())
+            task = sched.tasks[id].get();
+    }
+    if (!task)
+        return State::ERR;
+    if (!task->done.load(std::memory_order_acquire)) {
+        scheduler_target = task;
+        return State::YIELD;
+    }
+    result = task->result;
+    return State::OK;
+}
+
+void scheduler_park(Scheduler& sched, Task* task, Task* target, std::size_t worker) {
+    {
+        std::lock_guard<std::mutex> lock(sched.mutex);
+        if (!target->done.load(std::memory_order_acquire)) {
+            target->waiters.push_back(task);
+            if (++sched.parked < sched.pending.load())
+                return;
+            sched.deadlocked = true;
+        }
+    }
+    if (sched.deadlocked) {
+        sched.ready.notify_all();
+        return;
+    }
+    queue_push_front(sched.queues[worker], task);
+}
+
+void scheduler_finish(Scheduler& sched, Task* task, State state, std::size_t worker) {
+    task->state = state;
+    task->result = task->vm.stack.empty() ? 0 : task->vm.stack.back();
+    if (state == State::ERR)
+        sched.failed = true;
+    std::vector<Task*> waiters{};
+    {
+        std::lock_guard<std::mutex> lock(sched.mutex);
+        task->done.store(true, std::memory_order_release);
+        waiters.swap(task->waiters);
+        sched.parked -= waiters.size();
+        sched.pending--;
+    }
+    for (Task* waiter: waiters)
+        queue_push_back(sched.queues[worker], waiter);
+    if (sched.pending.load() == 0)
+        sched.ready.notify_all();
+    else if (!waiters.empty())
+        scheduler_wake(sched);
+}
+
+bool scheduler_over(const Scheduler& sched) {
+    return sched.pending.load(std::memory_order_acquire) == 0 || sched.deadlocked;
+}
+
+bool scheduler_queued(Scheduler& sched) {
+    for (auto& queue: sched.queues) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+            return true;
+    }
+    return false;
+}
+
+void scheduler_sleep(Scheduler& sched) {
+    std::unique_lock<std::mutex> lock(sched.mutex);
+    sched.sleeping++;
+    sched.ready.wait(lock, [&]() { return scheduler_over(sched) || scheduler_queued(sched); });
+    sched.sleeping--;
+}
+
+Task* scheduler_take(Scheduler& sched, std::size_t worker) {
+    if (Task* task = queue_pop_back(sched.queues[worker]))
+        return task;
+    for (std::size_t i = 1; i < sched.queues.size(); i++) {
+        if (Task* task = queue_pop_front(sched.queues[(worker + i) % sched.queues.size()]))
+            return task;
+    }
+    return nullptr;
+}
+
+void scheduler_run(Scheduler& sched, std::size_t worker) {
+    scheduler_worker = worker;
+    while (!scheduler_over(sched)) {
+        Task* task = scheduler_take(sched, worker);
+        if (!task) {
+            scheduler_sleep(sched);
+            continue;
+        }
+        scheduler_target = nullptr;
+        const State state = iset_resume(task->vm, *sched.prg);
+        if (state == State::YIELD && scheduler_target)
+            scheduler_park(sched, task, scheduler_target, worker);
+        else if (state == State::YIELD)
+            queue_push_front(sched.queues[worker], task);
+        else
+            scheduler_finish(sched, task, state, worker);
+    }
+}
+
+State sched_eval(Pool& pool, VM& vm, const Program& prg) {
+    if (!is_linked(prg))
+        return State::ERR;
+    Scheduler sched{};
+    sched.prg = &prg;
+    const std::size_t workers = std::max<std::size_t>(pool.workers.size(), 1);
+    for (std::size_t i = 0; i < workers; i++)
+        sched.queues.emplace_back();
+    vm_start(vm, prg);
+    scheduler_worker = 0;
+    scheduler_add(sched, std::move(vm));
+
+    if (pool.workers.empty()) {
+        scheduler_run(sched, 0);
+    } else {
+        std::latch done(workers);
+        for (std::size_t i = 0; i < workers; i++)
+            pool_submit(pool, [&, i]() { scheduler_run(sched, i); done.count_down(); });
+        done.wait();
+    }
+
+    Task& main = *sched.tasks.front();
+    vm = std::move(main.vm);
+    vm.scheduler = nullptr;
+    return sched.failed || sched.deadlocked ? State::ERR : main.state;
+}
+
+}//ns
@@ -0,0 +1,292 @@
+#pragma once
+
+#include "Defs.hpp"
+#include "Eval.hpp"
+#include "Jit.hpp"
+
+namespace LemonVM {
+
+struct AotVM {
+    const Arg* stack{nullptr};
+    std::size_t depth{0};
+    std::uint64_t steps{0};
+    std::size_t ip{0};
+    void* vm{nullptr};
+    Arg* (*resize_stack)(void* vm, std::size_t depth){nullptr};
+    Arg* (*resize_locals)(void* vm, std::size_t size){nullptr};
+    void (*write)(void* vm, Arg value){nullptr};
+};
+using AotFunction = int (*)(AotVM*);
+
+const char* aot_interface_source =
+    "struct AotVM {\n"
+    "    const Arg* stack;\n"
+    "    std::size_t depth;\n"
+    "    std::uint64_t steps;\n"
+    "    std::size_t ip;\n"
+    "    void* vm;\n"
+    "    Arg* (*resize_stack)(void* vm, std::size_t depth);\n"
+    "    Arg* (*resize_locals)(void* vm, std::size_t size);\n"
+    "    void (*write)(void* vm, Arg value);\n"
+    "};\n";
+
+struct Translation {
+    std::string source{};
+    LinkErrors errors{};
+};
+
+bool is_translated(const Translation& tr) {
+    return tr.errors.empty();
+}
+
+void translate_check(const Program& prg, LinkErrors& errors) {
+    std::span<const Bytecode> code = program_code(prg);
+    for (std::size_t fn = 0; fn < prg.functions.size(); fn++) {
+        const std::size_t end = function_end(prg, fn);
+        for (std::size_t ip = prg.functions[fn].entry; ip < end; ip++) {
+            const Bytecode& bc = code[ip];
+            switch (bc.opcode) {
+            case OPCODE_JMP:
+            case OPCODE_JMPIF:
+            case OPCODE_JNE:
+            case OPCODE_JEQ:
+                if (&function_at(prg, bc.arg1) != &prg.functions[fn])
+                    errors.push_back({ip, label_at(prg, bc.arg1), 0, 0, "jump out of its function"});
+                break;
+            case OPCODE_CALL:
+                if (bc.arg1 == 0)
+                    errors.push_back({ip, prg.functions[0].name, 0, 0, "call to the entry function"});
+                break;
+            case OPCODE_SPAWN:
+            case OPCODE_JOIN:
+            case OPCODE_YIELD:
+                errors.push_back({ip, str(prg, ip), 0, 0, "instruction can not be translated"});
+                break;
+            default:
+                break;
+            }
+        }
+        if (fn + 1 == prg.functions.size() || end == prg.functions[fn].entry)
+            continue;
+        const Opcode last = code[end - 1].opcode;
+        if (last != OPCODE_EXIT && last != OPCODE_RETURN && last != OPCODE_JMP)
+            errors.push_back({end, prg.functions[fn + 1].name, 0, 0, "fall through into function"});
+    }
+}
+
+std::vector<bool> translate_targets(const Program& prg) {
+    std::span<const Bytecode> code = program_code(prg);
+    std::vector<bool> targets(code.size() + 1, false);
+    for (auto& bc: code) {
+        if (bc.opcode == OPCODE_JMP || bc.opcode == OPCODE_JMPIF || bc.opcode == OPCODE_JNE || bc.opcode == OPCODE_JEQ)
+            targets[bc.arg1] = true;
+    }
+    return targets;
+}
+
+std::vector<bool> translate_leaders(const Program& prg, const std::vector<bool>& targets) {
+    std::span<const Bytecode> code = program_code(prg);
+    std::vector<bool> leaders = targets;
+    for (auto& fn: prg.functions)
+        leaders[fn.entry] = true;
+    for (std::size_t ip = 0; ip < code.size(); ip++) {
+        if (jit_ends_block(code[ip].opcode))
+            leaders[ip + 1] = true;
+    }
+    return leaders;
+}
+
+std::string translate_instruction(const Program& prg, std::size_t fn, std::size_t ip, const std::string& leave) {
+    const Bytecode ins = program_code(prg)[ip];
+    const std::string arg = std::to_string(ins.arg1);
+    const std::string var = "x" + arg;
+    const std::string stop = "return stop(c, sp, " + std::to_string(ip) + ", EXIT);";
+    switch (ins.opcode) {
+    case OPCODE_LABEL:
+    case OPCODE_NOP:      return ";";
+    case OPCODE_PUT:      return "*sp++ = " + arg + ";";
+    case OPCODE_POP:      return "sp--;";
+    case OPCODE_DUP:      return "*sp = c.base[" + arg + "]; sp++;";
+    case OPCODE_DUPLAST:  return "*sp = sp[-1]; sp++;";
+    case OPCODE_SWAP:     return "std::swap(sp[-1], sp[-2]);";
+    case OPCODE_PLUS:     return "sp--; sp[-1] = add(sp[-1], sp[0]);";
+    case OPCODE_MINUS:    return "sp--; sp[-1] = sub(sp[-1], sp[0]);";
+    case OPCODE_MULTIPLY: return "sp--; sp[-1] = mul(sp[-1], sp[0]);";
+    case OPCODE_DIVIDE:
+        return "if (sp[-1] == 0 || (sp[-1] == -1 && sp[-2] == INT32_MIN)) { " + leave + "return stop(c, sp, "
+            + std::to_string(ip) + ", ERR); } sp--; sp[-1] = sp[-1] / sp[0];";
+    case OPCODE_EQ:       return "sp--; sp[-1] = sp[-1] == sp[0];";
+    case OPCODE_CMP:      return "sp--; sp[-1] = sp[-1] == sp[0] ? 0 : sp[-1] < sp[0] ? 1 : -1;";
+    case OPCODE_JMP:      return "goto L" + arg + ";";
+    case OPCODE_JMPIF:    return "if (*--sp != 0) goto L" + arg + ";";
+    case OPCODE_JNE:      return "sp -= 2; if (sp[1] != sp[0]) goto L" + arg + ";";
+    case OPCODE_JEQ:      return "sp -= 2; if (sp[1] == sp[0]) goto L" + arg + ";";
+    case OPCODE_CALL:     return "c.sp = sp; if (!f" + arg + "(c)) { " + leave + "return false; } sp = c.sp;";
+    case OPCODE_RETURN:
+        if (fn == 0)
+            return leave + stop;
+        return "c.sp = sp; return true;";
+    case OPCODE_VAR:      return var + " = 0;";
+    case OPCODE_STORE:    return var + " = *--sp;";
+    case OPCODE_LOAD:     return "*sp++ = " + var + ";";
+    case OPCODE_INCVAR:   return var + " = add(" + var + ", 1);";
+    case OPCODE_WRITE:    return "c.vm->write(c.vm->vm, *--sp);";
+    case OPCODE_ADDI:     return "sp[-1] = add(sp[-1], " + arg + ");";
+    case OPCODE_SUBI:     return "sp[-1] = sub(sp[-1], " + arg + ");";
+    case OPCODE_MULI:     return "sp[-1] = mul(sp[-1], " + arg + ");";
+    case OPCODE_SQUARE:   return "sp[-1] = mul(sp[-1], sp[-1]);";
+    default:              return leave + stop;
+    }
+}
+
+void translate_function(std::stringstream& ss, const Program& prg, std::size_t fn,
+                        const std::vector<bool>& leaders, const std::vector<bool>& targets)
+{
+    std::span<const Bytecode> code = program_code(prg);
+    const Function& f = prg.functions[fn];
+    const std::size_t end = function_end(prg, fn);
+    std::stringstream spill{};
+    ss << "\n// " << (f.name.empty() ? "<entry>" : f.name) << "\n"
+       << "bool f" << fn << "(Context& c) {\n"
+       << "    Arg* sp = c.sp;\n";
+    for (std::size_t slot = 0; slot < f.locals.size(); slot++) {
+        ss << "    [[maybe_unused]] Arg x" << slot << " = ";
+        if (fn == 0)
+            ss << "c.frame[" << slot << "]";
+        else
+            ss << "0";
+        ss << "; // " << f.locals[slot] << "\n";
+        if (fn == 0)
+            spill << "c.frame[" << slot << "] = x" << slot << "; ";
+    }
+    const std::string leave = spill.str();
+    for (std::size_t ip = f.entry; ip < end; ip++) {
+        if (leaders[ip]) {
+            std::uint32_t length = 1;
+            while (ip + length < end && !leaders[ip + length])
+                length++;
+            const std::uint32_t pushes = jit_block_pushes(code, ip, length);
+            if (targets[ip])
+                ss << "L" << ip << ":\n";
+            ss << "    c.steps += " << length << ";\n";
+            if (pushes > 0)
+                ss << "    if (c.end - sp < " << pushes << ") { " << leave << "return stop(c, sp, " << ip << ", ERR); }\n";
+        }
+        ss << "    " << translate_instruction(prg, fn, ip, leave) << " // " << str(prg, ip) << "\n";
+    }
+    if (end == code.size())
+        ss << "    " << leave << "return stop(c, sp, " << end << ", OK);\n";
+    ss << "}\n";
+}
+
+Translation program_translate(const Program& prg, const std::string& name) {
+    Translation tr{};
+    tr.errors = prg.errors;
+    if (prg.value != VALUE_INT32)
+        tr.errors.push_back({0, "", 0, 0, "only int32 programs can be translated"});
+    if (tr.errors.empty())
+        translate_check(prg, tr.errors);
+    if (tr.errors.empty() && !prg.verification.verified)
+        tr.errors.push_back({0, "", 0, 0, "only verified programs can be translated"});
+    if (!tr.errors.empty())
+        return tr;
+
+    const std::vector<bool> targets = translate_targets(prg);
+    const std::vector<bool> leaders = translate_leaders(prg, targets);
+    std::stringstream ss{};
+    ss << "// Translated from a LemonVM program, do not edit.\n"
+       << "#include <algorithm>\n"
+       << "#include <cstddef>\n"
+       << "#include <cstdint>\n"
+       << "#include <utility>\n"
+       << "\n"
+       << "#ifndef LEMONVM_AOT_STACK\n"
+       << "#define LEMONVM_AOT_STACK (1 << 16)\n"
+       << "#endif\n"
+       << "\n"
+       << "using Arg = int;\n"
+       << "\n"
+       << aot_interface_source
+       << "\n"
+       << "namespace {\n"
+       << "\n"
+       << "enum Stop { ERR = " << static_cast<int>(State::ERR) << ", OK = " << static_cast<int>(State::OK)
+       << ", EXIT = " << static_cast<int>(State::EXIT) << " };\n"
+       << "\n"
+       << "struct Context {\n"
+       << "    Arg* sp;\n"
+       << "    Arg* base;\n"
+       << "    Arg* end;\n"
+       << "    Arg* frame;\n"
+       << "    std::uint64_t steps;\n"
+       << "    std::size_t ip;\n"
+       << "    Stop state;\n"
+       << "    AotVM* vm;\n"
+       << "};\n"
+       << "\n"
+       << "inline Arg add(Arg a, Arg b) { return static_cast<Arg>(static_cast<unsigned>(a) + static_cast<unsigned>(b)); }\n"
+       << "inline Arg sub(Arg a, Arg b) { return static_cast<Arg>(static_cast<unsigned>(a) - static_cast<unsigned>(b)); }\n"
+       << "inline Arg mul(Arg a, Arg b) { return static_cast<Arg>(static_cast<unsigned>(a) * static_cast<unsigned>(b)); }\n"
+       << "\n"
+       << "inline bool stop(Context& c, Arg* sp, std::size_t ip, Stop state) {\n"
+       << "    c.sp = sp;\n"
+       << "    c.ip = ip;\n"
+       << "    c.state = state;\n"
+       << "    return false;\n"
+       << "}\n"
+       << "\n";
+    for (std::size_t fn = 0; fn < prg.functions.size(); fn++)
+        ss << "bool f" << fn << "(Context& c);\n";
+    for (std::size_t fn = 0; fn < prg.functions.size(); fn++)
+        translate_function(ss, prg, fn, leaders, targets);
+    const std::size_t needs = prg.functions.front().needs;
+    ss << "\n"
+       << "}\n"
+       << "\n"
+       << "extern \"C\" int " << name << "(AotVM* vm) {\n"
+       << "    Arg stack[LEMONVM_AOT_STACK];\n"
+       << "    if (vm->depth > LEMONVM_AOT_STACK" << (needs > 0 ? " || vm->depth < " + std::to_string(needs) : "") << ")\n"
+       << "        return ERR;\n"
+       << "    std::copy(vm->stack, vm->stack + vm->depth, stack);\n"
+       << "    Arg* frame = vm->resize_locals(vm->vm, " << prg.functions.front().locals.size() << ");\n"
+       << "    Context c{stack + vm->depth, stack, stack + LEMONVM_AOT_STACK, frame, vm->steps, 0, OK, vm};\n"
+       << "    f0(c);\n"
+       << "    std::copy(stack, c.sp, vm->resize_stack(vm->vm, c.sp - stack));\n"
+       << "    vm->steps = c.steps;\n"
+       << "    vm->ip = c.ip;\n"
+       << "    return c.state;\n"
+       << "}\n";
+    tr.source = ss.str();
+    return tr;
+}
+
+Translation iset_translate(const InstructionSet& iset, const std::string& name) {
+    return program_translate(link(iset), name);
+}
+
+Arg* aot_resize_stack(void* vm, std::size_t depth) {
+    MemoryStack& stack = static_cast<VM*>(vm)->stack;
+    stack.resize(depth);
+    return stack.data();
+}
+
+Arg* aot_resize_locals(void* vm, std::size_t size) {
+    MemoryStack& locals = static_cast<VM*>(vm)->locals;
+    locals.resize(std::max(locals.size(), size));
+    return locals.data();
+}
+
+void aot_write(void* vm, Arg value) {
+    value_write(*static_cast<VM*>(vm), value);
+}
+
+State aot_eval(VM& vm, AotFunction fn) {
+    AotVM aot{vm.stack.data(), vm.stack.size(), vm.steps, 0, &vm, aot_resize_stack, aot_resize_locals, aot_write};
+    vm.fp = 0;
+    const int state = fn(&aot);
+    vm.steps = aot.steps;
+    vm.ip = aot.ip;
+    return output_end(vm, static_cast<State>(state));
+}
+
+}//ns
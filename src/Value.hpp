@@ -0,0 +1,164 @@
+#pragma once
+
+#include "Defs.hpp"
+
+namespace LemonVM {
+
+constexpr std::uint64_t value_tag_mask      = 0xFFFF'0000'0000'0000;
+constexpr std::uint64_t value_payload_mask  = 0x0000'FFFF'FFFF'FFFF;
+constexpr std::uint64_t value_boxed_mask    = 0xFFF8'0000'0000'0000;
+constexpr std::uint64_t value_int_tag       = 0xFFF9'0000'0000'0000;
+constexpr std::uint64_t value_bool_tag      = 0xFFFA'0000'0000'0000;
+constexpr std::uint64_t value_ref_tag       = 0xFFFB'0000'0000'0000;
+constexpr std::uint64_t value_canonical_nan = 0x7FF8'0000'0000'0000;
+
+struct Value {
+    std::uint64_t bits{value_int_tag};
+
+    constexpr Value() = default;
+    constexpr Value(std::int32_t i) : bits{value_int_tag | static_cast<std::uint32_t>(i)} {}
+    constexpr Value(double d) : bits{d != d ? value_canonical_nan : std::bit_cast<std::uint64_t>(d)} {}
+    constexpr Value(bool b) : bits{value_bool_tag | static_cast<std::uint64_t>(b)} {}
+};
+static_assert(sizeof(Value) == 8, "Value is expected to be NaN-boxed into 8 bytes");
+
+constexpr bool value_is_double(Value v) { return (v.bits & value_boxed_mask) != value_boxed_mask; }
+constexpr bool value_is_int(Value v)    { return (v.bits & value_tag_mask) == value_int_tag; }
+constexpr bool value_is_bool(Value v)   { return (v.bits & value_tag_mask) == value_bool_tag; }
+constexpr bool value_is_ref(Value v)    { return (v.bits & value_tag_mask) == value_ref_tag; }
+
+constexpr std::int32_t value_int(Value v) { return static_cast<std::int32_t>(static_cast<std::uint32_t>(v.bits)); }
+constexpr double value_double(Value v)    { return std::bit_cast<double>(v.bits); }
+constexpr bool value_bool(Value v)        { return (v.bits & 1) != 0; }
+
+Value value_ref(const void* ptr) {
+    const std::uint64_t address = reinterpret_cast<std::uintptr_t>(ptr);
+    assert((address & ~value_payload_mask) == 0 && "pointer does not fit in a Value");
+    Value v{};
+    v.bits = value_ref_tag | address;
+    return v;
+}
+
+template<typename T>
+T* value_ref_as(Value v) {
+    return reinterpret_cast<T*>(static_cast<std::uintptr_t>(v.bits & value_payload_mask));
+}
+
+constexpr bool value_both_int(Value a, Value b)    { return value_is_int(a) && value_is_int(b); }
+constexpr bool value_both_double(Value a, Value b) { return value_is_double(a) && value_is_double(b); }
+
+constexpr std::int32_t value_wrap(std::uint32_t i) { return static_cast<std::int32_t>(i); }
+
+constexpr double value_number(Value v) {
+    if (value_is_double(v))
+        return value_double(v);
+    if (value_is_bool(v))
+        return value_bool(v) ? 1.0 : 0.0;
+    return value_int(v);
+}
+
+template<typename IntOp, typename DoubleOp>
+constexpr Value value_arith_slow(Value a, Value b, IntOp int_op, DoubleOp double_op) {
+    if (value_is_ref(a) || value_is_ref(b))
+        return Value(std::numeric_limits<double>::quiet_NaN());
+    if (value_is_double(a) || value_is_double(b))
+        return Value(double_op(value_number(a), value_number(b)));
+    return Value(int_op(static_cast<std::int32_t>(value_number(a)), static_cast<std::int32_t>(value_number(b))));
+}
+
+constexpr Value operator+(Value a, Value b) {
+    if (value_both_int(a, b)) [[likely]]
+        return Value(value_wrap(static_cast<std::uint32_t>(value_int(a)) + static_cast<std::uint32_t>(value_int(b))));
+    if (value_both_double(a, b))
+        return Value(value_double(a) + value_double(b));
+    return value_arith_slow(a, b, [](std::int32_t x, std::int32_t y) { return value_wrap(std::uint32_t(x) + std::uint32_t(y)); },
+                            [](double x, double y) { return x + y; });
+}
+
+constexpr Value operator-(Value a, Value b) {
+    if (value_both_int(a, b)) [[likely]]
+        return Value(value_wrap(static_cast<std::uint32_t>(value_int(a)) - static_cast<std::uint32_t>(value_int(b))));
+    if (value_both_double(a, b))
+        return Value(value_double(a) - value_double(b));
+    return value_arith_slow(a, b, [](std::int32_t x, std::int32_t y) { return value_wrap(std::uint32_t(x) - std::uint32_t(y)); },
+                            [](double x, double y) { return x - y; });
+}
+
+constexpr Value operator*(Value a, Value b) {
+    if (value_both_int(a, b)) [[likely]]
+        return Value(value_wrap(static_cast<std::uint32_t>(value_int(a)) * static_cast<std::uint32_t>(value_int(b))));
+    if (value_both_double(a, b))
+        return Value(value_double(a) * value_double(b));
+    return value_arith_slow(a, b, [](std::int32_t x, std::int32_t y) { return value_wrap(std::uint32_t(x) * std::uint32_t(y)); },
+                            [](double x, double y) { return x * y; });
+}
+
+constexpr Value operator/(Value a, Value b) {
+    if (value_both_int(a, b) && value_int(b) != 0 && !(value_int(b) == -1 && value_int(a) == std::numeric_limits<std::int32_t>::min())) [[likely]]
+        return Value(value_int(a) / value_int(b));
+    if (value_is_ref(a) || value_is_ref(b))
+        return Value(std::numeric_limits<double>::quiet_NaN());
+    return Value(value_number(a) / value_number(b));
+}
+
+constexpr Value& operator+=(Value& a, Value b) {
+    a = a + b;
+    return a;
+}
+
+constexpr bool operator==(Value a, Value b) {
+    if (value_both_int(a, b)) [[likely]]
+        return a.bits == b.bits;
+    if (value_is_ref(a) || value_is_ref(b))
+        return a.bits == b.bits;
+    return value_number(a) == value_number(b);
+}
+
+constexpr bool operator<(Value a, Value b) {
+    if (value_both_int(a, b)) [[likely]]
+        return value_int(a) < value_int(b);
+    if (value_is_ref(a) || value_is_ref(b))
+        return false;
+    return value_number(a) < value_number(b);
+}
+
+std::to_chars_result to_chars(char* first, char* last, Value v) {
+    if (value_is_int(v))
+        return std::to_chars(first, last, value_int(v));
+    if (value_is_double(v))
+        return std::to_chars(first, last, value_double(v));
+    const std::string_view text = value_is_ref(v) ? "ref:0x" : value_bool(v) ? "true" : "false";
+    if (static_cast<std::size_t>(last - first) < text.size())
+        return {last, std::errc::value_too_large};
+    first = std::copy(text.begin(), text.end(), first);
+    if (!value_is_ref(v))
+        return {first, std::errc{}};
+    return std::to_chars(first, last, v.bits & value_payload_mask, 16);
+}
+
+std::from_chars_result from_chars(const char* first, const char* last, Value& v) {
+    const std::string_view str(first, last - first);
+    if (str == "true" || str == "false") {
+        v = Value(str == "true");
+        return {last, std::errc{}};
+    }
+    std::int32_t i{};
+    auto [int_end, int_ec] = std::from_chars(first, last, i);
+    if (int_ec == std::errc{} && int_end == last) {
+        v = Value(i);
+        return {last, std::errc{}};
+    }
+    double d{};
+    auto result = std::from_chars(first, last, d);
+    if (result.ec == std::errc{})
+        v = Value(d);
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& os, Value v) {
+    std::array<char, 32> buf{};
+    auto [ptr, ec] = to_chars(buf.data(), buf.data() + buf.size(), v);
+    return os.write(buf.data(), ptr - buf.data());
+}
+
+}//ns
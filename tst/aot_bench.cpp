@@ -0,0 +1,160 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include "../LemonVM.hpp"
+#include "workloads.hpp"
+
+using namespace LemonVM;
+
+/*
+ * Benchmarks programs translated to C++ ahead of time against evaluating them:
+ *   exec  iset_eval
+ *   aot   aot_eval of the translation, compiled into this benchmark by the build
+ * The workloads start with their input on the stack, so the compiler can not fold
+ * the translations. Every translation is checked to leave the same state, stack,
+ * step count and output as evaluating the program. Each is run several times and
+ * the fastest run is reported.
+ *
+ * Usage: lemonvm_aot_bench [--csv] [--reps N] [program...]
+ */
+
+extern "C" {
+int lemonvm_aot_fib(AotVM*);
+int lemonvm_aot_loop(AotVM*);
+int lemonvm_aot_variables(AotVM*);
+int lemonvm_aot_calls(AotVM*);
+int lemonvm_aot_generated(AotVM*);
+int lemonvm_aot_cube_of_7(AotVM*);
+}
+
+struct Translated {
+    std::string name{};
+    std::string source{};
+    AotFunction function{nullptr};
+    VM start{};
+};
+
+struct Result {
+    std::string name{};
+    std::uint64_t steps{0};
+    double exec_ns{0};
+    double aot_ns{0};
+    bool ok{false};
+};
+
+std::vector<Translated> translated_default(void) {
+    const Workloads workloads = workloads_default();
+    const AotFunction functions[] = {
+        lemonvm_aot_fib,
+        lemonvm_aot_loop,
+        lemonvm_aot_variables,
+        lemonvm_aot_calls,
+        lemonvm_aot_generated,
+    };
+    std::vector<Translated> programs{};
+    for (std::size_t i = 0; i < workloads.size(); i++)
+        programs.push_back({workloads[i].name, workloads[i].source, functions[i], workload_vm(workloads[i])});
+    programs.push_back({"cube-of-7", file_slurp(LEMONVM_EXAMPLES "/cube-of-7.hl"), lemonvm_aot_cube_of_7});
+    return programs;
+}
+
+template<typename Fn>
+double time_best_ns(std::size_t reps, Fn fn) {
+    double best = 0;
+    for (std::size_t i = 0; i < reps; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (i == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+Result run_translated(const Translated& t, std::size_t reps) {
+    Result r{};
+    r.name = t.name;
+    const Program prg = assemble_program(t.source);
+    if (!is_linked(prg)) {
+        std::cerr << t.name << ":\n" << link_errors_str(prg);
+        return r;
+    }
+
+    VM expect{};
+    State expect_state{};
+    Output expect_out{};
+    r.exec_ns = time_best_ns(reps, [&]() {
+        expect_out = output_vector();
+        expect = t.start;
+        expect.output = &expect_out;
+        expect_state = iset_eval(expect, prg);
+    });
+    r.steps = expect.steps;
+
+    r.ok = expect_state != State::ERR;
+    r.aot_ns = time_best_ns(reps, [&]() {
+        Output out = output_vector();
+        VM vm = t.start;
+        vm.output = &out;
+        const State state = aot_eval(vm, t.function);
+        r.ok = r.ok && state == expect_state && vm.steps == expect.steps && vm.stack == expect.stack
+            && vm.ip == expect.ip && out.values == expect_out.values;
+    });
+    return r;
+}
+
+void print_json(const std::vector<Result>& results) {
+    std::cout << "{\n  \"programs\": [\n";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::cout << "    {"
+                  << "\"name\": \"" << r.name << "\", "
+                  << "\"ok\": " << (r.ok ? "true" : "false") << ", "
+                  << "\"steps\": " << r.steps << ", "
+                  << "\"exec_ns\": " << r.exec_ns << ", "
+                  << "\"aot_ns\": " << r.aot_ns << ", "
+                  << "\"speedup\": " << (r.aot_ns ? r.exec_ns / r.aot_ns : 0)
+                  << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n}" << std::endl;
+}
+
+void print_csv(const std::vector<Result>& results) {
+    std::cout << "name,ok,steps,exec_ns,aot_ns,speedup\n";
+    for (auto& r: results) {
+        std::cout << r.name << "," << r.ok << "," << r.steps << "," << r.exec_ns << "," << r.aot_ns << ","
+                  << (r.aot_ns ? r.exec_ns / r.aot_ns : 0) << "\n";
+    }
+    std::cout.flush();
+}
+
+int main(int argc, char **argv) {
+    bool csv = false;
+    std::size_t reps = 5;
+    std::vector<std::string> only{};
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else if (std::strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+            reps = std::max(1, std::atoi(argv[++i]));
+        else
+            only.push_back(argv[i]);
+    }
+
+    std::vector<Result> results{};
+    bool ok = true;
+    for (auto& t: translated_default()) {
+        if (!only.empty() && std::find(only.begin(), only.end(), t.name) == only.end())
+            continue;
+        results.push_back(run_translated(t, reps));
+        ok = ok && results.back().ok;
+    }
+
+    std::cout.precision(12);
+    if (csv)
+        print_csv(results);
+    else
+        print_json(results);
+    return ok ? 0 : 1;
+}
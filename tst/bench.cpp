@@ -0,0 +1,233 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include "../LemonVM.hpp"
+#include "workloads.hpp"
+
+using namespace LemonVM;
+
+/*
+ * Benchmarks for the VM, every workload is timed in each stage of getting from
+ * source to a result:
+ *   lex      tokenize
+ *   assemble assemble the tokens into an InstructionSet
+ *   link     link the InstructionSet
+ *   stream   assemble_program, the single pass that eval uses instead of the three above
+ *   exec     iset_eval
+ *   reg      reg_eval, with the program translated to registers beforehand, also
+ *            reporting how many register instructions were dispatched
+ *   jit      jit_eval, with the program translated to native code beforehand
+ * Each stage is run several times and the fastest run is reported.
+ *
+ * The write workloads write every value of a loop, once to a buffered output on
+ * /dev/null and once to an output that keeps the values in memory.
+ *
+ * The pool workloads evaluate a batch of fib programs on a worker pool, once for
+ * every thread count up to the number of cores, to show how throughput scales.
+ *
+ * Usage: lemonvm_bench [--csv] [--reps N] [workload...]
+ */
+
+struct Result {
+    std::string name{};
+    std::size_t source_bytes{0};
+    std::size_t instructions{0};
+    std::uint64_t steps{0};
+    double lex_ns{0};
+    double assemble_ns{0};
+    double link_ns{0};
+    double stream_ns{0};
+    double exec_ns{0};
+    double reg_ns{0};
+    std::uint64_t dispatches{0};
+    double jit_ns{0};
+    bool ok{false};
+};
+
+template<typename Fn>
+double time_best_ns(std::size_t reps, Fn fn) {
+    double best = 0;
+    for (std::size_t i = 0; i < reps; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (i == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+Result run_workload(const Workload& w, std::size_t reps) {
+    Result r{};
+    Tokens tokens{};
+    InstructionSet iset{};
+    Program prg{};
+    r.name = w.name;
+    r.source_bytes = w.source.size();
+    r.lex_ns      = time_best_ns(reps, [&]() { tokens = tokenize(w.source); });
+    r.assemble_ns = time_best_ns(reps, [&]() { iset = assemble(tokens); });
+    r.link_ns     = time_best_ns(reps, [&]() { prg = link(iset); });
+    r.stream_ns   = time_best_ns(reps, [&]() { prg = assemble_program(w.source); });
+    r.instructions = prg.code.size();
+    if (!is_linked(prg)) {
+        std::cerr << w.name << ":\n" << link_errors_str(prg);
+        return r;
+    }
+
+    r.ok = true;
+    r.exec_ns = time_best_ns(reps, [&]() {
+        VM vm = workload_vm(w);
+        const State state = iset_eval(vm, prg);
+        r.steps = vm.steps;
+        r.ok = r.ok && state != State::ERR && !vm.stack.empty() && vm.stack.back() == w.expect;
+    });
+
+    RegisterProgram rp{};
+    if (reg_compile(prg, rp) == State::OK) {
+        r.reg_ns = time_best_ns(reps, [&]() {
+            VM vm = workload_vm(w);
+            r.dispatches = 0;
+            const State state = reg_eval(vm, prg, rp, &r.dispatches);
+            r.ok = r.ok && state != State::ERR && vm.steps == r.steps && vm.stack.back() == w.expect;
+        });
+    }
+
+    Jit jit{};
+    if (jit_compile(prg, jit) != State::OK)
+        return r;
+    r.jit_ns = time_best_ns(reps, [&]() {
+        VM vm = workload_vm(w);
+        const State state = jit_eval(vm, prg, jit);
+        r.ok = r.ok && state != State::ERR && vm.steps == r.steps && vm.stack.back() == w.expect;
+    });
+    return r;
+}
+
+Result run_pool(const Workload& w, std::size_t threads, std::size_t jobs, std::size_t reps) {
+    Result r{};
+    Pool pool{};
+    pool_start(pool, threads);
+    const SharedProgram prg = assemble_shared(w.source);
+    r.name = "pool-" + w.name + "-t" + std::to_string(threads);
+    r.source_bytes = w.source.size();
+    r.instructions = prg->code.size();
+    r.ok = is_linked(*prg);
+    r.exec_ns = time_best_ns(reps, [&]() {
+        const BatchResults results = pool_eval(pool, *prg, std::vector<VM>(jobs, workload_vm(w)));
+        r.steps = 0;
+        for (auto& result: results) {
+            r.steps += result.vm.steps;
+            r.ok = r.ok && result.state != State::ERR && result.vm.stack.back() == w.expect;
+        }
+    });
+    return r;
+}
+
+Result run_output(const Workload& w, OutputKind kind, std::size_t reps) {
+    Result r{};
+    const Program prg = assemble_program(w.source);
+    r.name = w.name + (kind == OUTPUT_VECTOR ? "-vector" : "-fd");
+    r.source_bytes = w.source.size();
+    r.instructions = prg.code.size();
+    r.ok = is_linked(prg);
+    const int fd = kind == OUTPUT_VECTOR ? -1 : open("/dev/null", O_WRONLY);
+    r.exec_ns = time_best_ns(reps, [&]() {
+        Output out = kind == OUTPUT_VECTOR ? output_vector() : output_fd(fd);
+        VM vm = workload_vm(w);
+        vm.output = &out;
+        const State state = iset_eval(vm, prg);
+        r.steps = vm.steps;
+        r.ok = r.ok && state != State::ERR && vm.stack.back() == w.expect && out.written > 0;
+    });
+    if (fd >= 0)
+        close(fd);
+    return r;
+}
+
+double ns_per_step(const Result& r)   { return r.steps ? r.exec_ns / r.steps : 0; }
+double steps_per_sec(const Result& r) { return r.exec_ns ? r.steps / (r.exec_ns * 1e-9) : 0; }
+
+void print_json(const std::vector<Result>& results) {
+    std::cout << "{\n  \"workloads\": [\n";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::cout << "    {"
+                  << "\"name\": \"" << r.name << "\", "
+                  << "\"ok\": " << (r.ok ? "true" : "false") << ", "
+                  << "\"source_bytes\": " << r.source_bytes << ", "
+                  << "\"instructions\": " << r.instructions << ", "
+                  << "\"steps\": " << r.steps << ", "
+                  << "\"lex_ns\": " << r.lex_ns << ", "
+                  << "\"assemble_ns\": " << r.assemble_ns << ", "
+                  << "\"link_ns\": " << r.link_ns << ", "
+                  << "\"stream_ns\": " << r.stream_ns << ", "
+                  << "\"exec_ns\": " << r.exec_ns << ", "
+                  << "\"reg_ns\": " << r.reg_ns << ", "
+                  << "\"dispatches\": " << r.dispatches << ", "
+                  << "\"jit_ns\": " << r.jit_ns << ", "
+                  << "\"ns_per_instruction\": " << ns_per_step(r) << ", "
+                  << "\"instructions_per_sec\": " << steps_per_sec(r)
+                  << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n}" << std::endl;
+}
+
+void print_csv(const std::vector<Result>& results) {
+    std::cout << "name,ok,source_bytes,instructions,steps,lex_ns,assemble_ns,link_ns,stream_ns,exec_ns,reg_ns,dispatches,jit_ns,"
+                 "ns_per_instruction,instructions_per_sec\n";
+    for (auto& r: results) {
+        std::cout << r.name << "," << r.ok << "," << r.source_bytes << "," << r.instructions << ","
+                  << r.steps << "," << r.lex_ns << "," << r.assemble_ns << "," << r.link_ns << ","
+                  << r.stream_ns << "," << r.exec_ns << "," << r.reg_ns << "," << r.dispatches << "," << r.jit_ns << "," << ns_per_step(r) << "," << steps_per_sec(r)
+                  << "\n";
+    }
+    std::cout.flush();
+}
+
+int main(int argc, char **argv) {
+    bool csv = false;
+    std::size_t reps = 5;
+    std::vector<std::string> only{};
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else if (std::strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+            reps = std::max(1, std::atoi(argv[++i]));
+        else
+            only.push_back(argv[i]);
+    }
+
+    std::vector<Result> results{};
+    bool ok = true;
+    for (auto& w: workloads_default()) {
+        if (!only.empty() && std::find(only.begin(), only.end(), w.name) == only.end())
+            continue;
+        results.push_back(run_workload(w, reps));
+        ok = ok && results.back().ok;
+    }
+    if (only.empty() || std::find(only.begin(), only.end(), "write") != only.end()) {
+        for (auto kind: {OUTPUT_FD, OUTPUT_VECTOR}) {
+            results.push_back(run_output(workload_write(2000000), kind, reps));
+            ok = ok && results.back().ok;
+        }
+    }
+    if (only.empty() || std::find(only.begin(), only.end(), "pool") != only.end()) {
+        const std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::size_t> threads{};
+        for (std::size_t n = 1; n < cores; n *= 2)
+            threads.push_back(n);
+        threads.push_back(cores);
+        for (auto n: threads) {
+            results.push_back(run_pool(workload_fib(20, 6765), n, 256, reps));
+            ok = ok && results.back().ok;
+        }
+    }
+
+    std::cout.precision(12);
+    if (csv)
+        print_csv(results);
+    else
+        print_json(results);
+    return ok ? 0 : 1;
+}
@@ -2,6 +2,7 @@
 #include <cassert>
 #include "testlib.h"
 #include "../LemonVM.hpp"
+#include "workloads.hpp"
 
 using namespace LemonVM;
 
@@ -41,14 +42,13 @@ print_labels(LabelMap& labels)
 void test(void) {
     VM vm;
     State state;
-    LabelMap labels{};
 
     InstructionSet a = {
         ins_put(3),
         ins_put(4),
     };
     print_iset(a);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_stack(vm);
     TL_TEST(state == State::OK);
 
@@ -56,7 +56,7 @@ void test(void) {
         ins_plus(),
     };
     print_iset(b);
-    state = iset_eval(vm, labels, b);
+    state = iset_eval(vm, link(b));
     print_stack(vm);
     TL_TEST(state == State::OK);
 }
@@ -64,7 +64,6 @@ void test(void) {
 void test_exit(void) {
     VM vm;
     State state;
-    LabelMap labels{};
 
     InstructionSet a = {
         ins_put(1),
@@ -73,15 +72,23 @@ void test_exit(void) {
     };
 
     print_iset(a);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_stack(vm);
     TL_TEST(state == State::EXIT);
+    TL_TEST(vm.steps == 2);
+
+    /*A byte that is not an opcode is an error, whichever engine evaluates it*/
+    for (std::uint8_t byte: {std::uint8_t{OPCODE_INVALID}, std::uint8_t{OPCODE_COUNT}, std::uint8_t{200}}) {
+        Program broken = link(a);
+        broken.code[1].opcode = static_cast<Opcode>(byte);
+        VM bad{};
+        TL_TEST(iset_eval(bad, broken) == State::ERR && bad.ip == 1);
+    }
 }
 
 void test_math(void) {
     VM vm;
     State state;
-    LabelMap labels{};
 
     InstructionSet a = {
         ins_put(3),
@@ -93,7 +100,7 @@ void test_math(void) {
     };
 
     print_iset(a);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_stack(vm);
     TL_TEST(test_top(vm, 7));
 
@@ -105,7 +112,7 @@ void test_math(void) {
         // 14
     };
     print_iset(b);
-    state = iset_eval(vm, labels, b);
+    state = iset_eval(vm, link(b));
     stack_dump(vm);
     TL_TEST(test_top(vm, 14));
 
@@ -118,7 +125,7 @@ void test_math(void) {
         // 10
     };
     print_iset(c);
-    state = iset_eval(vm, labels, c);
+    state = iset_eval(vm, link(c));
     print_stack(vm);
     TL_TEST(test_top(vm, 10));
 
@@ -130,7 +137,7 @@ void test_math(void) {
         // 5
     };
     print_iset(d);
-    state = iset_eval(vm, labels, d);
+    state = iset_eval(vm, link(d));
     print_stack(vm);
     TL_TEST(test_top(vm, 5));
 }
@@ -138,7 +145,6 @@ void test_math(void) {
 void test_eq(void) {
     VM vm;
     State state;
-    LabelMap labels{};
 
     InstructionSet a = {
         ins_put(3),
@@ -147,7 +153,7 @@ void test_eq(void) {
         // 0
     };
     print_iset(a);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_stack(vm);
     TL_TEST(test_top(vm, 0));
     vm = VM{};
@@ -159,7 +165,7 @@ void test_eq(void) {
         // 1
     };
     print_iset(b);
-    state = iset_eval(vm, labels, b);
+    state = iset_eval(vm, link(b));
     print_stack(vm);
     TL_TEST(test_top(vm, 1));
 }
@@ -167,7 +173,6 @@ void test_eq(void) {
 void test_cmp(void) {
     VM vm;
     State state;
-    LabelMap labels{};
 
     InstructionSet a = {
         ins_put(3),
@@ -176,7 +181,7 @@ void test_cmp(void) {
         // 1
     };
     print_iset(a);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_stack(vm);
     TL_TEST(test_top(vm, 1));
 
@@ -188,7 +193,7 @@ void test_cmp(void) {
     };
     vm = VM{};
     print_iset(b);
-    state = iset_eval(vm, labels, b);
+    state = iset_eval(vm, link(b));
     print_stack(vm);
     TL_TEST(test_top(vm, 0));
 
@@ -200,11 +205,48 @@ void test_cmp(void) {
     };
     vm = VM{};
     print_iset(c);
-    state = iset_eval(vm, labels, c);
+    state = iset_eval(vm, link(c));
     print_stack(vm);
     TL_TEST(test_top(vm, -1));
 }
 
+void test_stack_spill(void) {
+    VM vm;
+    State state;
+
+    InstructionSet a = {
+        ins_put(1),
+        ins_put(2),
+    };
+    state = iset_eval(vm, link(a));
+    TL_TEST(state == State::OK);
+    TL_TEST(vm.stack.size() == 2);
+
+    InstructionSet b{};
+    for (int i = 0; i < 200; i++)
+        b.push_back(ins_put(i));
+    b.push_back(ins_dup(0));
+    b.push_back(ins_dup(201));
+    b.push_back(ins_swap());
+    state = iset_eval(vm, link(b));
+    print_stack(vm);
+    TL_TEST(state == State::OK);
+    TL_TEST(vm.stack.size() == 204);
+    TL_TEST(vm.stack[0] == 1);
+    TL_TEST(vm.stack[201] == 199);
+    TL_TEST(vm.stack[202] == 199);
+    TL_TEST(vm.stack[203] == 1);
+
+    InstructionSet c = {
+        ins_pop(),
+        ins_pop(),
+        ins_plus(),
+    };
+    state = iset_eval(vm, link(c));
+    TL_TEST(vm.stack.size() == 201);
+    TL_TEST(test_top(vm, 198+199));
+}
+
 void test_labelmap_create(void) {
     LabelMap labels{};
 
@@ -226,6 +268,46 @@ void test_labelmap_create(void) {
 
 }
 
+void test_link(void) {
+    VM vm;
+    State state;
+
+    InstructionSet a = {
+        /*0*/ ins_call("fn-main"),
+        ins_exit(),
+
+        /*2*/ ins_label("fn-main"),
+        ins_put(1),
+        ins_jmpif("fn-main"),
+    };
+
+    Program prg = link(a);
+    std::cout << ISet_disasemble(prg);
+    print_labels(prg.labels);
+    TL_TEST(is_linked(prg));
+    TL_TEST(prg.code[0].arg1 == 1);
+    TL_TEST(prg.functions[1].entry == 2);
+    TL_TEST(prg.code[4].arg1 == 2);
+    TL_TEST(prg.symbols.size() == 1);
+    TL_TEST(ISet_disasemble(prg) == ISet_disasemble(a));
+    TL_TEST(sizeof(prg.code[0]) == 8);
+
+    InstructionSet b = {
+        ins_put(1),
+        ins_jmpif("fn-missing"),
+        ins_call("fn-missing-too"),
+    };
+
+    prg = link(b);
+    std::cout << link_errors_str(prg);
+    TL_TEST(!is_linked(prg));
+    TL_TEST(prg.errors.size() == 2);
+    TL_TEST(prg.errors[0].ip == 1);
+    state = iset_eval(vm, prg);
+    TL_TEST(state == State::ERR);
+    TL_TEST(vm.stack.empty());
+}
+
 void test_jmpif(void) {
     VM vm;
     State state;
@@ -245,7 +327,7 @@ void test_jmpif(void) {
     };
 
     labels = extract_labels(a);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_iset(a);
     print_labels(labels);
     print_stack(vm);
@@ -266,7 +348,7 @@ void test_jmpif(void) {
 
     labels = extract_labels(b);
     vm = VM();
-    state = iset_eval(vm, labels, b);
+    state = iset_eval(vm, link(b));
     print_iset(a);
     print_labels(labels);
     print_stack(vm);
@@ -299,11 +381,74 @@ void test_call_return(void) {
     labels = extract_labels(a);
     print_iset(a);
     print_labels(labels);
-    state = iset_eval(vm, labels, a);
+    state = iset_eval(vm, link(a));
     print_stack(vm);
     TL_TEST(test_top(vm, 7*7*7));
 }
 
+void test_variables(void) {
+    VM vm;
+    State state;
+
+    InstructionSet a = {
+        ins_put(10),
+        ins_call("fib"),
+        ins_exit(),
+
+        ins_label("fib"),
+        ins_store("n"),
+        ins_load("n"),
+        ins_put(2),
+        ins_cmp(),
+        ins_put(1),
+        ins_eq(),
+        ins_jmpif("fib-base"),
+        ins_load("n"),
+        ins_put(1),
+        ins_minus(),
+        ins_call("fib"),
+        ins_load("n"),
+        ins_put(2),
+        ins_minus(),
+        ins_call("fib"),
+        ins_plus(),
+        ins_return(),
+
+        ins_label("fib-base"),
+        ins_load("n"),
+        ins_return(),
+    };
+
+    Program prg = link(a);
+    std::cout << ISet_disasemble(prg);
+    TL_TEST(is_linked(prg));
+    TL_TEST(prg.functions.size() == 2);
+    TL_TEST(prg.functions[1].locals.size() == 1);
+    state = iset_eval(vm, prg);
+    print_stack(vm);
+    TL_TEST(state == State::EXIT);
+    TL_TEST(test_top(vm, 55));
+    TL_TEST(vm.locals.size() == 0);
+
+    InstructionSet b = {
+        ins_var("x"),
+        ins_put(4),
+        ins_store("x"),
+        ins_put(5),
+        ins_store("x"),
+        ins_load("x"),
+        ins_load("y"),
+    };
+    prg = link(b);
+    std::cout << link_errors_str(prg);
+    TL_TEST(prg.errors.size() == 1);
+    TL_TEST(prg.errors[0].label == "y");
+    b.pop_back();
+    vm = VM{};
+    state = iset_eval(vm, link(b));
+    TL_TEST(test_top(vm, 5));
+}
+
 void test_tokenization(void) {
     VM vm;
     State state;
@@ -330,6 +475,35 @@ void test_tokenization(void) {
     Tokens tokens = tokenize(program);
     print_tokens(tokens);
     TL_TEST(tokens.size() == 17);
+    TL_TEST(tokens[0].str == "call" && tokens[0].line == 1 && tokens[0].column == 1);
+    TL_TEST(tokens[1].str == "main" && tokens[1].line == 1 && tokens[1].column == 6);
+    TL_TEST(tokens[16].str == "return" && tokens[16].line == 12 && tokens[16].column == 1);
+}
+void test_tokenization_edges(void) {
+    Tokens tokens;
+
+    /*Comment on the last line, without a newline*/
+    tokens = tokenize("put 1\n# the end");
+    TL_TEST(tokens.size() == 2);
+
+    /*Comment directly after a token, and the line after it*/
+    tokens = tokenize("put 1# one\nlabel x");
+    print_tokens(tokens);
+    TL_TEST(tokens.size() == 4);
+    TL_TEST(tokens[1].str == "1");
+    TL_TEST(tokens[2].str == "label" && tokens[2].line == 2 && tokens[2].column == 1);
+
+    /*Indented comment followed by an indented token*/
+    tokens = tokenize("  # comment\n\tput 2");
+    TL_TEST(tokens.size() == 2);
+    TL_TEST(tokens[0].str == "put" && tokens[0].line == 2 && tokens[0].column == 2);
+
+    /*Empty lines, windows line endings and only comments*/
+    tokens = tokenize("\n\nput 3\r\n\r\nexit\r\n");
+    TL_TEST(tokens.size() == 3);
+    TL_TEST(tokens[2].str == "exit" && tokens[2].line == 5);
+    TL_TEST(tokenize("").empty());
+    TL_TEST(tokenize("#\n#\n#").empty());
 }
 
 void test_assemble(void) {
@@ -388,6 +562,199 @@ void test_cube_function(void) {
     TL_TEST(test_top(vm, 7*7*7));
 }
 
+bool same_program(const Program& a, const Program& b) {
+    if (a.code.size() != b.code.size() || a.functions.size() != b.functions.size())
+        return false;
+    for (std::size_t ip = 0; ip < a.code.size(); ip++) {
+        if (a.code[ip].opcode != b.code[ip].opcode || a.code[ip].arg1 != b.code[ip].arg1)
+            return false;
+    }
+    for (std::size_t i = 0; i < a.functions.size(); i++) {
+        if (a.functions[i].name != b.functions[i].name || a.functions[i].entry != b.functions[i].entry ||
+            a.functions[i].locals != b.functions[i].locals)
+            return false;
+    }
+    return a.symbols == b.symbols && a.labels == b.labels;
+}
+void test_assemble_program(void) {
+    VM vm{};
+    State state = State::OK;
+
+    const std::string program = "put 10\n"
+                                "call fib\n"
+                                "exit\n"
+
+                                "label fib\n"
+                                "  store n\n"
+                                "  load n\n"
+                                "  put 2\n"
+                                "  cmp\n"
+                                "  put 1\n"
+                                "  eq\n"
+                                "  jmpif fib-base # forward reference\n"
+                                "  load n\n"
+                                "  addi -1\n"
+                                "  call fib\n"
+                                "  load n\n"
+                                "  put 2\n"
+                                "  minus\n"
+                                "  call fib\n"
+                                "  plus\n"
+                                "  return\n"
+
+                                "label fib-base\n"
+                                "  load n\n"
+                                "  return\n"
+        ;
+    Program prg = assemble_program(program);
+    std::cout << ISet_disasemble(prg);
+    TL_TEST(is_linked(prg));
+    TL_TEST(same_program(prg, link(assemble(tokenize(program)))));
+    state = iset_eval(vm, prg);
+    TL_TEST(state == State::EXIT);
+    TL_TEST(test_top(vm, 55));
+
+    TL_TEST(get_opcode("pop") == OPCODE_POP);
+    TL_TEST(get_opcode("incvar") == OPCODE_INCVAR);
+    TL_TEST(get_opcode("") == OPCODE_INVALID);
+    TL_TEST(get_opcode("exits") == OPCODE_INVALID);
+    for (auto mnemonic: mnemonics)
+        TL_TEST(get_opcode(mnemonic.name) == mnemonic.opcode);
+
+    prg = assemble_program("put 1\n"
+                           "  jmpif nowhere\n"
+                           "bogus\n"
+                           "put x1\n"
+                           "label a\n"
+                           "label a\n"
+                           "load q\n"
+                           "call");
+    std::cout << link_errors_str(prg);
+    TL_TEST(!is_linked(prg));
+    TL_TEST(prg.errors.size() == 6);
+    TL_TEST(prg.errors[0].label == "nowhere" && prg.errors[0].line == 2 && prg.errors[0].column == 9);
+    TL_TEST(prg.errors[1].label == "bogus" && prg.errors[1].ip == 2);
+    TL_TEST(prg.errors[2].label == "x1" && prg.errors[2].line == 4);
+    TL_TEST(prg.errors[3].label == "a" && prg.errors[3].ip == 5);
+    TL_TEST(prg.errors[4].label == "q");
+    TL_TEST(prg.errors[5].label == "call");
+    TL_TEST(prg.code.size() == 8);
+}
+void test_profile(void) {
+    VM vm{};
+    State state = State::OK;
+    Profile profile{};
+
+    const std::string program = fib_of(10);
+    const Program prg = assemble_program(program);
+    state = iset_eval_profiled(vm, prg, profile);
+    std::cout << profile_listing(prg, profile);
+    TL_TEST(state == State::EXIT);
+    TL_TEST(test_top(vm, 55));
+
+    std::uint64_t steps = 0;
+    for (auto count: profile.instructions)
+        steps += count;
+    TL_TEST(steps == vm.steps);
+    TL_TEST(profile.opcodes[OPCODE_CALL] == 177);
+    TL_TEST(profile.opcodes[OPCODE_EXIT] == 1);
+    TL_TEST(profile.functions.size() == 2);
+    TL_TEST(profile.functions[0].calls == 1);
+    TL_TEST(profile.functions[1].calls == 177);
+    TL_TEST(profile.functions[0].steps + profile.functions[1].steps == vm.steps);
+    TL_TEST(profile.functions[1].inclusive >= profile.functions[1].exclusive);
+    TL_TEST(profile.functions[0].inclusive >= profile.functions[1].inclusive);
+    TL_TEST(profile.frames.empty());
+    TL_TEST(profile_labels(prg, profile).at("fib") == 177);
+    TL_TEST(profile_labels(prg, profile).at("fib-base") == 89);
+
+    /*A profile keeps accumulating over evaluations*/
+    vm = VM{};
+    state = iset_eval_profiled(vm, prg, profile);
+    TL_TEST(profile.functions[1].calls == 2 * 177);
+}
+void test_sampler(void) {
+    VM vm{};
+    State state = State::OK;
+    Sampler sampler{};
+
+    const std::string program = fib_of(15);
+    const Program prg = assemble_program(program);
+    sampler.interval = 100;
+    vm.sampler = &sampler;
+    state = iset_eval(vm, prg);
+    const std::string folded = sampler_folded(sampler, prg);
+    std::cout << folded;
+    TL_TEST(state == State::EXIT);
+    TL_TEST(test_top(vm, 610));
+    TL_TEST(sampler.samples >= vm.steps / 100 - 20 && sampler.samples <= vm.steps / 100);
+    TL_TEST(folded.find(";fib;fib-base ") != std::string::npos);
+    std::uint64_t samples = 0;
+    for (auto& [stack, count]: sampler.stacks)
+        samples += count;
+    TL_TEST(samples == sampler.samples);
+
+    /*Disabled and requested samples*/
+    samples = sampler.samples;
+    sampler.enabled = false;
+    vm = VM{};
+    vm.sampler = &sampler;
+    state = iset_eval(vm, prg);
+    TL_TEST(sampler.samples == samples);
+    sampler.enabled = true;
+    sampler.interval = 0;
+    sampler.requested = true;
+    state = iset_eval(vm, prg);
+    TL_TEST(sampler.samples == samples + 1);
+
+    /*Sampling on a timer*/
+    Sampler timed{};
+    const std::string loop = "put 5000000\n"
+                             "label loop\n"
+                             "  put 1\n"
+                             "  minus\n"
+                             "  duplast\n"
+                             "  jmpif loop\n"
+                             "exit\n";
+    vm = VM{};
+    vm.sampler = &timed;
+    TL_TEST(sampler_timer_start(timed, std::chrono::microseconds(500)) == State::OK);
+    state = iset_eval(vm, assemble_program(loop));
+    sampler_timer_stop();
+    std::cout << sampler_folded(timed, assemble_program(loop));
+    TL_TEST(timed.samples > 0);
+    TL_TEST(timed.stacks.size() == 1);
+}
+void test_pool(void) {
+    Pool pool{};
+    pool_start(pool, 4);
+
+    const SharedProgram prg = assemble_shared(fib_source);
+    TL_TEST(is_linked(*prg));
+
+    std::vector<MemoryStack> inputs{};
+    for (Arg n = 0; n < 100; n++)
+        inputs.push_back({n % 20});
+    const BatchResults results = pool_eval(pool, *prg, inputs);
+    TL_TEST(results.size() == inputs.size());
+
+    bool same = true;
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        VM vm{};
+        vm.stack = inputs[i];
+        const State state = iset_eval(vm, *prg);
+        same = same && results[i].state == state && results[i].vm.stack == vm.stack;
+    }
+    TL_TEST(same);
+    TL_TEST(results[10].vm.stack.back() == 55);
+    TL_TEST(results[99].vm.stack.back() == 4181);
+
+    /*Batches can be submitted again, and without workers they run on the caller*/
+    TL_TEST(pool_eval(pool, *prg, inputs)[19].vm.stack.back() == 4181);
+    pool_stop(pool);
+    TL_TEST(pool_eval(pool, *prg, inputs)[19].vm.stack.back() == 4181);
+    TL_TEST(pool_eval(pool, *prg, std::vector<MemoryStack>{}).empty());
+}
 void test_comment(void) {
     VM vm{};
     State state = State::OK;
@@ -417,6 +784,122 @@ void test_comment(void) {
     TL_TEST(test_top(vm, 2*7+4));
 }
 
+void test_fuse(void) {
+    VM vm{};
+    State state = State::OK;
+
+    const std::string program = "call main\n"
+                                "exit\n"
+
+                                "label main\n"
+                                "put 7\n"
+                                "call cube\n"
+                                "put 2\n"
+                                "plus\n"
+                                "duplast\n"
+                                "put 345\n"
+                                "cmp\n"
+                                "jmpif main-wrong\n"
+                                "return\n"
+
+                                "label main-wrong\n"
+                                "put 0\n"
+                                "return\n"
+
+                                "label cube\n"
+                                "duplast\n"
+                                "duplast\n"
+                                "multiply\n"
+                                "multiply\n"
+                                "return\n"
+        ;
+
+    InstructionSet iset = assemble(tokenize(program));
+    const std::size_t size = iset.size();
+    const std::size_t removed = iset_fuse(iset);
+    print_iset(iset);
+    TL_TEST(removed == 3);
+    TL_TEST(iset.size() == size - removed);
+    TL_TEST(iset[5].opcode == OPCODE_ADDI);
+    TL_TEST(iset[8].opcode == OPCODE_JNE);
+    TL_TEST(iset[15].opcode == OPCODE_SQUARE);
+
+    state = iset_eval(vm, link(iset));
+    print_stack(vm);
+    TL_TEST(state == State::EXIT);
+    TL_TEST(test_top(vm, 7*7*7+2));
+}
+void test_bytecode(void) {
+    VM vm{};
+    State state = State::OK;
+
+    const std::string program = "call main\n"
+                                "exit\n"
+
+                                "label main\n"
+                                "put 7\n"
+                                "store x\n"
+                                "load x\n"
+                                "call cube\n"
+                                "return\n"
+
+                                "label cube\n"
+                                "duplast\n"
+                                "duplast\n"
+                                "multiply\n"
+                                "multiply\n"
+                                "return\n"
+        ;
+    const Program prg = link(assemble(tokenize(program)));
+    const std::vector<std::uint8_t> binary = generate_bytecode(prg);
+    TL_TEST(binary[0] == 25 && binary[1] == 01);
+
+    Program loaded{};
+    state = read_bytecode(binary.data(), binary.size(), nullptr, loaded);
+    TL_TEST(state == State::OK);
+    TL_TEST(ISet_disasemble(loaded) == ISet_disasemble(prg));
+
+    std::vector<std::uint8_t> broken = binary;
+    broken[0] = 0;
+    TL_TEST(read_bytecode(broken.data(), broken.size(), nullptr, loaded) == State::ERR);
+    broken = binary;
+    broken.resize(binary.size() - 1);
+    TL_TEST(read_bytecode(broken.data(), broken.size(), nullptr, loaded) == State::ERR);
+    broken = binary;
+    const std::uint64_t symbols = std::uint64_t(1) << 58;
+    std::memcpy(broken.data() + binary_code_offset + 8 + program_code(prg).size() * sizeof(Bytecode), &symbols, sizeof(symbols));
+    TL_TEST(read_bytecode(broken.data(), broken.size(), nullptr, loaded) == State::ERR);
+    broken = binary;
+    broken[binary_code_offset + 8 + 3 * sizeof(Bytecode)] = 200;
+    TL_TEST(read_bytecode(broken.data(), broken.size(), nullptr, loaded) == State::ERR);
+    Program unknown = prg;
+    unknown.code[3].opcode = static_cast<Opcode>(200);
+    TL_TEST(!program_verify(unknown).verified);
+
+    /*Function entries outside of the code are neither verified nor loaded*/
+    Program misplaced = prg;
+    misplaced.functions.back().entry = program_code(prg).size() + 100;
+    TL_TEST(!program_verify(misplaced).verified);
+    broken = generate_bytecode(misplaced);
+    TL_TEST(read_bytecode(broken.data(), broken.size(), nullptr, loaded) == State::ERR);
+    misplaced = prg;
+    std::swap(misplaced.functions.front().entry, misplaced.functions.back().entry);
+    TL_TEST(!program_verify(misplaced).verified);
+
+    const std::string path = "test_bytecode.lbc";
+    TL_TEST(write_bytecode(path, prg) == State::OK);
+    state = load_bytecode(path, loaded);
+    TL_TEST(state == State::OK);
+    TL_TEST(loaded.code.empty());
+    std::cout << ISet_disasemble(loaded) << std::endl;
+
+    state = iset_eval(vm, loaded);
+    print_stack(vm);
+    TL_TEST(state == State::EXIT);
+    TL_TEST(test_top(vm, 7*7*7));
+    std::remove(path.c_str());
+}
+
 void test_file(void) {
     VM vm{};
     State state = State::OK;
@@ -427,6 +910,696 @@ void test_file(void) {
     TL_TEST(test_top(vm, 7*7*7));
 }
 
+void test_tasks(void) {
+    /*fib(20) + fib(21), with both spawned as green threads*/
+    const Program prg = assemble_program("put 20\n"
+                                         "spawn fib\n"
+                                         "put 21\n"
+                                         "spawn fib\n"
+                                         "join\n"
+                                         "swap\n"
+                                         "join\n"
+                                         "plus\n"
+                                         "exit\n"
+
+                                         "label fib\n"
+                                         "  store n\n"
+                                         "  load n\n"
+                                         "  put 2\n"
+                                         "  cmp\n"
+                                         "  put 1\n"
+                                         "  eq\n"
+                                         "  jmpif fib-base\n"
+                                         "  load n\n"
+                                         "  put 1\n"
+                                         "  minus\n"
+                                         "  call fib\n"
+                                         "  load n\n"
+                                         "  put 2\n"
+                                         "  minus\n"
+                                         "  call fib\n"
+                                         "  plus\n"
+                                         "  yield\n"
+                                         "  return\n"
+
+                                         "label fib-base\n"
+                                         "  load n\n"
+                                         "  return\n");
+    TL_TEST(is_linked(prg));
+    TL_TEST(str(prg, 1) == "spawn fib");
+    TL_TEST(prg.functions.size() == 2);
+
+    for (std::size_t threads: {0, 1, 3}) {
+        Pool pool{};
+        pool_start(pool, threads);
+        if (threads == 0)
+            pool_stop(pool);
+        VM vm{};
+        TL_TEST(sched_eval(pool, vm, prg) == State::EXIT);
+        TL_TEST(vm.stack.size() == 1 && vm.stack.back() == 17711);
+        /*Waiting in a join does not count as evaluating it again*/
+        TL_TEST(vm.steps == 9);
+
+        /*Tasks that only wait for each other fail instead of spinning forever*/
+        VM self{};
+        TL_TEST(sched_eval(pool, self, assemble_program("put 0\njoin\n")) == State::ERR);
+        VM cycle{};
+        TL_TEST(sched_eval(pool, cycle, assemble_program("put 0\nspawn wait\njoin\nexit\n"
+                                                         "label wait\n  join\n  return\n")) == State::ERR);
+        VM waited{};
+        TL_TEST(sched_eval(pool, waited, assemble_program("put 1\nspawn wait\njoin\nexit\n"
+                                                          "label wait\n  put 0\n  label loop\n  subi 1\n  yield\n"
+                                                          "  duplast\n  put -1000\n  jne loop\n  return\n")) == State::EXIT);
+        TL_TEST(waited.stack.back() == -1000 && waited.steps == 4);
+    }
+
+    /*Green threads need a scheduler*/
+    VM vm{};
+    TL_TEST(iset_eval(vm, prg) == State::ERR);
+
+    /*A yielding VM can be resumed without a scheduler*/
+    const Program yields = assemble_program("put 1\n"
+                                            "yield\n"
+                                            "put 2\n"
+                                            "plus\n");
+    VM resumed{};
+    TL_TEST(iset_eval(resumed, yields) == State::YIELD);
+    TL_TEST(resumed.stack.size() == 1 && resumed.ip == 2);
+    TL_TEST(iset_resume(resumed, yields) == State::OK);
+    TL_TEST(resumed.stack.size() == 1 && resumed.stack.back() == 3);
+
+    /*Joining something that was never spawned*/
+    const Program bad = assemble_program("put 42\n"
+                                         "join\n");
+    Pool pool{};
+    VM joined{};
+    TL_TEST(sched_eval(pool, joined, bad) == State::ERR);
+}
+
+/*A host coroutine, that starts right away and awaits an evaluation*/
+struct HostTask {
+    struct promise_type {
+        HostTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+HostTask host_await(VM& vm, const Program& prg, const Post& post, State& state) {
+    state = co_await eval_async(vm, prg, 1000, post);
+}
+
+void test_budget(void) {
+    const Program prg = assemble_program("put 5000\n"
+                                         "label loop\n"
+                                         "  put 1\n"
+                                         "  minus\n"
+                                         "  duplast\n"
+                                         "  jmpif loop\n"
+                                         "put 7\n");
+    TL_TEST(is_linked(prg));
+    VM whole{};
+    TL_TEST(iset_eval(whole, prg) == State::OK);
+
+    /*Evaluating in slices ends up exactly where evaluating at once does*/
+    VM sliced{};
+    std::size_t slices = 1;
+    State state = iset_eval_for(sliced, prg, 7);
+    TL_TEST(state == State::SUSPENDED && sliced.steps == 7);
+    while (state == State::SUSPENDED) {
+        state = iset_resume_for(sliced, prg, 7);
+        slices++;
+    }
+    TL_TEST(state == State::OK);
+    TL_TEST(sliced.stack == whole.stack);
+    TL_TEST(sliced.steps == whole.steps);
+    TL_TEST(slices == (whole.steps + 6) / 7);
+
+    /*Three evaluations taking turns on a single event loop*/
+    std::deque<std::coroutine_handle<>> ready{};
+    const Post post = [&](std::coroutine_handle<> h) { ready.push_back(h); };
+    std::array<VM, 3> vms{};
+    std::array<State, 3> states{State::ERR, State::ERR, State::ERR};
+    for (std::size_t i = 0; i < vms.size(); i++)
+        host_await(vms[i], prg, post, states[i]);
+    TL_TEST(ready.size() == 3);
+    std::size_t resumed = 0;
+    while (!ready.empty()) {
+        std::coroutine_handle<> h = ready.front();
+        ready.pop_front();
+        h.resume();
+        resumed++;
+    }
+    TL_TEST(resumed == 3 * (whole.steps / 1000));
+    for (std::size_t i = 0; i < vms.size(); i++)
+        TL_TEST(states[i] == State::OK && vms[i].stack == whole.stack);
+
+    /*Without an event loop, the slices run back to back*/
+    VM direct{};
+    Evaluation ev = eval_async(direct, prg, 100);
+    TL_TEST(!evaluation_done(ev));
+    evaluation_start(ev);
+    TL_TEST(evaluation_done(ev) && evaluation_state(ev) == State::OK);
+    TL_TEST(direct.stack == whole.stack);
+
+    /*Any value type*/
+    const Program squared = assemble_program<std::int64_t>("put 3037000499\nyield\nsquare\n");
+    Int64VM wide{};
+    Evaluation big = eval_async(wide, squared, 1);
+    evaluation_start(big);
+    TL_TEST(evaluation_state(big) == State::OK && wide.stack.back() == 9223372030926249001);
+}
+
+/*
+ * Evaluates a program in the evaluation loop and in another way, and compares the
+ * VMs. Programs that are evaluated as something else, like an optimized copy, only
+ * have to leave the same state and stack.
+ */
+template<typename Eval>
+bool same_eval(const Program& prg, Eval eval, bool whole = true) {
+    VM a{};
+    VM b{};
+    const State sa = iset_eval(a, prg);
+    const State sb = eval(b);
+    if (!whole)
+        return sa == sb && a.stack == b.stack;
+    return sa == sb && a.stack == b.stack && a.ip == b.ip && a.steps == b.steps &&
+           a.locals == b.locals && a.fp == b.fp && a.returnstack.size() == b.returnstack.size();
+}
+
+bool same_jit(const Program& prg) {
+    Jit jit{};
+#ifdef LEMONVM_JIT
+    if (jit_compile(prg, jit) != (prg.verification.verified ? State::OK : State::ERR))
+        return false;
+#endif
+    return same_eval(prg, [&](VM& vm) { return jit_eval(vm, prg, jit); });
+}
+
+void test_jit(void) {
+    const std::string fib = fib_of(20);
+    std::string spill{};
+    for (int i = 0; i < 300; i++)
+        spill += "put " + std::to_string(i) + "\n";
+    for (int i = 0; i < 299; i++)
+        spill += "plus\n";
+
+    const std::vector<std::string> sources = {
+        fib,
+        spill,
+        "put 10\nput 3\nminus\nput 4\nmultiply\nput -7\nplus\nexit\n",
+        "put 3\nput 3\neq\nput 3\nput 4\neq\nput 1\nput 2\ncmp\nput 2\nput 1\ncmp\nput 2\nput 2\ncmp\n",
+        "put 1\nput 2\nswap\npop\nduplast\nnop\n",
+        "put 100000\nlabel loop\n  put 1\n  minus\n  duplast\n  jmpif loop\nexit\n",
+        "call main\nexit\nlabel main\nput 7\ncall cube\nreturn\n"
+        "label cube\nduplast\nduplast\nmultiply\nmultiply\nreturn\n",
+        "var i\nlabel loop\n  incvar i\n  load i\n  put 1000\n  jne loop\n"
+        "load i\naddi 3\nsubi 1\nmuli 4\nsquare\nput 4004\nput 4004\njeq done\nput 1\nlabel done\n",
+        "put 9\nput 2\ndivide\nput 5\ndup 0\nwrite\nput 3\nplus\n",
+        "label top\nput 8\nput 2\ndivide\nduplast\nput 4\njeq out\nexit\nlabel out\nput 1\n",
+        /*A failing division leaves native code in the middle of its block*/
+        "put 5\nput 1\nput 0\ndivide\nput 2\nplus\n",
+        "put -2147483647\nput 1\nminus\nput -1\ndivide\nput 2\n",
+        "put 3\nlabel loop\n  subi 1\n  put 12\n  dup 0\n  divide\n  pop\n  duplast\n  jmpif loop\n",
+        /*Returning with an empty stack ends the program*/
+        "put 1\npop\nreturn\nput 5\n",
+    };
+    for (auto& source: sources) {
+        const Program prg = assemble_program(source);
+        TL_TEST(is_linked(prg) && same_jit(prg));
+    }
+
+    InstructionSet fused = assemble(tokenize(fib));
+    TL_TEST(iset_fuse(fused) > 0);
+    TL_TEST(same_jit(link(fused)));
+
+    /*Yielding in native code, and resuming a VM that stopped in the middle of a block*/
+    const Program prg = assemble_program("put 1\nput 2\nyield\nput 3\nplus\nplus\nput 4\nmultiply\n");
+    Jit jit{};
+#ifdef LEMONVM_JIT
+    TL_TEST(jit_compile(prg, jit) == State::OK);
+#else
+    TL_TEST(jit_compile(prg, jit) == State::ERR);
+#endif
+    VM a{};
+    VM b{};
+    TL_TEST(iset_eval(a, prg) == State::YIELD && jit_eval(b, prg, jit) == State::YIELD);
+    TL_TEST(a.stack == b.stack && a.ip == b.ip);
+    TL_TEST(iset_resume_for(b, prg, 2) == State::SUSPENDED);
+    TL_TEST(iset_resume(a, prg) == State::OK && jit_resume(b, prg, jit) == State::OK);
+    TL_TEST(a.stack == b.stack && a.steps == b.steps && b.stack.back() == 24);
+
+    /*Only verified programs are compiled*/
+    Program unverified = assemble_program("put 1\njmpif out\nlabel out\n");
+    unverified.verification.verified = false;
+    Jit rejected{};
+    TL_TEST(jit_compile(unverified, rejected) == State::ERR);
+}
+
+void test_translate(void) {
+    const Translation cube = iset_translate(assemble(tokenize("call main\nexit\nlabel main\nput 7\ncall cube\nreturn\n"
+                                                             "label cube\nduplast\nduplast\nmultiply\nmultiply\nreturn\n")),
+                                            "lemonvm_cube");
+    TL_TEST(is_translated(cube));
+    TL_TEST(cube.source.find("extern \"C\" int lemonvm_cube(AotVM* vm)") != std::string::npos);
+    TL_TEST(cube.source.find("#include \"") == std::string::npos);
+
+    /*Output goes through the VM, not straight to stdout*/
+    const Translation written = iset_translate(assemble(tokenize("put 7\nwrite\n")), "written");
+    TL_TEST(is_translated(written) && written.source.find("printf") == std::string::npos);
+    TL_TEST(written.source.find("c.vm->write(c.vm->vm, *--sp);") != std::string::npos);
+
+    const Translation loop = iset_translate(assemble(tokenize("put 3\nlabel loop\nsubi 1\nduplast\njmpif loop\n")), "loop");
+    TL_TEST(is_translated(loop));
+    TL_TEST(loop.source.find("goto L1;") != std::string::npos);
+
+    /*Code that has no structured counterpart is reported instead of translated*/
+    const std::vector<std::pair<std::string, std::string>> rejected = {
+        {"call f\nexit\nlabel f\nput 1\njmpif out\nreturn\nlabel g\nlabel out\nexit\ncall g\n", "jump out of its function"},
+        {"call f\nexit\nlabel f\nput 1\ncall g\nlabel g\nreturn\n", "fall through into function"},
+        {"label top\nput 1\ncall top\n", "call to the entry function"},
+        {"put 1\nspawn f\njoin\nexit\nlabel f\nreturn\n", "instruction can not be translated"},
+        {"put 1\njmpif nowhere\n", "unresolved symbol"},
+    };
+    for (auto& [source, what]: rejected) {
+        const Translation tr = iset_translate(assemble(tokenize(source)), "rejected");
+        TL_TEST(!is_translated(tr) && tr.source.empty() && std::string(tr.errors.front().what) == what);
+    }
+}
+
+constexpr auto static_cube = static_program<"call main\nexit\n"
+                                            "label main\n  put 7\n  call cube\n  duplast\n  write\n  return\n"
+                                            "label cube\n  duplast\n  duplast\n  multiply\n  multiply\n  return\n">();
+
+constexpr auto static_fib = static_program<fib_source>();
+
+void test_static(void) {
+    /*Everything up to the result is done by the compiler*/
+    constexpr auto tokens = static_tokenize<16>("put 1 # one\nput -2\nplus\n");
+    static_assert(tokens.size() == 5 && tokens[3].str == "-2" && tokens[3].line == 2);
+    static_assert(static_is_linked(static_cube) && static_cube.code.size() == 14 && static_cube.functions.size() == 3);
+    static_assert(!static_is_linked(static_program<"put 1\njmpif nowhere\nload x\n">()));
+
+    constexpr auto cube = [] {
+        StaticVM<16> vm{};
+        const State state = static_eval(vm, static_cube);
+        return std::pair{state, vm};
+    }();
+    static_assert(cube.first == State::EXIT && cube.second.output.size() == 1 && cube.second.output[0] == 343);
+    static_assert(cube.second.stack.size() == 1 && cube.second.stack[0] == 343);
+
+    constexpr auto fib = [] {
+        StaticVM<64> vm{};
+        vm.stack.push_back(15);
+        static_eval(vm, static_fib);
+        return vm;
+    }();
+    static_assert(fib.stack.back() == 610);
+
+    /*The same results as evaluating the program at runtime*/
+    VM vm{};
+    vm.stack = {15};
+    TL_TEST(iset_eval(vm, assemble_program(fib_source)) == State::EXIT);
+    TL_TEST(vm.stack.back() == 610 && vm.steps == fib.steps);
+
+    StaticVM<64> specialized{};
+    specialized.stack.push_back(15);
+    TL_TEST(static_run<static_fib>(specialized) == State::EXIT);
+    TL_TEST(specialized.stack.back() == 610 && specialized.steps == fib.steps);
+    StaticVM<16> runtime{};
+    TL_TEST(static_run<static_cube>(runtime) == State::EXIT && runtime.output[0] == 343);
+
+    /*Running out of a fixed capacity is an error, not a crash*/
+    StaticVM<4> small{};
+    TL_TEST(static_eval(small, static_program<"put 1\nput 2\nput 3\nput 4\nput 5\n">()) == State::ERR);
+    StaticVM<8> deep{};
+    deep.stack.push_back(15);
+    TL_TEST(static_eval(deep, static_fib) == State::ERR);
+
+    /*Bad operands fail like the checked evaluation loop, and overflow wraps around in constant expressions*/
+    constexpr auto static_state = [](auto prg) { StaticVM<8> vm{}; return static_eval(vm, prg); };
+    static_assert(static_state(static_program<"put 1\nput 0\ndivide\n">()) == State::ERR);
+    static_assert(static_state(static_program<"put -2147483648\nput -1\ndivide\n">()) == State::ERR);
+    static_assert(static_state(static_program<"put 1\nplus\n">()) == State::ERR);
+    static_assert(static_state(static_program<"pop\n">()) == State::ERR);
+    static_assert(static_state(static_program<"put 1\ndup 1\n">()) == State::ERR);
+    constexpr auto wrapped = [] {
+        StaticVM<8> vm{};
+        static_eval(vm, static_program<"put 2147483647\naddi 1\nput 65536\nsquare\n">());
+        return vm;
+    }();
+    static_assert(wrapped.stack[0] == -2147483648 && wrapped.stack[1] == 0);
+
+    Arg arg{};
+    static_assert([] { Arg a{}; return parse_arg("-2147483648", a) && a == -2147483648; }());
+    static_assert([] { Arg a{}; return !parse_arg("2147483648", a) && !parse_arg("-", a) && !parse_arg("1x", a); }());
+    TL_TEST(parse_arg("-2147483648", arg) && !parse_arg("2147483648", arg));
+}
+
+void test_value_types(void) {
+    const std::string fib = fib_of(20);
+    /*Every value type evaluates the same program the same way*/
+    VM vm{};
+    Int64VM vm64{};
+    DoubleVM vmd{};
+    TL_TEST(eval(vm, fib) == State::EXIT && vm.stack.back() == 6765);
+    TL_TEST(eval(vm64, fib) == State::EXIT && vm64.stack.back() == 6765 && vm64.steps == vm.steps);
+    TL_TEST(eval(vmd, fib) == State::EXIT && vmd.stack.back() == 6765.0 && vmd.steps == vm.steps);
+
+    /*Values that do not fit an Arg*/
+    const Program big = assemble_program<std::int64_t>("put 3037000499\nsquare\nput 4000000000\nmuli 3\nwrite\n");
+    TL_TEST(is_linked(big) && big.constants.size() == 3 && str(big, 0) == "put 3037000499");
+    TL_TEST(iset_eval(vm64, big) == State::OK && vm64.stack.back() == 9223372030926249001);
+    TL_TEST(!is_linked(assemble_program("put 3037000499\n")));
+
+    const Program half = assemble_program<double>("put 7\nput 2\ndivide\nput 0.5\naddi 0.25\nmultiply\nwrite\nput 1e300\nmuli 1e10\n");
+    TL_TEST(is_linked(half) && str(half, 3) == "put 0.5" && str(half, 4) == "addi 0.25");
+    vmd = DoubleVM{};
+    TL_TEST(iset_eval(vmd, half) == State::OK && vmd.stack.size() == 1 && vmd.stack.back() > 1e308);
+    TL_TEST(link(assemble<double>(tokenize("put 2.5\nduplast\nplus\n"))).constants.size() == 1);
+
+    /*A program only runs in a VM of the type it was assembled for*/
+    vm = VM{};
+    TL_TEST(iset_eval(vm, big) == State::ERR);
+    TL_TEST(!is_translated(program_translate(half, "half")));
+}
+
+void test_dynamic_values(void) {
+    static_assert(sizeof(Value) == 8 && value_is_int(Value{}) && value_int(Value{}) == 0);
+    static_assert(value_is_double(Value(-std::numeric_limits<double>::quiet_NaN())));
+    static_assert(Value(-std::numeric_limits<double>::quiet_NaN()).bits == value_canonical_nan);
+    static_assert(value_is_bool(Value(true)) && Value(true) == Value(1) && Value(2) < Value(2.5));
+    static_assert(value_int(Value(std::numeric_limits<std::int32_t>::max()) + Value(1)) == std::numeric_limits<std::int32_t>::min());
+
+    /*The same program gives the same result as in the int32 VM*/
+    VM vm{};
+    DynamicVM dyn{};
+    const std::string fib = fib_of(20);
+    TL_TEST(eval(vm, fib) == State::EXIT && eval(dyn, fib) == State::EXIT);
+    TL_TEST(value_is_int(dyn.stack.back()) && dyn.stack.back() == 6765 && dyn.steps == vm.steps);
+
+    /*Mixed types*/
+    const Program mixed = assemble_program<Value>("put 7\nput 2\ndivide\nput 7\nput 2.0\ndivide\n"
+                                                  "put true\naddi 1\nput 1\nput 0\ndivide\nwrite\n");
+    TL_TEST(is_linked(mixed) && str(mixed, 4) == "put 2" && str(mixed, 6) == "put true" && str(mixed, 7) == "addi 1");
+    dyn = DynamicVM{};
+    TL_TEST(iset_eval(dyn, mixed) == State::OK && dyn.stack.size() == 3);
+    TL_TEST(value_is_int(dyn.stack[0]) && value_int(dyn.stack[0]) == 3);
+    TL_TEST(value_is_double(dyn.stack[1]) && value_double(dyn.stack[1]) == 3.5);
+    TL_TEST(value_is_int(dyn.stack[2]) && value_int(dyn.stack[2]) == 2);
+    TL_TEST(!is_linked(assemble_program<Value>("put yes\n")));
+    TL_TEST(str(assemble_program<Value>("put 2.5\n"), 0) == "put 2.5");
+
+    /*References are moved around and compared, nothing else*/
+    int host = 0;
+    dyn = DynamicVM{};
+    dyn.stack = {value_ref(&host), value_ref(&host), value_ref(&host)};
+    TL_TEST(iset_eval(dyn, assemble_program<Value>("eq\nswap\nput 1\nplus\n")) == State::OK);
+    TL_TEST(dyn.stack.size() == 2 && dyn.stack[0] == 1 && value_is_double(dyn.stack[1]) && dyn.stack[1] != dyn.stack[1]);
+    TL_TEST(value_ref_as<int>(value_ref(&host)) == &host && value_str(value_ref(&host)).rfind("ref:0x", 0) == 0);
+}
+
+void test_verify(void) {
+    const Program cube = assemble_program("call main\nexit\nlabel main\nput 7\ncall cube\nreturn\n"
+                                          "label cube\nduplast\nduplast\nmultiply\nmultiply\nreturn\n");
+    TL_TEST(cube.verification.verified && !cube.verification.recursive);
+    TL_TEST(cube.verification.max_depth == 3 && cube.verification.max_calls == 2);
+    TL_TEST(cube.functions[2].needs == 1 && cube.functions[2].max_stack == 2);
+    TL_TEST(cube.verification.heights[4] == 1 && cube.verification.heights[9] == 2);
+
+    const Program fib = assemble_program(fib_of(15));
+    TL_TEST(fib.verification.verified && fib.verification.recursive);
+    VM a{};
+    VM b{};
+    TL_TEST(iset_eval(a, fib) == State::EXIT && iset_eval_checked(b, fib) == State::EXIT);
+    TL_TEST(a.stack == b.stack && a.steps == b.steps && a.stack.back() == 610);
+
+    /*Stacks that are too small and programs that can not be verified run checked, and report errors instead of reading past the stack*/
+    const std::vector<std::pair<std::string, State>> checked = {
+        {"put 1\nplus\n", State::ERR},
+        {"put 1\ndup 3\n", State::ERR},
+        {"put 1\njmpif skip\nput 2\nlabel skip\nput 3\n", State::OK},
+        {"put 1\njmpif skip\nput 2\nlabel skip\nplus\nplus\n", State::ERR},
+    };
+    for (auto& [source, state]: checked) {
+        VM vm{};
+        TL_TEST(iset_eval(vm, assemble_program(source)) == state);
+    }
+    TL_TEST(!assemble_program("put 1\njmpif skip\nput 2\nlabel skip\nput 3\n").verification.verified);
+
+    /*Returns without a call exit, no matter what is on the stack, and functions may return with an empty stack*/
+    VM ret{};
+    TL_TEST(iset_eval(ret, assemble_program("put 1\nput 2\nreturn\nput 5\n")) == State::EXIT && ret.stack.size() == 2);
+    VM empty{};
+    TL_TEST(iset_eval(empty, assemble_program("call f\nput 3\nlabel f\nreturn\n")) == State::EXIT);
+    TL_TEST(empty.stack.size() == 1 && empty.stack.back() == 3);
+
+    /*A verified program is only run unchecked from a stack that holds what it needs*/
+    const Program needs = assemble_program("plus\nexit\n");
+    TL_TEST(needs.verification.verified && needs.functions[0].needs == 2);
+    VM few{};
+    few.stack = {1};
+    TL_TEST(iset_eval(few, needs) == State::ERR && few.stack.size() == 1);
+    VM enough{};
+    enough.stack = {1, 2};
+    TL_TEST(iset_eval(enough, needs) == State::EXIT && enough.stack.back() == 3);
+
+    /*Resuming inside a call leaves room for the callers*/
+    const Program nested = assemble_program("put 1\ncall f\nput 2\nplus\nexit\nlabel f\nput 5\nyield\nplus\nreturn\n");
+    VM yielded{};
+    TL_TEST(iset_eval(yielded, nested) == State::YIELD && iset_resume(yielded, nested) == State::EXIT);
+    TL_TEST(yielded.stack.size() == 1 && yielded.stack.back() == 8);
+
+    VM divide{};
+    TL_TEST(iset_eval(divide, assemble_program("put 1\nput 0\ndivide\n")) == State::ERR && divide.stack.size() == 2);
+}
+
+bool same_optimized(const std::string& source, OptLevel level) {
+    const InstructionSet iset = assemble(tokenize(source));
+    InstructionSet optimized = iset;
+    iset_optimize(optimized, level);
+    const Program prg = link(optimized);
+    return same_eval(link(iset), [&](VM& vm) { return iset_eval(vm, prg); }, false);
+}
+
+void test_optimize(void) {
+    const std::vector<std::string> sources = {
+        fib_of(12),
+        "call main\nexit\nlabel main\nput 7\ncall cube\nreturn\nlabel cube\nduplast\nduplast\nmultiply\nmultiply\nreturn\n",
+        "put 0\nstore sum\nput 100\nstore i\nlabel loop\nload sum\nput 3\nplus\nstore sum\n"
+        "load i\nput 1\nminus\nstore i\nload i\njmpif loop\nload sum\nexit\n",
+        "put 3\nput 4\nplus\nput 2\nmultiply\nput 6\nswap\nminus\nduplast\nsquare\nput 9\nput 2\ndivide\n"
+        "put 5\nput 0\ndivide\n",
+        "put 1\nput 2\ncmp\nput 2\nput 1\ncmp\nput 3\nput 3\neq\nput -2147483647\nsubi 2\nmuli 3\n",
+        "put 1\nput 2\njne a\nput 9\nlabel a\nput 4\nput 4\njeq b\nput 8\nlabel b\nput 0\njmpif c\nput 7\nlabel c\n",
+        "var x\nload x\njmpif first\nput 1\njmpif second\nlabel first\nput 1\njmpif second\n"
+        "put 9\nexit\nlabel second\nput 7\n",
+        "put 1\nexit\nput 2\nlabel dead\nstore y\nexit\nlabel unused\nput 3\n",
+        "nop\nlabel f\nput 1\nreturn\ncall f\n",
+    };
+    for (auto& source: sources) {
+        TL_TEST(same_optimized(source, OPT_O1) && same_optimized(source, OPT_O2));
+    }
+
+    /*Constants are folded through the stack, and O0 changes nothing*/
+    InstructionSet folded = assemble(tokenize("put 3\nput 4\nplus\nput 2\nmultiply\nduplast\nswap\npop\nwrite\n"));
+    InstructionSet unchanged = folded;
+    TL_TEST(iset_optimize(unchanged, OPT_O0) == 0 && unchanged.size() == folded.size());
+    TL_TEST(iset_optimize(folded, OPT_O1) == 7 && folded[0].opcode == OPCODE_PUT && folded[0].arg1 == 14);
+
+    /*Code after exit and unused labels are removed, but the only creation of a loaded variable is kept*/
+    InstructionSet dead = assemble(tokenize("put 1\nexit\nput 2\nwrite\nlabel unused\nput 3\n"));
+    TL_TEST(iset_optimize(dead, OPT_O1) == 1 && iset_optimize(dead, OPT_O2) == 3 && dead.size() == 2);
+    InstructionSet kept = assemble(tokenize("load x\nexit\nlabel dead\nput 5\nstore x\n"));
+    TL_TEST(iset_optimize(kept, OPT_O2) == 1 && is_linked(link(kept)));
+
+    /*Jumps to jumps go straight to the end of the chain, and jumps to the next instruction disappear*/
+    InstructionSet chain = assemble(tokenize(sources[6]));
+    iset_optimize(chain, OPT_O2);
+    TL_TEST(std::none_of(chain.begin(), chain.end(), [](const Instruction& ins) { return ins.opcode == OPCODE_LABEL; }));
+    TL_TEST(chain.size() == 4 && chain[2].opcode == OPCODE_POP);
+
+    /*A called label is never moved to the start of the program, where it would become the entry function*/
+    InstructionSet entry = assemble(tokenize(sources[8]));
+    iset_optimize(entry, OPT_O1);
+    TL_TEST(entry.front().opcode == OPCODE_NOP && entry[1].opcode == OPCODE_LABEL);
+}
+
+void test_inline(void) {
+    /*Jumping leaves the stack alone, in every way a program can be evaluated*/
+    const std::string jumps = "put 0\nstore i\nlabel loop\nincvar i\nload i\nput 1000\njeq done\njmp loop\n"
+                              "label done\nload i\njmp skip\nput 9\nlabel skip\n";
+    VM vm{};
+    TL_TEST(iset_eval(vm, assemble_program(jumps)) == State::OK && vm.stack.size() == 1 && vm.stack[0] == 1000);
+    TL_TEST(same_jit(link(assemble(tokenize(jumps)))));
+    const Translation translated = iset_translate(assemble(tokenize(jumps)), "jumps");
+    TL_TEST(is_translated(translated) && translated.source.find("goto L2;") != std::string::npos);
+    constexpr auto over = [] {
+        StaticVM<8> vm{};
+        static_eval(vm, static_program<"put 3\njmp over\nput 4\nlabel over\nput 5\n">());
+        return vm;
+    }();
+    static_assert(over.stack.size() == 2 && over.stack[1] == 5);
+
+    /*Leaf functions are copied into their callers, with fresh variables for every copy*/
+    const std::vector<std::string> sources = {
+        "call main\nexit\nlabel main\nput 7\ncall cube\nreturn\nlabel cube\nduplast\nduplast\nmultiply\nmultiply\nreturn\n",
+        "call next\ncall next\nexit\nlabel next\nload k\naddi 1\nduplast\nstore k\nreturn\n",
+        "put 5\ncall f\nexit\nlabel f\nload k\naddi 1\nduplast\nstore k\nswap\nsubi 1\nduplast\njmpif more\nreturn\nlabel more\ncall f\nreturn\n",
+        "put 1\ncall sign\nput -4\ncall sign\nexit\nlabel sign\nduplast\nput 0\ncmp\nput 1\neq\njmpif negative\n"
+        "pop\nput 1\nreturn\nlabel negative\npop\nput -1\nreturn\n",
+    };
+    for (auto& source: sources)
+        TL_TEST(same_optimized(source, OPT_O2));
+    InstructionSet cube = assemble(tokenize(sources[0]));
+    TL_TEST(iset_inline(cube) == 1);
+    iset_optimize(cube, OPT_O2);
+    TL_TEST(std::none_of(cube.begin(), cube.end(), [](const Instruction& ins) { return ins.opcode == OPCODE_CALL; }));
+    InstructionSet large = assemble(tokenize(sources[0]));
+    TL_TEST(iset_inline(large, 3) == 0);
+
+    /*A function calling itself right before it returns jumps instead, and recurses in constant space*/
+    const std::string down = "put 100000\ncall down\nexit\nlabel down\nduplast\njmpif more\nexit\n"
+                             "label more\nsubi 1\ncall down\nreturn\n";
+    InstructionSet tail = assemble(tokenize(down));
+    TL_TEST(iset_tail_calls(tail) == 1 && tail[tail.size() - 2].opcode == OPCODE_JMP);
+    VM deep{};
+    VM flat{};
+    TL_TEST(iset_eval(deep, link(assemble(tokenize(down)))) == State::EXIT && deep.returnstack.size() == 100001);
+    TL_TEST(iset_eval(flat, link(tail)) == State::EXIT && flat.returnstack.size() == 1);
+    TL_TEST(flat.stack == deep.stack && same_jit(link(tail)));
+    InstructionSet only = assemble(tokenize("label f\nput 1\ncall f\nreturn\n"));
+    TL_TEST(iset_tail_calls(only) == 0);
+}
+
+bool same_registers(const Program& prg, const std::vector<std::string>& functions = {}) {
+    RegisterProgram rp{};
+    if (reg_compile(prg, rp, functions) != State::OK)
+        return false;
+    return same_eval(prg, [&](VM& vm) { return reg_eval(vm, prg, rp); });
+}
+
+void test_registers(void) {
+    /*The register tier leaves the VM exactly like the evaluation loop*/
+    const std::vector<std::string> sources = {
+        fib_of(15),
+        "call main\nexit\nlabel main\nput 7\ncall cube\nreturn\nlabel cube\nduplast\nduplast\nmultiply\nmultiply\nreturn\n",
+        "put 0\nstore sum\nput 1000\nstore i\nlabel loop\nload sum\nload i\nplus\nstore sum\n"
+        "load i\nsubi 1\nduplast\nstore i\njmpif loop\nload sum\nexit\n",
+        "put 3\nput 4\nswap\nminus\nput 5\nput 6\nplus\nswap\nput 2\nmultiply\ndup 0\nsquare\nput 7\nput 2\ndivide\n",
+        "var x\nput 1\nstore x\nload x\nload x\nput 5\nstore x\nload x\nplus\nplus\nincvar x\nload x\nswap\npop\n",
+        "put 9\nput 3\nput 0\ndivide\n",
+        "put 1\nput 2\njne a\nput 9\nlabel a\nput 4\nput 4\njeq b\nput 8\nlabel b\nput 0\njmpif c\nput 7\nlabel c\njmp d\nput 6\nlabel d\n",
+        "put 5\nspawn f\nyield\nput 2\nexit\nlabel f\naddi 1\nreturn\n",
+        "put 2\nput 3\nput 4\nreturn\n",
+    };
+    for (auto& source: sources) {
+        const Program prg = assemble_program(source);
+        if (prg.verification.verified)
+            TL_TEST(same_registers(prg));
+    }
+
+    /*Chains of pushes, an operation and a store are a single register instruction*/
+    RegisterProgram chain{};
+    TL_TEST(reg_compile(assemble_program("var a\nvar b\nvar c\nload a\nload b\nplus\nstore c\nload c\naddi 3\nstore a\n"), chain) == State::OK);
+    TL_TEST(chain.code.size() == 6 && chain.code[3].opcode == REG_ADD && chain.code[3].dst.kind == REG_LOCAL);
+    TL_TEST(chain.code[3].steps == 4 && chain.code[4].b.kind == REG_IMM && chain.code[4].b.value == 3);
+
+    /*Fewer dispatches for the same steps*/
+    const Program loop = assemble_program(sources[2]);
+    RegisterProgram rp{};
+    std::uint64_t dispatches = 0;
+    VM vm{};
+    TL_TEST(reg_compile(loop, rp) == State::OK && reg_eval(vm, loop, rp, &dispatches) == State::EXIT);
+    TL_TEST(vm.stack.back() == 500500 && dispatches * 2 < vm.steps);
+
+    /*Only the hot functions of a profile, the rest is evaluated*/
+    const Program fib = assemble_program(sources[0]);
+    Profile profile{};
+    VM profiled{};
+    iset_eval_profiled(profiled, fib, profile);
+    const std::vector<std::string> hot = reg_hot_functions(fib, profile);
+    TL_TEST(hot.size() == 1 && hot[0] == "fib" && same_registers(fib, hot) && same_registers(fib, {"nothing"}));
+
+    /*Code that is not translated is evaluated by the evaluation loop, one dispatch per instruction*/
+    RegisterProgram cold{};
+    vm = VM{};
+    dispatches = 0;
+    TL_TEST(reg_compile(fib, cold, {"nothing"}) == State::OK && reg_eval(vm, fib, cold, &dispatches) == State::EXIT);
+    TL_TEST(dispatches == vm.steps && vm.stack.back() == 610);
+
+    /*Unverified programs are not translated*/
+    TL_TEST(reg_compile(assemble_program("put 1\njmpif a\nput 2\nlabel a\n"), rp) == State::ERR && rp.entries.empty());
+}
+
+void test_output(void) {
+    /*Every tier hands what is written to the output of the VM*/
+    const std::string source = "put 3\nstore i\nlabel loop\nload i\nduplast\nwrite\nsubi 1\nduplast\nstore i\njmpif loop\nput -7\nwrite\n";
+    const Program prg = assemble_program(source);
+    const std::vector<Arg> expect = {3, 2, 1, -7};
+    Output values = output_vector();
+    VM vm{};
+    vm.output = &values;
+    TL_TEST(iset_eval(vm, prg) == State::OK && values.values == expect && values.written == 4);
+
+    RegisterProgram rp{};
+    values = output_vector();
+    vm = VM{};
+    vm.output = &values;
+    TL_TEST(reg_compile(prg, rp) == State::OK && reg_eval(vm, prg, rp) == State::OK && values.values == expect);
+
+    Jit jit{};
+    values = output_vector();
+    vm = VM{};
+    vm.output = &values;
+    jit_compile(prg, jit);
+    TL_TEST(jit_eval(vm, prg, jit) == State::OK && values.values == expect);
+
+#ifdef LEMONVM_OUTPUT_FD
+    /*A small buffer is flushed whenever it fills up, and at the end of the evaluation*/
+    const std::string path = "test_output.txt";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Output text = output_fd(fd, 64);
+    vm = VM{};
+    vm.output = &text;
+    TL_TEST(iset_eval(vm, assemble_program("put 1000\nstore i\nlabel loop\nload i\nwrite\nload i\nsubi 1\nduplast\nstore i\njmpif loop\n")) == State::OK);
+    TL_TEST(text.used == 0);
+    close(fd);
+    std::string expect_text{};
+    for (int i = 1000; i > 0; i--)
+        expect_text += std::to_string(i) + "\n";
+    std::ifstream f(path);
+    TL_TEST(std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()) == expect_text);
+
+    /*A binary output writes the bytes of the values, and a failing program still flushes them*/
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    BasicOutput<double> binary = output_binary<double>(fd);
+    DoubleVM dvm{};
+    dvm.output = &binary;
+    TL_TEST(iset_eval(dvm, assemble_program<double>("put 1.5\nwrite\nput -2.25\nwrite\npop\n")) == State::ERR);
+    close(fd);
+    std::ifstream b(path, std::ios::binary);
+    const std::string bytes(std::istreambuf_iterator<char>(b), {});
+    double written[2] = {};
+    TL_TEST(bytes.size() == sizeof(written));
+    std::memcpy(written, bytes.data(), std::min(bytes.size(), sizeof(written)));
+    TL_TEST(written[0] == 1.5 && written[1] == -2.25);
+    std::remove(path.c_str());
+
+    /*Output that could not be written fails the evaluation*/
+    Output broken = output_fd(-1, 64);
+    vm = VM{};
+    vm.output = &broken;
+    TL_TEST(iset_eval(vm, prg) == State::ERR && broken.failed);
+    broken = output_fd(-1);
+    vm = VM{};
+    vm.output = &broken;
+    TL_TEST(reg_eval(vm, prg, rp) == State::ERR && jit_eval(vm, prg, jit) == State::ERR);
+#endif
+}
+
 int main(int argc, char **argv) {
 	(void)argc;
 	(void)argv;
@@ -436,14 +1609,36 @@ int main(int argc, char **argv) {
 	TL(test_math());
 	TL(test_eq());
 	TL(test_cmp());
+	TL(test_stack_spill());
 	TL(test_labelmap_create());
+	TL(test_link());
 	TL(test_jmpif());
 	TL(test_call_return());
+	TL(test_variables());
 
 	TL(test_tokenization());
+	TL(test_tokenization_edges());
 	TL(test_assemble());
+	TL(test_assemble_program());
 	TL(test_cube_function());
 	TL(test_comment());
+	TL(test_fuse());
+	TL(test_bytecode());
+	TL(test_profile());
+	TL(test_sampler());
+	TL(test_pool());
+	TL(test_tasks());
+	TL(test_budget());
+	TL(test_jit());
+	TL(test_translate());
+	TL(test_static());
+	TL(test_value_types());
+	TL(test_dynamic_values());
+	TL(test_verify());
+	TL(test_optimize());
+	TL(test_inline());
+	TL(test_registers());
+	TL(test_output());
 	//TL(test_file());
 
 
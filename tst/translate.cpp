@@ -0,0 +1,60 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include "../LemonVM.hpp"
+#include "workloads.hpp"
+
+using namespace LemonVM;
+
+/*
+ * Translates a program to a C++ source file ahead of time, see iset_translate.
+ * The program is either a source file, or with --workload the name of one of the
+ * benchmark workloads. The translation is an extern "C" function with the given
+ * name, to be evaluated with aot_eval once compiled into the host.
+ * The program is optimized first with -O1 or -O2, see iset_optimize.
+ *
+ * Usage: lemonvm_translate [-O0|-O1|-O2] [--workload] <program> <function> <output.cpp>
+ */
+
+int main(int argc, char **argv) {
+    OptLevel level = OPT_O0;
+    if (argc > 1 && std::strncmp(argv[1], "-O", 2) == 0) {
+        level = static_cast<OptLevel>(std::clamp(std::atoi(argv[1] + 2), 0, 2));
+        argc--;
+        argv++;
+    }
+    const bool workload = argc > 1 && std::strcmp(argv[1], "--workload") == 0;
+    if (argc != (workload ? 5 : 4)) {
+        std::cerr << "usage: " << argv[0] << " [-O0|-O1|-O2] [--workload] <program> <function> <output.cpp>\n";
+        return 2;
+    }
+    const std::string program = argv[workload ? 2 : 1];
+    const std::string function = argv[workload ? 3 : 2];
+    const std::string output = argv[workload ? 4 : 3];
+
+    std::string source{};
+    if (workload) {
+        for (auto& w: workloads_default()) {
+            if (w.name == program)
+                source = w.source;
+        }
+    }
+    else if (std::ifstream(program)) {
+        source = file_slurp(program);
+    }
+    if (source.empty()) {
+        std::cerr << program << ": no such program\n";
+        return 1;
+    }
+
+    InstructionSet iset = assemble(tokenize(source));
+    iset_optimize(iset, level);
+    const Translation tr = iset_translate(iset, function);
+    if (!is_translated(tr)) {
+        std::cerr << program << ":\n" << link_errors_str(tr.errors);
+        return 1;
+    }
+    std::ofstream out(output);
+    out << tr.source;
+    return out ? 0 : 1;
+}
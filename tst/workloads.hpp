@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../LemonVM.hpp"
+
+/*
+ * The workloads shared by the benchmarks, each is a program, the value it
+ * leaves on top of the stack and its input. The input is on the stack when the
+ * program starts rather than written into its source, so a translation can not
+ * fold the work away at compile time.
+ */
+
+struct Workload {
+    std::string name{};
+    std::string source{};
+    LemonVM::Arg expect{0};
+    LemonVM::Arg input{0};
+};
+using Workloads = std::vector<Workload>;
+
+/*A VM with the input of the workload on its stack*/
+LemonVM::VM workload_vm(const Workload& w) {
+    LemonVM::VM vm{};
+    vm.stack.push_back(w.input);
+    return vm;
+}
+
+/*Calls the recursive fib with the argument it finds on the stack*/
+constexpr char fib_source[] = "call fib\n"
+                              "exit\n"
+
+                              "label fib\n"
+                              "  store n\n"
+                              "  load n\n"
+                              "  put 2\n"
+                              "  cmp\n"
+                              "  put 1\n"
+                              "  eq\n"
+                              "  jmpif fib-base\n"
+                              "  load n\n"
+                              "  put 1\n"
+                              "  minus\n"
+                              "  call fib\n"
+                              "  load n\n"
+                              "  put 2\n"
+                              "  minus\n"
+                              "  call fib\n"
+                              "  plus\n"
+                              "  return\n"
+
+                              "label fib-base\n"
+                              "  load n\n"
+                              "  return\n";
+
+/*fib of a constant argument, for programs that start with an empty stack*/
+std::string fib_of(LemonVM::Arg n) {
+    return "put " + std::to_string(n) + "\n" + fib_source;
+}
+
+Workload workload_fib(LemonVM::Arg n, LemonVM::Arg expect) {
+    return {"fib", fib_source, expect, n};
+}
+
+Workload workload_loop(LemonVM::Arg n) {
+    const std::string source = "label loop\n"
+                               "  put 1\n"
+                               "  minus\n"
+                               "  duplast\n"
+                               "  jmpif loop\n"
+                               "exit\n";
+    return {"loop", source, 0, n};
+}
+
+Workload workload_variables(LemonVM::Arg n) {
+    const std::string source = "store i\n"
+                               "put 0\n"
+                               "store sum\n"
+                               "label loop\n"
+                               "  load sum\n"
+                               "  put 3\n"
+                               "  plus\n"
+                               "  store sum\n"
+                               "  load i\n"
+                               "  put 1\n"
+                               "  minus\n"
+                               "  store i\n"
+                               "  load i\n"
+                               "  jmpif loop\n"
+                               "load sum\n"
+                               "exit\n";
+    return {"variables", source, 3 * n, n};
+}
+
+Workload workload_calls(LemonVM::Arg n) {
+    const std::string source = "label loop\n"
+                               "  call dec\n"
+                               "  duplast\n"
+                               "  jmpif loop\n"
+                               "exit\n"
+
+                               "label dec\n"
+                               "  call one\n"
+                               "  minus\n"
+                               "  return\n"
+
+                               "label one\n"
+                               "  put 1\n"
+                               "  return\n";
+    return {"calls", source, 0, n};
+}
+
+/*Writes every value it counts down, only meant to be evaluated with an output*/
+Workload workload_write(LemonVM::Arg n) {
+    const std::string source = "label loop\n"
+                               "  duplast\n"
+                               "  write\n"
+                               "  subi 1\n"
+                               "  duplast\n"
+                               "  jmpif loop\n"
+                               "exit\n";
+    return {"write", source, 0, n};
+}
+
+/*A large program, mostly here to stress the front end*/
+Workload workload_generated(LemonVM::Arg functions, LemonVM::Arg n) {
+    std::string source = "label loop\n";
+    for (LemonVM::Arg i = 0; i < functions; i++)
+        source += "  call f" + std::to_string(i) + "\n";
+    source += "  put 1\n"
+              "  minus\n"
+              "  duplast\n"
+              "  jmpif loop\n"
+              "exit\n";
+    for (LemonVM::Arg i = 0; i < functions; i++) {
+        source += "label f" + std::to_string(i) + "\n"
+                  "  # generated function " + std::to_string(i) + "\n"
+                  "  duplast\n"
+                  "  addi " + std::to_string(i) + "\n"
+                  "  store x\n"
+                  "  load x\n"
+                  "  put 7\n"
+                  "  multiply\n"
+                  "  store y\n"
+                  "  return\n";
+    }
+    return {"generated", source, 0, n};
+}
+
+Workloads workloads_default(void) {
+    return {
+        workload_fib(25, 75025),
+        workload_loop(10000000),
+        workload_variables(2000000),
+        workload_calls(2000000),
+        workload_generated(5000, 100),
+    };
+}